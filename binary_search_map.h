@@ -0,0 +1,437 @@
+#ifndef BINARY_SEARCH_MAP_H_
+#define BINARY_SEARCH_MAP_H_
+
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+#include "binary_search_tree.h"
+
+// Map with unique keys on top of BinarySearchTree. Lookups and the
+// lookup-then-insert operations descend the tree once.
+template<class K, class V, class Compare = std::less<K>,
+    class Allocator = std::allocator<std::pair<const K, V>>>
+class BinarySearchMap {
+ public:
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = std::pair<const K, V>;
+  using key_compare = Compare;
+  using allocator_type = Allocator;
+
+ private:
+  // orders values by key, also compares values with bare keys
+  struct KeyCompare {
+    using is_transparent = void;
+
+    bool operator()(const value_type& lhs, const value_type& rhs) const;
+    bool operator()(const value_type& lhs, const K& rhs) const;
+    bool operator()(const K& lhs, const value_type& rhs) const;
+
+    [[no_unique_address]] Compare comp;
+  };
+
+  using Tree = BinarySearchTree<value_type, KeyCompare, Allocator>;
+  using TreeNode = typename Tree::TreeNode;
+
+ public:
+  using ConstIterator = typename Tree::ConstIterator;
+
+  class Iterator {
+    friend class BinarySearchMap;
+   public:
+    using difference_type = std::ptrdiff_t;
+    using value_type = BinarySearchMap::value_type;
+    using pointer = value_type*;
+    using reference = value_type&;
+    using iterator_category = std::bidirectional_iterator_tag;
+
+    value_type& operator*() const;
+
+    value_type* operator->() const;
+
+    Iterator& operator++();
+    Iterator operator++(int);
+
+    Iterator& operator--();
+    Iterator operator--(int);
+
+    bool operator==(Iterator rhs) const;
+    bool operator!=(Iterator rhs) const;
+
+    operator ConstIterator() const;
+
+   private:
+    explicit Iterator(ConstIterator iter);
+
+    ConstIterator iter_;
+  };
+
+  BinarySearchMap() = default;
+  explicit BinarySearchMap(const Compare& comp,
+                           const Allocator& allocator = Allocator());
+
+  BinarySearchMap(const std::initializer_list<value_type>& list,
+                  const Compare& comp = Compare(),
+                  const Allocator& allocator = Allocator());
+
+  int size() const;
+  bool empty() const;
+
+  bool contains(const K& key) const;
+  int count(const K& key) const;
+
+  Iterator find(const K& key);
+  ConstIterator find(const K& key) const;
+
+  V& at(const K& key);
+  const V& at(const K& key) const;
+
+  V& operator[](const K& key);
+  V& operator[](K&& key);
+
+  // inserts only if the key is absent, the second member tells which
+  std::pair<Iterator, bool> insert(const value_type& value);
+
+  // constructs the value from args only if the key is absent
+  template<class... Args>
+  std::pair<Iterator, bool> try_emplace(const K& key, Args&& ... args);
+  template<class... Args>
+  std::pair<Iterator, bool> try_emplace(K&& key, Args&& ... args);
+
+  // true in the second member if the value was inserted, not assigned
+  template<class M>
+  std::pair<Iterator, bool> insert_or_assign(const K& key, M&& mapped);
+  template<class M>
+  std::pair<Iterator, bool> insert_or_assign(K&& key, M&& mapped);
+
+  // returns the number of erased values
+  int erase(const K& key);
+  void erase(ConstIterator iter);
+
+  void clear();
+
+  Iterator begin();
+  Iterator end();
+  ConstIterator begin() const;
+  ConstIterator end() const;
+
+  bool operator==(const BinarySearchMap& rhs) const;
+  bool operator!=(const BinarySearchMap& rhs) const;
+
+ private:
+  template<class KeyArg, class... Args>
+  std::pair<Iterator, bool> TryEmplace(KeyArg&& key, Args&& ... args);
+
+  template<class KeyArg, class M>
+  std::pair<Iterator, bool> InsertOrAssign(KeyArg&& key, M&& mapped);
+
+  Iterator MakeIterator(TreeNode* node) const;
+
+  Tree tree_;
+};
+
+// definitions
+
+template<class K, class V, class Compare, class Allocator>
+bool BinarySearchMap<K, V, Compare, Allocator>::KeyCompare::operator()
+    (const value_type& lhs, const value_type& rhs) const {
+  return comp(lhs.first, rhs.first);
+}
+
+template<class K, class V, class Compare, class Allocator>
+bool BinarySearchMap<K, V, Compare, Allocator>::KeyCompare::operator()
+    (const value_type& lhs, const K& rhs) const {
+  return comp(lhs.first, rhs);
+}
+
+template<class K, class V, class Compare, class Allocator>
+bool BinarySearchMap<K, V, Compare, Allocator>::KeyCompare::operator()
+    (const K& lhs, const value_type& rhs) const {
+  return comp(lhs, rhs.first);
+}
+
+template<class K, class V, class Compare, class Allocator>
+BinarySearchMap<K, V, Compare, Allocator>::BinarySearchMap
+    (const Compare& comp, const Allocator& allocator) :
+    tree_(KeyCompare{comp}, allocator) {}
+
+template<class K, class V, class Compare, class Allocator>
+BinarySearchMap<K, V, Compare, Allocator>::BinarySearchMap
+    (const std::initializer_list<value_type>& list, const Compare& comp,
+     const Allocator& allocator) :
+    tree_(KeyCompare{comp}, allocator) {
+  for (const auto& value : list) {
+    insert(value);
+  }
+}
+
+template<class K, class V, class Compare, class Allocator>
+int BinarySearchMap<K, V, Compare, Allocator>::size() const {
+  return tree_.size();
+}
+
+template<class K, class V, class Compare, class Allocator>
+bool BinarySearchMap<K, V, Compare, Allocator>::empty() const {
+  return tree_.empty();
+}
+
+template<class K, class V, class Compare, class Allocator>
+bool BinarySearchMap<K, V, Compare, Allocator>::contains(const K& key) const {
+  return tree_.contains(key);
+}
+
+template<class K, class V, class Compare, class Allocator>
+int BinarySearchMap<K, V, Compare, Allocator>::count(const K& key) const {
+  return tree_.contains(key) ? 1 : 0;
+}
+
+template<class K, class V, class Compare, class Allocator>
+typename BinarySearchMap<K, V, Compare, Allocator>::Iterator
+BinarySearchMap<K, V, Compare, Allocator>::find(const K& key) {
+  return Iterator(tree_.find(key));
+}
+
+template<class K, class V, class Compare, class Allocator>
+typename BinarySearchMap<K, V, Compare, Allocator>::ConstIterator
+BinarySearchMap<K, V, Compare, Allocator>::find(const K& key) const {
+  return tree_.find(key);
+}
+
+template<class K, class V, class Compare, class Allocator>
+V& BinarySearchMap<K, V, Compare, Allocator>::at(const K& key) {
+  TreeNode* node = tree_.FindNode(key);
+  if (node == nullptr) {
+    throw std::out_of_range("BinarySearchMap::at: no such key");
+  }
+  return node->value.second;
+}
+
+template<class K, class V, class Compare, class Allocator>
+const V& BinarySearchMap<K, V, Compare, Allocator>::at(const K& key) const {
+  const TreeNode* node = tree_.FindNode(key);
+  if (node == nullptr) {
+    throw std::out_of_range("BinarySearchMap::at: no such key");
+  }
+  return node->value.second;
+}
+
+template<class K, class V, class Compare, class Allocator>
+V& BinarySearchMap<K, V, Compare, Allocator>::operator[](const K& key) {
+  return TryEmplace(key).first->second;
+}
+
+template<class K, class V, class Compare, class Allocator>
+V& BinarySearchMap<K, V, Compare, Allocator>::operator[](K&& key) {
+  return TryEmplace(std::move(key)).first->second;
+}
+
+template<class K, class V, class Compare, class Allocator>
+std::pair<typename BinarySearchMap<K, V, Compare, Allocator>::Iterator, bool>
+BinarySearchMap<K, V, Compare, Allocator>::insert(const value_type& value) {
+  return TryEmplace(value.first, value.second);
+}
+
+template<class K, class V, class Compare, class Allocator>
+template<class... Args>
+std::pair<typename BinarySearchMap<K, V, Compare, Allocator>::Iterator, bool>
+BinarySearchMap<K, V, Compare, Allocator>::try_emplace
+    (const K& key, Args&& ... args) {
+  return TryEmplace(key, std::forward<Args>(args)...);
+}
+
+template<class K, class V, class Compare, class Allocator>
+template<class... Args>
+std::pair<typename BinarySearchMap<K, V, Compare, Allocator>::Iterator, bool>
+BinarySearchMap<K, V, Compare, Allocator>::try_emplace
+    (K&& key, Args&& ... args) {
+  return TryEmplace(std::move(key), std::forward<Args>(args)...);
+}
+
+template<class K, class V, class Compare, class Allocator>
+template<class M>
+std::pair<typename BinarySearchMap<K, V, Compare, Allocator>::Iterator, bool>
+BinarySearchMap<K, V, Compare, Allocator>::insert_or_assign
+    (const K& key, M&& mapped) {
+  return InsertOrAssign(key, std::forward<M>(mapped));
+}
+
+template<class K, class V, class Compare, class Allocator>
+template<class M>
+std::pair<typename BinarySearchMap<K, V, Compare, Allocator>::Iterator, bool>
+BinarySearchMap<K, V, Compare, Allocator>::insert_or_assign
+    (K&& key, M&& mapped) {
+  return InsertOrAssign(std::move(key), std::forward<M>(mapped));
+}
+
+template<class K, class V, class Compare, class Allocator>
+int BinarySearchMap<K, V, Compare, Allocator>::erase(const K& key) {
+  auto it = tree_.find(key);
+  if (it == tree_.end()) {
+    return 0;
+  }
+  tree_.erase(it);
+  return 1;
+}
+
+template<class K, class V, class Compare, class Allocator>
+void BinarySearchMap<K, V, Compare, Allocator>::erase(ConstIterator iter) {
+  tree_.erase(iter);
+}
+
+template<class K, class V, class Compare, class Allocator>
+void BinarySearchMap<K, V, Compare, Allocator>::clear() {
+  tree_.clear();
+}
+
+template<class K, class V, class Compare, class Allocator>
+typename BinarySearchMap<K, V, Compare, Allocator>::Iterator
+BinarySearchMap<K, V, Compare, Allocator>::begin() {
+  return Iterator(tree_.begin());
+}
+
+template<class K, class V, class Compare, class Allocator>
+typename BinarySearchMap<K, V, Compare, Allocator>::Iterator
+BinarySearchMap<K, V, Compare, Allocator>::end() {
+  return Iterator(tree_.end());
+}
+
+template<class K, class V, class Compare, class Allocator>
+typename BinarySearchMap<K, V, Compare, Allocator>::ConstIterator
+BinarySearchMap<K, V, Compare, Allocator>::begin() const {
+  return tree_.begin();
+}
+
+template<class K, class V, class Compare, class Allocator>
+typename BinarySearchMap<K, V, Compare, Allocator>::ConstIterator
+BinarySearchMap<K, V, Compare, Allocator>::end() const {
+  return tree_.end();
+}
+
+template<class K, class V, class Compare, class Allocator>
+bool BinarySearchMap<K, V, Compare, Allocator>::operator==
+    (const BinarySearchMap& rhs) const {
+  return tree_ == rhs.tree_;
+}
+
+template<class K, class V, class Compare, class Allocator>
+bool BinarySearchMap<K, V, Compare, Allocator>::operator!=
+    (const BinarySearchMap& rhs) const {
+  return !(*this == rhs);
+}
+
+template<class K, class V, class Compare, class Allocator>
+template<class KeyArg, class... Args>
+std::pair<typename BinarySearchMap<K, V, Compare, Allocator>::Iterator, bool>
+BinarySearchMap<K, V, Compare, Allocator>::TryEmplace
+    (KeyArg&& key, Args&& ... args) {
+  auto position = tree_.FindUniquePosition(key);
+  if (position.equal_node != nullptr) {
+    return {MakeIterator(position.equal_node), false};
+  }
+
+  TreeNode* node = tree_.CreateNode(
+      std::piecewise_construct,
+      std::forward_as_tuple(std::forward<KeyArg>(key)),
+      std::forward_as_tuple(std::forward<Args>(args)...));
+  tree_.LinkNode(node, position.parent, position.is_left_child);
+  return {MakeIterator(node), true};
+}
+
+template<class K, class V, class Compare, class Allocator>
+template<class KeyArg, class M>
+std::pair<typename BinarySearchMap<K, V, Compare, Allocator>::Iterator, bool>
+BinarySearchMap<K, V, Compare, Allocator>::InsertOrAssign
+    (KeyArg&& key, M&& mapped) {
+  auto position = tree_.FindUniquePosition(key);
+  if (position.equal_node != nullptr) {
+    position.equal_node->value.second = std::forward<M>(mapped);
+    return {MakeIterator(position.equal_node), false};
+  }
+
+  TreeNode* node = tree_.CreateNode(std::forward<KeyArg>(key),
+                                    std::forward<M>(mapped));
+  tree_.LinkNode(node, position.parent, position.is_left_child);
+  return {MakeIterator(node), true};
+}
+
+template<class K, class V, class Compare, class Allocator>
+typename BinarySearchMap<K, V, Compare, Allocator>::Iterator
+BinarySearchMap<K, V, Compare, Allocator>::MakeIterator(TreeNode* node) const {
+  return Iterator(tree_.MakeIterator(node));
+}
+
+// Iterator
+
+template<class K, class V, class Compare, class Allocator>
+BinarySearchMap<K, V, Compare, Allocator>::Iterator::Iterator
+    (ConstIterator iter) :
+    iter_(iter) {}
+
+template<class K, class V, class Compare, class Allocator>
+typename BinarySearchMap<K, V, Compare, Allocator>::value_type&
+BinarySearchMap<K, V, Compare, Allocator>::Iterator::operator*() const {
+  // the key stays const, so the order of the tree can not be broken
+  return Tree::NodeOf(iter_)->value;
+}
+
+template<class K, class V, class Compare, class Allocator>
+typename BinarySearchMap<K, V, Compare, Allocator>::value_type*
+BinarySearchMap<K, V, Compare, Allocator>::Iterator::operator->() const {
+  return &(Tree::NodeOf(iter_)->value);
+}
+
+template<class K, class V, class Compare, class Allocator>
+typename BinarySearchMap<K, V, Compare, Allocator>::Iterator&
+BinarySearchMap<K, V, Compare, Allocator>::Iterator::operator++() {
+  ++iter_;
+  return *this;
+}
+
+template<class K, class V, class Compare, class Allocator>
+typename BinarySearchMap<K, V, Compare, Allocator>::Iterator
+BinarySearchMap<K, V, Compare, Allocator>::Iterator::operator++(int) {
+  auto copy = *this;
+  ++(*this);
+  return copy;
+}
+
+template<class K, class V, class Compare, class Allocator>
+typename BinarySearchMap<K, V, Compare, Allocator>::Iterator&
+BinarySearchMap<K, V, Compare, Allocator>::Iterator::operator--() {
+  --iter_;
+  return *this;
+}
+
+template<class K, class V, class Compare, class Allocator>
+typename BinarySearchMap<K, V, Compare, Allocator>::Iterator
+BinarySearchMap<K, V, Compare, Allocator>::Iterator::operator--(int) {
+  auto copy = *this;
+  --(*this);
+  return copy;
+}
+
+template<class K, class V, class Compare, class Allocator>
+bool BinarySearchMap<K, V, Compare, Allocator>::Iterator::operator==
+    (Iterator rhs) const {
+  return iter_ == rhs.iter_;
+}
+
+template<class K, class V, class Compare, class Allocator>
+bool BinarySearchMap<K, V, Compare, Allocator>::Iterator::operator!=
+    (Iterator rhs) const {
+  return !(*this == rhs);
+}
+
+template<class K, class V, class Compare, class Allocator>
+BinarySearchMap<K, V, Compare, Allocator>::Iterator::operator ConstIterator()
+    const {
+  return iter_;
+}
+
+// -Iterator
+
+#endif  // BINARY_SEARCH_MAP_H_
@@ -1,34 +1,214 @@
 #ifndef BINARY_SEARCH_TREE_H_
 #define BINARY_SEARCH_TREE_H_
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
 #include <initializer_list>
+#include <istream>
 #include <iterator>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+// Balancing policies. AvlBalancing keeps the height within 1.44 * log2(n),
+// NoBalancing is a plain binary search tree.
+struct AvlBalancing {};
+struct NoBalancing {};
+
+// Augmentations kept up to date in every node. OrderStatistics stores
+// subtree sizes for rank(), select() and O(log n) count(). MerkleHash
+// stores a digest of the values of every subtree for digest(), diff() and
+// an O(1) answer from operator== for most unequal trees, T needs std::hash.
+struct NoAugmentation {};
+struct OrderStatistics {};
+struct MerkleHash {};
+
+// Policy parameter of BinarySearchTree. A bare balancing policy means
+// TreePolicy<Balancing, NoAugmentation>.
+template<class Balancing = AvlBalancing, class Augmentation = NoAugmentation>
+struct TreePolicy {
+  using balancing = Balancing;
+  using augmentation = Augmentation;
+};
+
+template<class Policy>
+struct TreePolicyTraits {
+  using balancing = Policy;
+  using augmentation = NoAugmentation;
+};
+
+template<class Balancing, class Augmentation>
+struct TreePolicyTraits<TreePolicy<Balancing, Augmentation>> {
+  using balancing = Balancing;
+  using augmentation = Augmentation;
+};
+
+// Opt-in parallel copy and clear. The work is split across subtrees near
+// the root, so balanced trees profit the most. Allocators that are not
+// always equal may keep unsynchronized state, with them the work stays on
+// the calling thread.
+struct ParallelExecution {
+  unsigned threads = std::thread::hardware_concurrency();
+};
+
+// Hot path counters, compiled in only if BINARY_SEARCH_TREE_ENABLE_COUNTERS
+// is defined before the first include. They cost a relaxed atomic add per
+// event then and nothing otherwise.
+#ifdef BINARY_SEARCH_TREE_ENABLE_COUNTERS
+inline constexpr bool kBinarySearchTreeCounters = true;
+#else
+inline constexpr bool kBinarySearchTreeCounters = false;
+#endif
+
+struct BinarySearchTreeCounters {
+  // descents by key: find, contains, bounds, erase and extract by value
+  std::uint64_t finds = 0;
+  std::uint64_t find_comparisons = 0;
+  // descents that place a new value, hinted ones included
+  std::uint64_t inserts = 0;
+  std::uint64_t insert_comparisons = 0;
+  // ConstIterator increments and decrements, and the parent links they
+  // climbed
+  std::uint64_t iterator_steps = 0;
+  std::uint64_t parent_climbs = 0;
+  std::uint64_t allocations = 0;
+  std::uint64_t frees = 0;
+};
+
+// Shape of a tree, see BinarySearchTree::stats().
+struct BinarySearchTreeStats {
+  int node_count = 0;
+  // the root is at depth 1, so height is the largest depth
+  int height = 0;
+  double average_depth = 0;
+  std::size_t node_bytes = 0;
+  // bytes the allocator holds for the tree: all slabs of a PoolAllocator,
+  // with their free blocks and unused space, and node_count * node_bytes
+  // for allocators that are asked for each node on its own
+  std::size_t bytes_allocated = 0;
+  // duplicate_runs[i] runs of equivalent values have a length in
+  // [2^i, 2^(i + 1)), values without duplicates count in duplicate_runs[0]
+  std::vector<int> duplicate_runs;
+  // all zero unless counters are compiled in
+  BinarySearchTreeCounters counters;
+};
+
+// Header of the format written by BinarySearchTree::serialize(), count
+// values follow in sorted order, byte for byte. Values keep the byte order
+// of the machine that wrote them. The header keeps values aligned to up to
+// 32 bytes in a mapping, see mapped_binary_search_tree.h.
+struct SerializedTreeHeader {
+  static constexpr std::uint64_t kMagic = 0x3145455254534231;  // "1BSTREE1"
+
+  std::uint64_t magic = kMagic;
+  std::uint32_t value_size = 0;
+  std::uint32_t value_alignment = 0;
+  std::uint64_t count = 0;
+  std::uint64_t reserved = 0;
+};
+
+// Result of BinarySearchTree::diff(), both sorted.
 template<class T>
+struct BinarySearchTreeDiff {
+  // in the other tree only
+  std::vector<T> added;
+  // in this tree only
+  std::vector<T> removed;
+};
+
+// Compare::is_transparent enables lookup by any key the comparator accepts
+template<class Compare>
+concept TransparentCompare = requires { typename Compare::is_transparent; };
+
+template<class K, class V, class Compare, class Allocator>
+class BinarySearchMap;
+
+template<class T, class Compare>
+class FrozenBinarySearchTree;
+
+// Values a, b are equivalent if !comp(a, b) && !comp(b, a).
+// Allocator is rebound to the internal node type, see node_pool.h for
+// a slab allocator that recycles freed nodes.
+template<class T, class Compare = std::less<T>,
+    class Allocator = std::allocator<T>, class Policy = AvlBalancing>
 class BinarySearchTree {
+  template<class K, class V, class C, class A>
+  friend class BinarySearchMap;
+
  private:
   struct TreeNode;
 
  public:
-  BinarySearchTree() = default;
+  using value_compare = Compare;
+  using allocator_type = Allocator;
 
-  BinarySearchTree(const std::initializer_list<T>& list);
+  BinarySearchTree() = default;
+  explicit BinarySearchTree(const Compare& comp,
+                            const Allocator& allocator = Allocator());
+  explicit BinarySearchTree(const Allocator& allocator);
+
+  BinarySearchTree(const std::initializer_list<T>& list,
+                   const Compare& comp = Compare(),
+                   const Allocator& allocator = Allocator());
+
+  // O(n) and perfectly balanced if the input is sorted, O(n log n) otherwise
+  template<std::input_iterator InputIt>
+  BinarySearchTree(InputIt first, InputIt last,
+                   const Compare& comp = Compare(),
+                   const Allocator& allocator = Allocator());
+
+  // [first, last) must be sorted, builds a perfectly balanced tree in O(n)
+  template<std::input_iterator InputIt>
+  static BinarySearchTree from_sorted(InputIt first, InputIt last,
+                                      const Compare& comp = Compare(),
+                                      const Allocator& allocator = Allocator());
 
   BinarySearchTree(const BinarySearchTree& rhs);
+  BinarySearchTree(const BinarySearchTree& rhs, ParallelExecution execution);
   BinarySearchTree(BinarySearchTree&& rhs) noexcept;
 
   ~BinarySearchTree();
 
   BinarySearchTree& operator=(const BinarySearchTree& rhs);
-  BinarySearchTree& operator=(BinarySearchTree&& rhs) noexcept;
+  BinarySearchTree& operator=(BinarySearchTree&& rhs)
+      noexcept(kMoveAssignSteals);
+
+  value_compare value_comp() const;
+  allocator_type get_allocator() const;
 
   int size() const;
   bool empty() const;
 
+  // height of the empty tree is 0
+  int height() const;
+
   bool contains(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  bool contains(const K& key) const;
+
+  // results[i] = contains(values[i]), several descents run interleaved so
+  // that their cache misses overlap
+  void contains_many(std::span<const T> values,
+                     std::span<bool> results) const;
 
   int count(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  int count(const K& key) const;
 
   template<class... Args>
   void emplace(Args&& ... args);
@@ -37,13 +217,45 @@ class BinarySearchTree {
   void insert(U&& value);
 
   void erase(const T& value);
+  template<class K> requires TransparentCompare<Compare>
+  void erase(const K& key);
 
   void clear();
+  void clear(ParallelExecution execution);
 
   std::vector<T> to_vector() const;
 
-  bool operator==(const BinarySearchTree<T>& rhs) const;
-  bool operator!=(const BinarySearchTree<T>& rhs) const;
+  // write the values in sorted order to out, return the end of the output
+  template<class OutputIt>
+  OutputIt copy_to(OutputIt out) const;
+
+  // move the values in sorted order to out and free their nodes on the
+  // way, the tree is empty afterwards
+  template<class OutputIt>
+  OutputIt drain(OutputIt out);
+
+  // immutable flat copy for fast lookups, see frozen_binary_search_tree.h
+  FrozenBinarySearchTree<T, Compare> freeze() const;
+
+  bool operator==(const BinarySearchTree& rhs) const;
+  bool operator!=(const BinarySearchTree& rhs) const;
+
+  // Binary snapshot for a warm start, only for trivially copyable T.
+  // serialize() reports errors in the stream state, deserialize() throws
+  // std::runtime_error for a failed read or a file of another type.
+
+  void serialize(std::ostream& out) const;
+
+  // O(n), the values are checked to be sorted and linked into a perfectly
+  // balanced tree
+  static BinarySearchTree deserialize(std::istream& in,
+                                      const Compare& comp = Compare(),
+                                      const Allocator& allocator = Allocator());
+
+  // walks the whole tree, O(n). Counters run from construction or the last
+  // reset_counters(), copies start from zero.
+  BinarySearchTreeStats stats() const;
+  void reset_counters();
 
   class ConstIterator : std::iterator<std::bidirectional_iterator_tag, T> {
     friend class BinarySearchTree;
@@ -68,26 +280,310 @@ class BinarySearchTree {
     bool operator!=(ConstIterator rhs) const;
 
    private:
-    ConstIterator(TreeNode* tree_node, const BinarySearchTree<T>* owner);
+    ConstIterator(TreeNode* tree_node, const BinarySearchTree* owner);
 
     TreeNode* tree_node_;
-    const BinarySearchTree<T>* owner_;
+    const BinarySearchTree* owner_;
   };
   ConstIterator begin() const;
 
   ConstIterator end() const;
 
   ConstIterator find(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator find(const K& key) const;
+
+  // first value that is not less than value
+  ConstIterator lower_bound(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator lower_bound(const K& key) const;
+
+  // first value that is greater than value
+  ConstIterator upper_bound(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator upper_bound(const K& key) const;
+
+  std::pair<ConstIterator, ConstIterator> equal_range(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  std::pair<ConstIterator, ConstIterator> equal_range(const K& key) const;
 
   void erase(ConstIterator iter);
 
+  // erase [first, last) in O(log n) plus the number of erased values, whole
+  // subtrees inside the span are unlinked and freed in one pass
+  ConstIterator erase(ConstIterator first, ConstIterator last);
+
+  // erase the values in [lo, hi), return how many were erased
+  int erase_range(const T& lo, const T& hi);
+  template<class K> requires TransparentCompare<Compare>
+  int erase_range(const K& lo, const K& hi);
+
+  // call f on every value in [lo, hi) in sorted order
+  template<class F>
+  void for_each_in_range(const T& lo, const T& hi, F f) const;
+  template<class K, class F> requires TransparentCompare<Compare>
+  void for_each_in_range(const K& lo, const K& hi, F f) const;
+
+  // set semantics: insert only if no equivalent value is present.
+  // One descent, and no node is allocated if the value is already there.
+  template<class U>
+  std::pair<ConstIterator, bool> insert_unique(U&& value);
+
+  template<class... Args>
+  std::pair<ConstIterator, bool> emplace_unique(Args&& ... args);
+
+  // insert right before hint if the value belongs there, which skips the
+  // descent from the root, and like emplace() otherwise
+  template<class... Args>
+  ConstIterator emplace_hint(ConstIterator hint, Args&& ... args);
+
+  // Owns a node taken out of a tree by extract(). insert() links it into a
+  // tree again without allocating, the value may be changed in between.
+  class NodeHandle {
+    friend class BinarySearchTree;
+   public:
+    NodeHandle() = default;
+    NodeHandle(NodeHandle&& rhs) noexcept;
+    NodeHandle& operator=(NodeHandle&& rhs) noexcept;
+
+    ~NodeHandle();
+
+    bool empty() const;
+    explicit operator bool() const;
+
+    T& value() const;
+    allocator_type get_allocator() const;
+
+   private:
+    NodeHandle(TreeNode* tree_node, const Allocator& allocator);
+
+    void Reset();
+
+    TreeNode* tree_node_ = nullptr;
+    std::optional<Allocator> allocator_;
+  };
+  using node_type = NodeHandle;
+
+  // unlink the node of iter and hand it over, nothing is freed
+  node_type extract(ConstIterator iter);
+  // a value equivalent to value, an empty handle if there is none
+  node_type extract(const T& value);
+  template<class K> requires TransparentCompare<Compare>
+  node_type extract(const K& key);
+
+  // link the node of a handle, end() for an empty handle. The allocator of
+  // the tree the node comes from must compare equal to this one.
+  ConstIterator insert(node_type&& node);
+
+  // Set algebra on detached subtrees, split by key and joined back. With a
+  // tree of m values it costs O(m log(n / m + 1)) plus the equivalent
+  // values found in both. Multiplicities follow std::set_union,
+  // std::set_intersection and std::set_difference, kept values come from
+  // this tree first. Nodes of an rvalue tree are reused and it is left
+  // empty. Need AvlBalancing.
+
+  // move the values of other here, equivalent values add up
+  void merge(BinarySearchTree&& other);
+
+  void union_with(const BinarySearchTree& other);
+  void union_with(BinarySearchTree&& other);
+
+  void intersect_with(const BinarySearchTree& other);
+  void intersect_with(BinarySearchTree&& other);
+
+  void difference_with(const BinarySearchTree& other);
+  void difference_with(BinarySearchTree&& other);
+
+  // move the values not less than key to the returned tree, O(log n) plus
+  // the size of the returned tree unless OrderStatistics keeps sizes
+  BinarySearchTree split(const T& key);
+  template<class K> requires TransparentCompare<Compare>
+  BinarySearchTree split(const K& key);
+
+  // Order statistics, O(log n) each. Need TreePolicy<..., OrderStatistics>.
+
+  // k-th smallest value counting from 0, end() if there is no such value
+  ConstIterator select(int k) const;
+
+  // number of values less than value
+  int rank(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  int rank(const K& key) const;
+
+  // position of iter in sorted order, size() for end()
+  int index_of(ConstIterator iter) const;
+
+  int distance(ConstIterator first, ConstIterator last) const;
+  void advance(ConstIterator& iter, int n) const;
+
+  // Digests, need TreePolicy<..., MerkleHash>.
+
+  // equal for trees of equal values whatever their shape, so replicas can
+  // compare 8 bytes instead of their values, O(1)
+  std::uint64_t digest() const;
+
+  // the values that turn this tree into other, found by descending only
+  // into ranges whose digests differ, O(d log^2 n) for d differences.
+  // Needs AvlBalancing.
+  BinarySearchTreeDiff<T> diff(const BinarySearchTree& other) const;
+
  private:
+  using Balancing = typename TreePolicyTraits<Policy>::balancing;
+  using Augmentation = typename TreePolicyTraits<Policy>::augmentation;
+
+  static constexpr bool kIsAvl = std::is_same_v<Balancing, AvlBalancing>;
+  static_assert(kIsAvl || std::is_same_v<Balancing, NoBalancing>,
+                "unknown balancing policy");
+
+  static constexpr bool kOrderStatistics =
+      std::is_same_v<Augmentation, OrderStatistics>;
+  static constexpr bool kMerkleHash = std::is_same_v<Augmentation, MerkleHash>;
+  static_assert(kOrderStatistics || kMerkleHash
+                    || std::is_same_v<Augmentation, NoAugmentation>,
+                "unknown augmentation");
+  static constexpr bool kIsAugmented = kOrderStatistics || kMerkleHash;
+
+  static constexpr std::size_t kLookupBatchSize = 8;
+
+  static constexpr bool kCounters = kBinarySearchTreeCounters;
+
+  // an AVL tree of up to INT_MAX nodes is less than 46 levels high
+  static constexpr int kMaxAvlHeight = 48;
+
+  using NodeAllocator = typename std::allocator_traits<Allocator>::
+      template rebind_alloc<TreeNode>;
+  using NodeAllocatorTraits = std::allocator_traits<NodeAllocator>;
+
+  // move assignment may take rhs nodes instead of moving values one by one
+  static constexpr bool kMoveAssignSteals =
+      NodeAllocatorTraits::propagate_on_container_move_assignment::value
+          || NodeAllocatorTraits::is_always_equal::value;
+
+  // relaxed atomics, const lookups may count from several threads
+  struct AtomicCounters {
+    AtomicCounters() = default;
+    AtomicCounters(const AtomicCounters&) {}
+    AtomicCounters& operator=(const AtomicCounters&) { return *this; }
+
+    std::atomic<std::uint64_t> finds = 0;
+    std::atomic<std::uint64_t> find_comparisons = 0;
+    std::atomic<std::uint64_t> inserts = 0;
+    std::atomic<std::uint64_t> insert_comparisons = 0;
+    std::atomic<std::uint64_t> iterator_steps = 0;
+    std::atomic<std::uint64_t> parent_climbs = 0;
+    std::atomic<std::uint64_t> allocations = 0;
+    std::atomic<std::uint64_t> frees = 0;
+  };
+  struct NoCounters {};
+  using Counters = std::conditional_t<kCounters, AtomicCounters, NoCounters>;
+  using Counter = std::atomic<std::uint64_t> AtomicCounters::*;
+
+  // add n to counter if counters are compiled in
+  void Count(Counter counter, std::uint64_t n = 1) const;
+
+  // comp_(lhs, rhs), counted in counter
+  template<class A, class B>
+  bool CountedLess(const A& lhs, const B& rhs, Counter counter) const;
+
   void FindFirstNode();
   void FindLastNode();
 
-  int CalcCount(const TreeNode* node, const T& value) const;
+  template<class K>
+  TreeNode* FindNode(const K& key) const;
+
+  template<class K>
+  TreeNode* LowerBoundNode(const K& key) const;
+  template<class K>
+  TreeNode* UpperBoundNode(const K& key) const;
+
+  template<class K>
+  int CalcCount(const K& key) const;
+
+  template<class K>
+  int EraseRange(const K& lo, const K& hi);
+
+  template<class K, class F>
+  void ForEachInRange(const K& lo, const K& hi, F& f) const;
+
+  // call f on every node in sorted order, without climbing parent links
+  // where the height allows a stack
+  template<class F>
+  void ForEachNode(F f) const;
+
+  // number of values less than key, or not greater than key if inclusive
+  template<class K>
+  int CalcRank(const K& key, bool inclusive) const;
+
+  // digest of the values less than key, or not greater than key if
+  // inclusive
+  std::uint64_t HashBelow(const T& key, bool inclusive) const;
+  // digest of the values between low and high, exclusive, nullptr leaves a
+  // side open
+  std::uint64_t HashBetween(const T* low, const T* high) const;
+  // the highest node with a value between low and high, exclusive
+  const TreeNode* RootBetween(const T* low, const T* high) const;
+
+  void DiffBetween(const BinarySearchTree& other, const T* low,
+                   const T* high, BinarySearchTreeDiff<T>* diff) const;
+  void DiffEquivalent(const BinarySearchTree& other, const T& key,
+                      BinarySearchTreeDiff<T>* diff) const;
+
+  // where a value equivalent to key goes if the tree keeps keys unique
+  struct UniquePosition {
+    TreeNode* parent = nullptr;
+    bool is_left_child = false;
+    // not nullptr if an equivalent value is already in the tree
+    TreeNode* equal_node = nullptr;
+  };
+
+  template<class K>
+  UniquePosition FindUniquePosition(const K& key) const;
+
+  // attach a detached node as the given child of parent and rebalance
+  void LinkNode(TreeNode* node, TreeNode* parent, bool is_left_child);
+
+  // descend to the place of a detached node and link it there, values past
+  // either end are linked to first_node_ or last_node_ without a descent
+  void InsertNode(TreeNode* node);
+
+  enum class SetOperation { kMerge, kUnion, kIntersection, kDifference };
+
+  void CombineWith(BinarySearchTree&& other, SetOperation operation);
+
+  template<class K>
+  BinarySearchTree SplitOff(const K& key);
+
+  // fill an empty tree, check_sorted falls back to inserting one by one
+  template<class InputIt>
+  void BuildFromRange(InputIt first, InputIt last, bool check_sorted);
+
+  // return the root of a perfectly balanced tree of the sorted nodes
+  TreeNode* BuildBalanced(TreeNode* const* nodes, int count,
+                          TreeNode* parent);
+
+  ConstIterator MakeIterator(TreeNode* node) const;
+  static TreeNode* NodeOf(ConstIterator iter);
+
+  struct NoBalanceData {};
+  struct AvlBalanceData {
+    int height = 1;
+  };
+  using BalanceData =
+      std::conditional_t<kIsAvl, AvlBalanceData, NoBalanceData>;
+
+  struct NoAugmentData {};
+  struct SizeAugmentData {
+    int subtree_size = 1;
+  };
+  // sum of HashValue() over the subtree, a sum so that any shape of the
+  // same values agrees and a range of values sums O(log n) subtrees
+  struct HashAugmentData {
+    std::uint64_t subtree_hash = 0;
+  };
+  using AugmentData = std::conditional_t<kOrderStatistics, SizeAugmentData,
+      std::conditional_t<kMerkleHash, HashAugmentData, NoAugmentData>>;
 
-  struct TreeNode {
+  struct TreeNode : BalanceData, AugmentData {
     template<class... Args>
     explicit TreeNode(Args&& ... args);
 
@@ -97,112 +593,399 @@ class BinarySearchTree {
     TreeNode* right = nullptr;
   };
 
+  template<class... Args>
+  TreeNode* CreateNode(Args&& ... args);
+  void DestroyNode(TreeNode* node);
+
+  // copy the balance and augmentation data, not the links
+  static void CopyNodeData(TreeNode* to, const TreeNode& from);
+
+  // Copy and delete walk the parent links, so they need no stack and work
+  // for trees of any depth.
+
   // return pointer to copied node
   TreeNode* CopyTree(const TreeNode& node_to_copy);
 
-  void DeleteTree(TreeNode* node);
+  // return the number of deleted nodes
+  int DeleteTree(TreeNode* node);
+
+  TreeNode* CopyTreeParallel(const TreeNode& node_to_copy, unsigned threads);
+  void DeleteTreeParallel(TreeNode* node, unsigned threads);
+
+  // subtrees this many levels below the root are handed out as tasks
+  static int ParallelSplitDepth(unsigned threads);
+
+  // call task(i) for every i in [0, task_count) on up to threads threads
+  template<class Task>
+  static void RunInParallel(std::size_t task_count, unsigned threads,
+                            Task task);
+
+  // free every node at once if the allocator owns an arena nobody else uses
+  bool ReleaseArena();
 
   // pointers in node do not change
   void Detach(TreeNode* node);
 
-  void DetachBothNull(TreeNode* node);
-  void DetachRightNull(TreeNode* node);
-  void DetachLeftNull(TreeNode* node);
-  void DetachNeitherNull(TreeNode* node);
+  // return the lowest node whose subtree lost a node, nullptr if none
+  TreeNode* DetachBothNull(TreeNode* node);
+  TreeNode* DetachRightNull(TreeNode* node);
+  TreeNode* DetachLeftNull(TreeNode* node);
+  TreeNode* DetachNeitherNull(TreeNode* node);
 
   TreeNode** FindPointerToPointerToChild(TreeNode* parent,
                                          TreeNode* child) const;
   // Do not change new_child, old_child
   void ChangeChild(TreeNode* parent, TreeNode* old_child, TreeNode* new_child);
 
+  // restore the balance on the way from node to root_
+  void Rebalance(TreeNode* node);
+
+  // return the new root if the walk reached it, nullptr if it stopped early
+  TreeNode* RebalanceUpwards(TreeNode* node);
+
+  // return the node that took the place of node
+  TreeNode* RotateLeft(TreeNode* node);
+  TreeNode* RotateRight(TreeNode* node);
+
+  // Split and join work on detached subtrees, a subtree root has no parent.
+
+  // return the root of left + mid + right, mid is a single detached node
+  TreeNode* Join(TreeNode* left, TreeNode* mid, TreeNode* right);
+  TreeNode* Join(TreeNode* left, TreeNode* right);
+
+  // split the subtree holding node into the part before node and the rest
+  void Split(TreeNode* node, TreeNode** before, TreeNode** rest);
+
+  // split the subtree at root into the values less than key and the rest,
+  // or not greater than key and the rest if inclusive
+  template<class K>
+  void SplitByKey(TreeNode* root, const K& key, bool inclusive,
+                  TreeNode** before, TreeNode** rest);
+
+  // split into the values less than, equivalent to and greater than key
+  template<class K>
+  void SplitEquivalent(TreeNode* root, const K& key, TreeNode** less,
+                       TreeNode** equal, TreeNode** greater);
+
+  // the same at the value of root, which only unlinks root unless its
+  // neighbours are equivalent to it
+  void SplitAtRoot(TreeNode* root, TreeNode** less, TreeNode** equal,
+                   TreeNode** greater);
+
+  // take the first node out, return the new subtree root
+  TreeNode* PopFirst(TreeNode* root, TreeNode** first);
+
+  // return the root of the combined subtrees, freed nodes are added to
+  // *destroyed
+  TreeNode* Combine(TreeNode* ours, TreeNode* theirs, SetOperation operation,
+                    int* destroyed);
+  // the same for two subtrees of equivalent values
+  TreeNode* CombineEquivalent(TreeNode* ours, TreeNode* theirs,
+                              SetOperation operation, int* destroyed);
+
+  TreeNode* DestroyFirst(TreeNode* root, int count, int* destroyed);
+
+  static int CountNodes(const TreeNode* root);
+
+  static void AttachChildren(TreeNode* node, TreeNode* left,
+                             TreeNode* right);
+  static TreeNode* Orphan(TreeNode* node);
+
+  // rebalance from node up to the subtree root, return the new subtree root
+  TreeNode* RebalanceSubtree(TreeNode* node, TreeNode* root);
+
+  static int Height(const TreeNode* node);
+  static int Size(const TreeNode* node);
+  static std::uint64_t SubtreeHash(const TreeNode* node);
+  static std::uint64_t HashValue(const T& value);
+  static void UpdateNode(TreeNode* node);
+
+  [[no_unique_address]] Compare comp_;
+  [[no_unique_address]] NodeAllocator allocator_;
   TreeNode* root_ = nullptr;
   TreeNode* first_node_ = nullptr;
   TreeNode* last_node_ = nullptr;
   int size_ = 0;
+  [[no_unique_address]] mutable Counters counters_;
 };
 
+template<class T, class Compare = std::less<T>,
+    class Allocator = std::allocator<T>>
+using OrderStatisticsTree = BinarySearchTree<T, Compare, Allocator,
+    TreePolicy<AvlBalancing, OrderStatistics>>;
+
+template<class T, class Compare = std::less<T>,
+    class Allocator = std::allocator<T>>
+using MerkleTree = BinarySearchTree<T, Compare, Allocator,
+    TreePolicy<AvlBalancing, MerkleHash>>;
+
 // definitions
 
-template<class T>
-BinarySearchTree<T>::BinarySearchTree(const std::initializer_list<T>& list) {
-  for (auto& value : list) {
-    insert(value);
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::BinarySearchTree
+    (const Compare& comp, const Allocator& allocator) :
+    comp_(comp), allocator_(allocator) {}
+
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::BinarySearchTree
+    (const Allocator& allocator) :
+    allocator_(allocator) {}
+
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::BinarySearchTree
+    (const std::initializer_list<T>& list, const Compare& comp,
+     const Allocator& allocator) :
+    comp_(comp), allocator_(allocator) {
+  BuildFromRange(list.begin(), list.end(), true);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<std::input_iterator InputIt>
+BinarySearchTree<T, Compare, Allocator, Policy>::BinarySearchTree
+    (InputIt first, InputIt last, const Compare& comp,
+     const Allocator& allocator) :
+    comp_(comp), allocator_(allocator) {
+  BuildFromRange(first, last, true);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<std::input_iterator InputIt>
+BinarySearchTree<T, Compare, Allocator, Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::from_sorted
+    (InputIt first, InputIt last, const Compare& comp,
+     const Allocator& allocator) {
+  BinarySearchTree tree(comp, allocator);
+  tree.BuildFromRange(first, last, false);
+  return tree;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::BinarySearchTree
+    (const BinarySearchTree& rhs) :
+    comp_(rhs.comp_),
+    allocator_(NodeAllocatorTraits::select_on_container_copy_construction
+                   (rhs.allocator_)),
+    size_(rhs.size_) {
+  if (rhs.root_ != nullptr) {
+    root_ = CopyTree(*(rhs.root_));
   }
+  FindFirstNode();
+  FindLastNode();
 }
 
-template<class T>
-BinarySearchTree<T>::BinarySearchTree(const BinarySearchTree& rhs) :
-    root_(CopyTree(*(rhs.root_))), size_(rhs.size_) {
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::BinarySearchTree
+    (const BinarySearchTree& rhs, ParallelExecution execution) :
+    comp_(rhs.comp_),
+    allocator_(NodeAllocatorTraits::select_on_container_copy_construction
+                   (rhs.allocator_)),
+    size_(rhs.size_) {
+  if (rhs.root_ != nullptr) {
+    root_ = CopyTreeParallel(*(rhs.root_), execution.threads);
+  }
   FindFirstNode();
   FindLastNode();
 }
 
-template<class T>
-BinarySearchTree<T>::BinarySearchTree(BinarySearchTree&& rhs) noexcept :
-    root_(rhs.root_), first_node_(rhs.first_node_), size_(rhs.size_) {
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::BinarySearchTree
+    (BinarySearchTree&& rhs) noexcept :
+    comp_(rhs.comp_), allocator_(std::move(rhs.allocator_)), root_(rhs.root_),
+    first_node_(rhs.first_node_), last_node_(rhs.last_node_),
+    size_(rhs.size_) {
   rhs.root_ = nullptr;
   rhs.first_node_ = nullptr;
+  rhs.last_node_ = nullptr;
   rhs.size_ = 0;
 }
 
-template<class T>
-BinarySearchTree<T>::~BinarySearchTree() {
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::~BinarySearchTree() {
   clear();
 }
 
-template<class T>
-BinarySearchTree<T>& BinarySearchTree<T>::operator=
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>&
+BinarySearchTree<T, Compare, Allocator, Policy>::operator=
     (const BinarySearchTree& rhs) {
   if (this != &rhs) {
     clear();
-    root_ = CopyTree(*(rhs.root_));
+    comp_ = rhs.comp_;
+    if constexpr
+        (NodeAllocatorTraits::propagate_on_container_copy_assignment::value) {
+      allocator_ = rhs.allocator_;
+    }
+    if (rhs.root_ != nullptr) {
+      root_ = CopyTree(*(rhs.root_));
+    }
     size_ = rhs.size_;
     FindFirstNode();
     FindLastNode();
   }
-  return *this;;
+  return *this;
 }
 
-template<class T>
-BinarySearchTree<T>& BinarySearchTree<T>::operator=
-    (BinarySearchTree&& rhs) noexcept {
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>&
+BinarySearchTree<T, Compare, Allocator, Policy>::operator=
+    (BinarySearchTree&& rhs) noexcept(kMoveAssignSteals) {
   if (this != &rhs) {
     clear();
+    comp_ = rhs.comp_;
+
+    if constexpr (!kMoveAssignSteals) {
+      if (!(allocator_ == rhs.allocator_)) {
+        // nodes of rhs can not be freed by our allocator
+        for (auto it = rhs.begin(); it != rhs.end(); ++it) {
+          emplace(std::move(it.tree_node_->value));
+        }
+        rhs.clear();
+        return *this;
+      }
+    }
+    if constexpr
+        (NodeAllocatorTraits::propagate_on_container_move_assignment::value) {
+      allocator_ = std::move(rhs.allocator_);
+    }
 
     root_ = rhs.root_;
     first_node_ = rhs.first_node_;
+    last_node_ = rhs.last_node_;
     size_ = rhs.size_;
 
     rhs.root_ = nullptr;
     rhs.first_node_ = nullptr;
+    rhs.last_node_ = nullptr;
     rhs.size_ = 0;
   }
   return *this;
 }
 
-template<class T>
-int BinarySearchTree<T>::size() const {
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::value_compare
+BinarySearchTree<T, Compare, Allocator, Policy>::value_comp() const {
+  return comp_;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::allocator_type
+BinarySearchTree<T, Compare, Allocator, Policy>::get_allocator() const {
+  return allocator_type(allocator_);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+int BinarySearchTree<T, Compare, Allocator, Policy>::size() const {
   return size_;
 }
 
-template<class T>
-bool BinarySearchTree<T>::empty() const {
+template<class T, class Compare, class Allocator, class Policy>
+bool BinarySearchTree<T, Compare, Allocator, Policy>::empty() const {
   return size_ == 0;
 }
 
-template<class T>
-bool BinarySearchTree<T>::contains(const T& value) const {
+template<class T, class Compare, class Allocator, class Policy>
+int BinarySearchTree<T, Compare, Allocator, Policy>::height() const {
+  if constexpr (kIsAvl) {
+    return Height(root_);
+  } else {
+    // level-order walk, the tree may be too deep for recursion
+    int height = 0;
+    std::vector<const TreeNode*> level;
+    std::vector<const TreeNode*> next_level;
+    if (root_ != nullptr) {
+      level.push_back(root_);
+    }
+    while (!level.empty()) {
+      ++height;
+      next_level.clear();
+      for (const TreeNode* node : level) {
+        if (node->left != nullptr) {
+          next_level.push_back(node->left);
+        }
+        if (node->right != nullptr) {
+          next_level.push_back(node->right);
+        }
+      }
+      level.swap(next_level);
+    }
+    return height;
+  }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+bool
+BinarySearchTree<T, Compare, Allocator, Policy>::contains
+    (const T& value) const {
   return find(value) != end();
 }
 
-template<class T>
-int BinarySearchTree<T>::count(const T& value) const {
-  return CalcCount(root_, value);
+template<class T, class Compare, class Allocator, class Policy>
+template<class K> requires TransparentCompare<Compare>
+bool
+BinarySearchTree<T, Compare, Allocator, Policy>::contains
+    (const K& key) const {
+  return FindNode(key) != nullptr;
 }
 
-template<class T>
-void BinarySearchTree<T>::clear() {
-  DeleteTree(root_);
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::contains_many
+    (std::span<const T> values, std::span<bool> results) const {
+  for (std::size_t first = 0; first < values.size();
+       first += kLookupBatchSize) {
+    std::size_t batch = std::min(kLookupBatchSize, values.size() - first);
+    const T* keys = values.data() + first;
+    TreeNode* nodes[kLookupBatchSize];
+    for (std::size_t i = 0; i < batch; ++i) {
+      nodes[i] = root_;
+      results[first + i] = false;
+    }
+
+    // one step of every unfinished descent per round
+    for (bool active = true; active;) {
+      active = false;
+      for (std::size_t i = 0; i < batch; ++i) {
+        TreeNode* node = nodes[i];
+        if (node == nullptr) {
+          continue;
+        }
+        if (comp_(keys[i], node->value)) {
+          node = node->left;
+        } else if (comp_(node->value, keys[i])) {
+          node = node->right;
+        } else {
+          results[first + i] = true;
+          node = nullptr;
+        }
+        if (node != nullptr) {
+          __builtin_prefetch(node);
+          active = true;
+        }
+        nodes[i] = node;
+      }
+    }
+  }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+int
+BinarySearchTree<T, Compare, Allocator, Policy>::count
+    (const T& value) const {
+  return CalcCount(value);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K> requires TransparentCompare<Compare>
+int
+BinarySearchTree<T, Compare, Allocator, Policy>::count
+    (const K& key) const {
+  return CalcCount(key);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::clear() {
+  if (!ReleaseArena()) {
+    DeleteTree(root_);
+  }
 
   root_ = nullptr;
   first_node_ = nullptr;
@@ -210,11 +993,31 @@ void BinarySearchTree<T>::clear() {
   size_ = 0;
 }
 
-template<class T>
-bool BinarySearchTree<T>::operator==(const BinarySearchTree<T>& rhs) const {
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::clear
+    (ParallelExecution execution) {
+  if (!ReleaseArena()) {
+    DeleteTreeParallel(root_, execution.threads);
+  }
+
+  root_ = nullptr;
+  first_node_ = nullptr;
+  last_node_ = nullptr;
+  size_ = 0;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+bool BinarySearchTree<T, Compare, Allocator, Policy>::operator==
+    (const BinarySearchTree& rhs) const {
   if (size_ != rhs.size_) {
     return false;
   }
+  if constexpr (kMerkleHash) {
+    // different digests prove a difference, equal ones may collide
+    if (digest() != rhs.digest()) {
+      return false;
+    }
+  }
   auto it_this = begin();
   for (const auto& value : rhs) {
     if (!(*it_this == value)) {
@@ -225,31 +1028,201 @@ bool BinarySearchTree<T>::operator==(const BinarySearchTree<T>& rhs) const {
   return true;
 }
 
-template<class T>
-bool BinarySearchTree<T>::operator!=(const BinarySearchTree<T>& rhs) const {
+template<class T, class Compare, class Allocator, class Policy>
+bool BinarySearchTree<T, Compare, Allocator, Policy>::operator!=
+    (const BinarySearchTree& rhs) const {
   return !(*this == rhs);
 }
 
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::serialize
+    (std::ostream& out) const {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "serialize() needs a trivially copyable T");
+  SerializedTreeHeader header;
+  header.value_size = sizeof(T);
+  header.value_alignment = alignof(T);
+  header.count = size_;
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  // write in chunks, the values are not contiguous in memory
+  constexpr std::size_t kChunkSize = 4096 / sizeof(T) + 1;
+  std::array<std::byte, kChunkSize * sizeof(T)> chunk;
+  std::byte* chunk_end = chunk.data();
+  ForEachNode([&](const TreeNode* node) {
+    std::memcpy(chunk_end, std::addressof(node->value), sizeof(T));
+    chunk_end += sizeof(T);
+    if (chunk_end == chunk.data() + chunk.size()) {
+      out.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+      chunk_end = chunk.data();
+    }
+  });
+  out.write(reinterpret_cast<const char*>(chunk.data()),
+            chunk_end - chunk.data());
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::deserialize
+    (std::istream& in, const Compare& comp, const Allocator& allocator) {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "deserialize() needs a trivially copyable T");
+  SerializedTreeHeader header;
+  if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+      || header.magic != SerializedTreeHeader::kMagic
+      || header.value_size != sizeof(T)
+      || header.value_alignment != alignof(T)
+      || header.count > INT_MAX) {
+    throw std::runtime_error("BinarySearchTree::deserialize: bad header");
+  }
+
+  // T need not be default constructible, values are built by bit_cast
+  constexpr std::uint64_t kChunkSize = 4096 / sizeof(T) + 1;
+  std::array<std::byte, kChunkSize * sizeof(T)> chunk;
+  std::vector<T> values;
+  // the count is not trusted until the values arrive, so a corrupt header
+  // cannot make the reserve fail or take gigabytes
+  constexpr std::uint64_t kMaxReserve = (std::uint64_t(1) << 20) / sizeof(T);
+  values.reserve(std::min(header.count, kMaxReserve));
+  while (values.size() < header.count) {
+    std::uint64_t batch = std::min(kChunkSize, header.count - values.size());
+    if (!in.read(reinterpret_cast<char*>(chunk.data()), batch * sizeof(T))) {
+      throw std::runtime_error("BinarySearchTree::deserialize: truncated");
+    }
+    for (std::uint64_t i = 0; i < batch; ++i) {
+      std::array<std::byte, sizeof(T)> bytes;
+      std::memcpy(bytes.data(), chunk.data() + i * sizeof(T), sizeof(T));
+      values.push_back(std::bit_cast<T>(bytes));
+      if (values.size() > 1 && comp(values.back(), values.end()[-2])) {
+        throw std::runtime_error("BinarySearchTree::deserialize: unsorted");
+      }
+    }
+  }
+  return from_sorted(values.begin(), values.end(), comp, allocator);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTreeStats
+BinarySearchTree<T, Compare, Allocator, Policy>::stats() const {
+  BinarySearchTreeStats stats;
+  stats.node_count = size_;
+  stats.node_bytes = sizeof(TreeNode);
+  if constexpr (requires(const NodeAllocator& allocator) {
+                  allocator.slab_bytes();
+                }) {
+    stats.bytes_allocated = allocator_.slab_bytes();
+  } else {
+    stats.bytes_allocated = size_ * sizeof(TreeNode);
+  }
+
+  // depths need a stack of their own, the height of a NoBalancing tree is
+  // not bounded
+  long long depth_sum = 0;
+  std::vector<std::pair<const TreeNode*, int>> stack;
+  if (root_ != nullptr) {
+    stack.emplace_back(root_, 1);
+  }
+  while (!stack.empty()) {
+    auto [node, depth] = stack.back();
+    stack.pop_back();
+    depth_sum += depth;
+    stats.height = std::max(stats.height, depth);
+    if (node->left != nullptr) {
+      stack.emplace_back(node->left, depth + 1);
+    }
+    if (node->right != nullptr) {
+      stack.emplace_back(node->right, depth + 1);
+    }
+  }
+  if (size_ > 0) {
+    stats.average_depth = static_cast<double>(depth_sum) / size_;
+  }
+
+  const T* run_value = nullptr;
+  int run_length = 0;
+  auto end_run = [&stats, &run_length]() {
+    int bucket = std::bit_width(static_cast<unsigned>(run_length)) - 1;
+    if (static_cast<int>(stats.duplicate_runs.size()) <= bucket) {
+      stats.duplicate_runs.resize(bucket + 1);
+    }
+    ++stats.duplicate_runs[bucket];
+  };
+  ForEachNode([&](const TreeNode* node) {
+    if (run_value != nullptr && !comp_(*run_value, node->value)) {
+      ++run_length;
+      return;
+    }
+    if (run_value != nullptr) {
+      end_run();
+    }
+    run_value = &node->value;
+    run_length = 1;
+  });
+  if (run_value != nullptr) {
+    end_run();
+  }
+
+  if constexpr (kCounters) {
+    BinarySearchTreeCounters& counters = stats.counters;
+    counters.finds = counters_.finds.load(std::memory_order_relaxed);
+    counters.find_comparisons =
+        counters_.find_comparisons.load(std::memory_order_relaxed);
+    counters.inserts = counters_.inserts.load(std::memory_order_relaxed);
+    counters.insert_comparisons =
+        counters_.insert_comparisons.load(std::memory_order_relaxed);
+    counters.iterator_steps =
+        counters_.iterator_steps.load(std::memory_order_relaxed);
+    counters.parent_climbs =
+        counters_.parent_climbs.load(std::memory_order_relaxed);
+    counters.allocations =
+        counters_.allocations.load(std::memory_order_relaxed);
+    counters.frees = counters_.frees.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::reset_counters() {
+  if constexpr (kCounters) {
+    for (Counter counter : {&AtomicCounters::finds,
+                            &AtomicCounters::find_comparisons,
+                            &AtomicCounters::inserts,
+                            &AtomicCounters::insert_comparisons,
+                            &AtomicCounters::iterator_steps,
+                            &AtomicCounters::parent_climbs,
+                            &AtomicCounters::allocations,
+                            &AtomicCounters::frees}) {
+      (counters_.*counter).store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
 // ConstIterator
 
-template<class T>
-BinarySearchTree<T>::ConstIterator::ConstIterator
-    (BinarySearchTree::TreeNode* tree_node, const BinarySearchTree<T>* owner) :
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator::ConstIterator
+    (BinarySearchTree::TreeNode* tree_node, const BinarySearchTree* owner) :
     tree_node_(tree_node), owner_(owner) {}
 
-template<class T>
-const T& BinarySearchTree<T>::ConstIterator::operator*() const {
+template<class T, class Compare, class Allocator, class Policy>
+const T&
+BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator::operator*
+    () const {
   return tree_node_->value;
 }
 
-template<class T>
-const T* BinarySearchTree<T>::ConstIterator::operator->() const {
+template<class T, class Compare, class Allocator, class Policy>
+const T*
+BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator::operator->
+    () const {
   return &(tree_node_->value);
 }
 
-template<class T>
-typename BinarySearchTree<T>::ConstIterator&
-BinarySearchTree<T>::ConstIterator::operator++() {
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator&
+BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator::operator++
+    () {
+  owner_->Count(&AtomicCounters::iterator_steps);
   if (tree_node_->right != nullptr) {
     tree_node_ = tree_node_->right;
     while (tree_node_->left != nullptr) {
@@ -258,6 +1231,7 @@ BinarySearchTree<T>::ConstIterator::operator++() {
   } else {
     TreeNode* prev = nullptr;
     while (tree_node_ != nullptr && tree_node_->right == prev) {
+      owner_->Count(&AtomicCounters::parent_climbs);
       prev = tree_node_;
       tree_node_ = tree_node_->parent;
     }
@@ -266,17 +1240,20 @@ BinarySearchTree<T>::ConstIterator::operator++() {
   return *this;
 }
 
-template<class T>
-typename BinarySearchTree<T>::ConstIterator
-BinarySearchTree<T>::ConstIterator::operator++(int) {
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator
+BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator::operator++
+    (int) {
   auto copy = *this;
   ++(*this);
   return copy;
 }
 
-template<class T>
-typename BinarySearchTree<T>::ConstIterator&
-BinarySearchTree<T>::ConstIterator::operator--() {
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator&
+BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator::operator--
+    () {
+  owner_->Count(&AtomicCounters::iterator_steps);
   if (tree_node_ == nullptr) {
     tree_node_ = owner_->last_node_;
     return *this;
@@ -290,6 +1267,7 @@ BinarySearchTree<T>::ConstIterator::operator--() {
   } else {
     TreeNode* prev = nullptr;
     while (tree_node_ != nullptr && tree_node_->left == prev) {
+      owner_->Count(&AtomicCounters::parent_climbs);
       prev = tree_node_;
       tree_node_ = tree_node_->parent;
     }
@@ -298,141 +1276,864 @@ BinarySearchTree<T>::ConstIterator::operator--() {
   return *this;
 }
 
-template<class T>
-typename BinarySearchTree<T>::ConstIterator
-BinarySearchTree<T>::ConstIterator::operator--(int) {
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator
+BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator::operator--
+    (int) {
   auto copy = *this;
   --(*this);
   return copy;
 }
 
-template<class T>
-std::vector<T> BinarySearchTree<T>::to_vector() const {
+template<class T, class Compare, class Allocator, class Policy>
+std::vector<T>
+BinarySearchTree<T, Compare, Allocator, Policy>::to_vector() const {
   std::vector<T> vec;
-  for (const T& value : *this) {
-    vec.push_back(value);
-  }
+  vec.reserve(size_);
+  copy_to(std::back_inserter(vec));
   return vec;
 }
 
-template<class T>
-bool BinarySearchTree<T>::ConstIterator::operator==(ConstIterator rhs) const {
+template<class T, class Compare, class Allocator, class Policy>
+template<class OutputIt>
+OutputIt
+BinarySearchTree<T, Compare, Allocator, Policy>::copy_to(OutputIt out) const {
+  ForEachNode([&out](const TreeNode* node) {
+    *out = node->value;
+    ++out;
+  });
+  return out;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class OutputIt>
+OutputIt
+BinarySearchTree<T, Compare, Allocator, Policy>::drain(OutputIt out) {
+  TreeNode* node = std::exchange(root_, nullptr);
+  first_node_ = nullptr;
+  last_node_ = nullptr;
+  size_ = 0;
+  // rotate left children up until the smallest node is on top, it has no
+  // left child then and goes next, so only left and right links are used
+  std::exception_ptr error;
+  while (node != nullptr) {
+    if (node->left != nullptr) {
+      TreeNode* left = node->left;
+      node->left = left->right;
+      left->right = node;
+      node = left;
+      continue;
+    }
+    TreeNode* right = node->right;
+    if (error == nullptr) {
+      try {
+        *out = std::move(node->value);
+        ++out;
+      } catch (...) {
+        // free the rest, then pass the exception on
+        error = std::current_exception();
+      }
+    }
+    DestroyNode(node);
+    node = right;
+  }
+  if (error != nullptr) {
+    std::rethrow_exception(error);
+  }
+  return out;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+bool
+BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator::operator==
+    (ConstIterator rhs) const {
   return (tree_node_ == rhs.tree_node_) && (owner_ == rhs.owner_);
 }
 
-template<class T>
-bool BinarySearchTree<T>::ConstIterator::operator!=
+template<class T, class Compare, class Allocator, class Policy>
+bool
+BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator::operator!=
     (BinarySearchTree::ConstIterator rhs) const {
   return !(*this == rhs);
 }
 
 // -ConstIterator
 
-template<class T>
+template<class T, class Compare, class Allocator, class Policy>
 template<class... Args>
-BinarySearchTree<T>::TreeNode::TreeNode(Args&& ... args) :
+BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode::TreeNode
+    (Args&& ... args) :
     value(std::forward<Args>(args)...) {}
 
-template<class T>
-typename BinarySearchTree<T>::ConstIterator BinarySearchTree<T>::begin() const {
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator
+BinarySearchTree<T, Compare, Allocator, Policy>::begin() const {
   return {first_node_, this};
 }
 
-template<class T>
-typename BinarySearchTree<T>::ConstIterator BinarySearchTree<T>::end() const {
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator
+BinarySearchTree<T, Compare, Allocator, Policy>::end() const {
   return ConstIterator(nullptr, this);
 }
 
-template<class T>
-typename BinarySearchTree<T>::ConstIterator
-BinarySearchTree<T>::find(const T& value) const {
-  TreeNode* cur_node = root_;
-  while (cur_node != nullptr && !(cur_node->value == value)) {
-    if (value < cur_node->value) {
-      cur_node = cur_node->left;
-    } else {
-      cur_node = cur_node->right;
-    }
-  }
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator
+BinarySearchTree<T, Compare, Allocator, Policy>::find(const T& value) const {
+  return {FindNode(value), this};
+}
 
-  return {cur_node, this};
+template<class T, class Compare, class Allocator, class Policy>
+template<class K> requires TransparentCompare<Compare>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator
+BinarySearchTree<T, Compare, Allocator, Policy>::find(const K& key) const {
+  return {FindNode(key), this};
 }
 
-template<class T>
-void BinarySearchTree<T>::erase(BinarySearchTree::ConstIterator iter) {
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator
+BinarySearchTree<T, Compare, Allocator, Policy>::lower_bound
+    (const T& value) const {
+  return {LowerBoundNode(value), this};
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K> requires TransparentCompare<Compare>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator
+BinarySearchTree<T, Compare, Allocator, Policy>::lower_bound
+    (const K& key) const {
+  return {LowerBoundNode(key), this};
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator
+BinarySearchTree<T, Compare, Allocator, Policy>::upper_bound
+    (const T& value) const {
+  return {UpperBoundNode(value), this};
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K> requires TransparentCompare<Compare>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator
+BinarySearchTree<T, Compare, Allocator, Policy>::upper_bound
+    (const K& key) const {
+  return {UpperBoundNode(key), this};
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+auto BinarySearchTree<T, Compare, Allocator, Policy>::equal_range
+    (const T& value) const -> std::pair<ConstIterator, ConstIterator> {
+  return {lower_bound(value), upper_bound(value)};
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K> requires TransparentCompare<Compare>
+auto BinarySearchTree<T, Compare, Allocator, Policy>::equal_range
+    (const K& key) const -> std::pair<ConstIterator, ConstIterator> {
+  return {lower_bound(key), upper_bound(key)};
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::erase
+    (BinarySearchTree::ConstIterator iter) {
   --size_;
   Detach(iter.tree_node_);
-  delete iter.tree_node_;
+  DestroyNode(iter.tree_node_);
 }
 
-template<class T>
-void BinarySearchTree<T>::erase(const T& value) {
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator
+BinarySearchTree<T, Compare, Allocator, Policy>::erase
+    (ConstIterator first, ConstIterator last) {
+  if (first == last) {
+    return last;
+  }
+  if (first.tree_node_ == first_node_ && last.tree_node_ == nullptr) {
+    clear();
+    return end();
+  }
+
+  TreeNode* before;
+  TreeNode* span;
+  Split(first.tree_node_, &before, &span);
+  TreeNode* after = nullptr;
+  if (last.tree_node_ != nullptr) {
+    Split(last.tree_node_, &span, &after);
+  }
+
+  size_ -= DeleteTree(span);
+  root_ = Join(before, after);
+  FindFirstNode();
+  FindLastNode();
+  return last;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+int BinarySearchTree<T, Compare, Allocator, Policy>::erase_range
+    (const T& lo, const T& hi) {
+  return EraseRange(lo, hi);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K> requires TransparentCompare<Compare>
+int BinarySearchTree<T, Compare, Allocator, Policy>::erase_range
+    (const K& lo, const K& hi) {
+  return EraseRange(lo, hi);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class F>
+void BinarySearchTree<T, Compare, Allocator, Policy>::for_each_in_range
+    (const T& lo, const T& hi, F f) const {
+  ForEachInRange(lo, hi, f);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K, class F> requires TransparentCompare<Compare>
+void BinarySearchTree<T, Compare, Allocator, Policy>::for_each_in_range
+    (const K& lo, const K& hi, F f) const {
+  ForEachInRange(lo, hi, f);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+int BinarySearchTree<T, Compare, Allocator, Policy>::EraseRange
+    (const K& lo, const K& hi) {
+  TreeNode* first = LowerBoundNode(lo);
+  TreeNode* last = LowerBoundNode(hi);
+  // hi < lo, the range is empty
+  if (last != nullptr && comp_(last->value, lo)) {
+    return 0;
+  }
+  int old_size = size_;
+  erase(MakeIterator(first), MakeIterator(last));
+  return old_size - size_;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K, class F>
+void BinarySearchTree<T, Compare, Allocator, Policy>::ForEachInRange
+    (const K& lo, const K& hi, F& f) const {
+  // the descent to lo skips everything on the left, the walk stops at hi
+  for (ConstIterator it(LowerBoundNode(lo), this);
+       it != end() && comp_(*it, hi); ++it) {
+    f(*it);
+  }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class F>
+void BinarySearchTree<T, Compare, Allocator, Policy>::ForEachNode(F f) const {
+  if constexpr (kIsAvl) {
+    TreeNode* stack[kMaxAvlHeight];
+    int depth = 0;
+    TreeNode* node = root_;
+    while (true) {
+      for (; node != nullptr; node = node->left) {
+        stack[depth++] = node;
+      }
+      if (depth == 0) {
+        return;
+      }
+      node = stack[--depth];
+      f(node);
+      node = node->right;
+    }
+  } else {
+    // the height is not bounded, walk the parent links like ConstIterator
+    for (ConstIterator it = begin(); it != end(); ++it) {
+      f(it.tree_node_);
+    }
+  }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::erase(const T& value) {
   auto it = find(value);
   if (it != end()) {
     erase(it);
   }
 }
 
-template<class T>
+template<class T, class Compare, class Allocator, class Policy>
+template<class K> requires TransparentCompare<Compare>
+void BinarySearchTree<T, Compare, Allocator, Policy>::erase(const K& key) {
+  auto it = find(key);
+  if (it != end()) {
+    erase(it);
+  }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
 template<class U>
-void BinarySearchTree<T>::insert(U&& value) {
+void BinarySearchTree<T, Compare, Allocator, Policy>::insert(U&& value) {
   emplace(std::forward<U>(value));
 }
 
-template<class T>
+template<class T, class Compare, class Allocator, class Policy>
 template<class... Args>
-void BinarySearchTree<T>::emplace(Args&& ... args) {
-  auto* added_node = new TreeNode(std::forward<Args>(args)...);
+void
+BinarySearchTree<T, Compare, Allocator, Policy>::emplace(Args&& ... args) {
+  InsertNode(CreateNode(std::forward<Args>(args)...));
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void
+BinarySearchTree<T, Compare, Allocator, Policy>::InsertNode(TreeNode* node) {
+  Count(&AtomicCounters::inserts);
+  Counter comparisons = &AtomicCounters::insert_comparisons;
+  // equivalent values go after each other, so the descent would end at
+  // last_node_ for a value not less than it
+  if (last_node_ != nullptr
+      && !CountedLess(node->value, last_node_->value, comparisons)) {
+    LinkNode(node, last_node_, false);
+    return;
+  }
+  if (first_node_ != nullptr
+      && CountedLess(node->value, first_node_->value, comparisons)) {
+    LinkNode(node, first_node_, true);
+    return;
+  }
 
   TreeNode* cur_node = root_;
   TreeNode* parent = nullptr;
+  bool is_left_child = false;
   while (cur_node != nullptr) {
-    if (added_node->value < cur_node->value) {
-      parent = cur_node;
+    parent = cur_node;
+    is_left_child = CountedLess(node->value, cur_node->value, comparisons);
+    cur_node = is_left_child ? cur_node->left : cur_node->right;
+  }
+
+  LinkNode(node, parent, is_left_child);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class InputIt>
+void BinarySearchTree<T, Compare, Allocator, Policy>::BuildFromRange
+    (InputIt first, InputIt last, bool check_sorted) {
+  // nodes are allocated in sorted order, so a slab allocator places them
+  // next to each other in the order the iterators visit them
+  std::vector<TreeNode*> nodes;
+  if constexpr (std::forward_iterator<InputIt>) {
+    nodes.reserve(std::distance(first, last));
+  }
+
+  bool is_sorted = true;
+  try {
+    for (; first != last; ++first) {
+      nodes.push_back(nullptr);
+      nodes.back() = CreateNode(*first);
+      if (check_sorted && is_sorted && nodes.size() > 1
+          && comp_(nodes.back()->value, nodes[nodes.size() - 2]->value)) {
+        is_sorted = false;
+      }
+    }
+
+    if (!is_sorted) {
+      for (TreeNode* node : nodes) {
+        InsertNode(node);
+      }
+      return;
+    }
+  } catch (...) {
+    for (TreeNode* node : nodes) {
+      if (node != nullptr) {
+        DestroyNode(node);
+      }
+    }
+    root_ = nullptr;
+    first_node_ = nullptr;
+    last_node_ = nullptr;
+    size_ = 0;
+    throw;
+  }
+
+  if (nodes.empty()) {
+    return;
+  }
+  size_ = static_cast<int>(nodes.size());
+  root_ = BuildBalanced(nodes.data(), size_, nullptr);
+  first_node_ = nodes.front();
+  last_node_ = nodes.back();
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::BuildBalanced
+    (TreeNode* const* nodes, int count, TreeNode* parent) {
+  if (count == 0) {
+    return nullptr;
+  }
+
+  int middle = count / 2;
+  TreeNode* node = nodes[middle];
+  node->parent = parent;
+  node->left = BuildBalanced(nodes, middle, node);
+  node->right = BuildBalanced(nodes + middle + 1, count - middle - 1, node);
+  UpdateNode(node);
+  return node;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class U>
+std::pair<typename BinarySearchTree<T, Compare, Allocator, Policy>::
+              ConstIterator, bool>
+BinarySearchTree<T, Compare, Allocator, Policy>::insert_unique
+    (U&& value) {
+  if constexpr (!std::is_same_v<std::remove_cvref_t<U>, T>
+      && !TransparentCompare<Compare>) {
+    // the comparator takes only T, convert once instead of on every compare
+    return insert_unique(T(std::forward<U>(value)));
+  } else {
+    UniquePosition position = FindUniquePosition(value);
+    if (position.equal_node != nullptr) {
+      return {ConstIterator(position.equal_node, this), false};
+    }
+
+    TreeNode* added_node = CreateNode(std::forward<U>(value));
+    LinkNode(added_node, position.parent, position.is_left_child);
+    return {ConstIterator(added_node, this), true};
+  }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class... Args>
+std::pair<typename BinarySearchTree<T, Compare, Allocator, Policy>::
+              ConstIterator, bool>
+BinarySearchTree<T, Compare, Allocator, Policy>::emplace_unique
+    (Args&& ... args) {
+  if constexpr (sizeof...(Args) == 1
+      && (std::is_same_v<std::remove_cvref_t<Args>, T> && ...)) {
+    return insert_unique(std::forward<Args>(args)...);
+  } else {
+    // build the value on the stack, a node is allocated only if it is new
+    return insert_unique(T(std::forward<Args>(args)...));
+  }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class... Args>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator
+BinarySearchTree<T, Compare, Allocator, Policy>::emplace_hint
+    (ConstIterator hint, Args&& ... args) {
+  TreeNode* node = CreateNode(std::forward<Args>(args)...);
+  TreeNode* next = hint.tree_node_;
+  // the value belongs before hint if it is between hint and its predecessor
+  ConstIterator before = hint;
+  if (next != first_node_) {
+    --before;
+  }
+  Counter comparisons = &AtomicCounters::insert_comparisons;
+  if ((next != nullptr && CountedLess(next->value, node->value, comparisons))
+      || (next != first_node_
+          && CountedLess(node->value, *before, comparisons))) {
+    InsertNode(node);
+    return MakeIterator(node);
+  }
+  Count(&AtomicCounters::inserts);
+
+  // the predecessor has no right child if hint has a left one
+  if (next == nullptr) {
+    LinkNode(node, last_node_, false);
+  } else if (next->left == nullptr) {
+    LinkNode(node, next, true);
+  } else {
+    LinkNode(node, before.tree_node_, false);
+  }
+  return MakeIterator(node);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::NodeHandle::NodeHandle
+    (TreeNode* tree_node, const Allocator& allocator) :
+    tree_node_(tree_node), allocator_(allocator) {}
+
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::NodeHandle::NodeHandle
+    (NodeHandle&& rhs) noexcept :
+    tree_node_(std::exchange(rhs.tree_node_, nullptr)),
+    allocator_(std::move(rhs.allocator_)) {
+  rhs.allocator_.reset();
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::NodeHandle&
+BinarySearchTree<T, Compare, Allocator, Policy>::NodeHandle::operator=
+    (NodeHandle&& rhs) noexcept {
+  if (this != &rhs) {
+    Reset();
+    tree_node_ = std::exchange(rhs.tree_node_, nullptr);
+    allocator_ = std::move(rhs.allocator_);
+    rhs.allocator_.reset();
+  }
+  return *this;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::NodeHandle::~NodeHandle() {
+  Reset();
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+bool BinarySearchTree<T, Compare, Allocator, Policy>::NodeHandle::empty()
+    const {
+  return tree_node_ == nullptr;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::NodeHandle::operator bool()
+    const {
+  return tree_node_ != nullptr;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+T& BinarySearchTree<T, Compare, Allocator, Policy>::NodeHandle::value()
+    const {
+  return tree_node_->value;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+Allocator
+BinarySearchTree<T, Compare, Allocator, Policy>::NodeHandle::get_allocator()
+    const {
+  return *allocator_;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::NodeHandle::Reset() {
+  if (tree_node_ != nullptr) {
+    NodeAllocator allocator(*allocator_);
+    NodeAllocatorTraits::destroy(allocator, tree_node_);
+    NodeAllocatorTraits::deallocate(allocator, tree_node_, 1);
+    tree_node_ = nullptr;
+  }
+  allocator_.reset();
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::node_type
+BinarySearchTree<T, Compare, Allocator, Policy>::extract(ConstIterator iter) {
+  TreeNode* node = iter.tree_node_;
+  --size_;
+  Detach(node);
+  // a detached node keeps its old links, make it a single node tree
+  node->parent = nullptr;
+  AttachChildren(node, nullptr, nullptr);
+  return NodeHandle(node, get_allocator());
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::node_type
+BinarySearchTree<T, Compare, Allocator, Policy>::extract(const T& value) {
+  auto it = find(value);
+  return it != end() ? extract(it) : NodeHandle();
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K> requires TransparentCompare<Compare>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::node_type
+BinarySearchTree<T, Compare, Allocator, Policy>::extract(const K& key) {
+  auto it = find(key);
+  return it != end() ? extract(it) : NodeHandle();
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator
+BinarySearchTree<T, Compare, Allocator, Policy>::insert(node_type&& node) {
+  if (node.empty()) {
+    return end();
+  }
+  TreeNode* added_node = std::exchange(node.tree_node_, nullptr);
+  node.allocator_.reset();
+  InsertNode(added_node);
+  return MakeIterator(added_node);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::merge
+    (BinarySearchTree&& other) {
+  CombineWith(std::move(other), SetOperation::kMerge);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::union_with
+    (const BinarySearchTree& other) {
+  CombineWith(from_sorted(other.begin(), other.end(), comp_, get_allocator()),
+              SetOperation::kUnion);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::union_with
+    (BinarySearchTree&& other) {
+  CombineWith(std::move(other), SetOperation::kUnion);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::intersect_with
+    (const BinarySearchTree& other) {
+  CombineWith(from_sorted(other.begin(), other.end(), comp_, get_allocator()),
+              SetOperation::kIntersection);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::intersect_with
+    (BinarySearchTree&& other) {
+  CombineWith(std::move(other), SetOperation::kIntersection);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::difference_with
+    (const BinarySearchTree& other) {
+  CombineWith(from_sorted(other.begin(), other.end(), comp_, get_allocator()),
+              SetOperation::kDifference);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::difference_with
+    (BinarySearchTree&& other) {
+  CombineWith(std::move(other), SetOperation::kDifference);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::split(const T& key) {
+  return SplitOff(key);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K> requires TransparentCompare<Compare>
+BinarySearchTree<T, Compare, Allocator, Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::split(const K& key) {
+  return SplitOff(key);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::CombineWith
+    (BinarySearchTree&& other, SetOperation operation) {
+  static_assert(kIsAvl, "set operations need AvlBalancing");
+  if (this == &other) {
+    if (operation == SetOperation::kDifference) {
+      clear();
+    }
+    return;
+  }
+  if constexpr (!NodeAllocatorTraits::is_always_equal::value) {
+    if (!(allocator_ == other.allocator_)) {
+      // nodes of other can not be freed by our allocator
+      BinarySearchTree copy = from_sorted(other.begin(), other.end(), comp_,
+                                          get_allocator());
+      other.clear();
+      CombineWith(std::move(copy), operation);
+      return;
+    }
+  }
+
+  int destroyed = 0;
+  int total_size = size_ + other.size_;
+  root_ = Combine(root_, other.root_, operation, &destroyed);
+  size_ = total_size - destroyed;
+  FindFirstNode();
+  FindLastNode();
+
+  other.root_ = nullptr;
+  other.first_node_ = nullptr;
+  other.last_node_ = nullptr;
+  other.size_ = 0;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+BinarySearchTree<T, Compare, Allocator, Policy>
+BinarySearchTree<T, Compare, Allocator, Policy>::SplitOff(const K& key) {
+  BinarySearchTree rest(comp_, get_allocator());
+  SplitByKey(root_, key, false, &root_, &rest.root_);
+  rest.size_ = CountNodes(rest.root_);
+  size_ -= rest.size_;
+  FindFirstNode();
+  FindLastNode();
+  rest.FindFirstNode();
+  rest.FindLastNode();
+  return rest;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::UniquePosition
+BinarySearchTree<T, Compare, Allocator, Policy>::FindUniquePosition
+    (const K& key) const {
+  Count(&AtomicCounters::inserts);
+  Counter comparisons = &AtomicCounters::insert_comparisons;
+  UniquePosition position;
+  if (last_node_ != nullptr
+      && CountedLess(last_node_->value, key, comparisons)) {
+    position.parent = last_node_;
+    return position;
+  }
+  if (first_node_ != nullptr
+      && CountedLess(key, first_node_->value, comparisons)) {
+    position.parent = first_node_;
+    position.is_left_child = true;
+    return position;
+  }
+
+  TreeNode* cur_node = root_;
+  while (cur_node != nullptr) {
+    position.parent = cur_node;
+    if (CountedLess(key, cur_node->value, comparisons)) {
+      position.is_left_child = true;
       cur_node = cur_node->left;
-    } else {
-      parent = cur_node;
+    } else if (CountedLess(cur_node->value, key, comparisons)) {
+      position.is_left_child = false;
       cur_node = cur_node->right;
+    } else {
+      position.equal_node = cur_node;
+      break;
     }
   }
+  return position;
+}
 
-  added_node->parent = parent;
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::LinkNode
+    (TreeNode* node, TreeNode* parent, bool is_left_child) {
+  node->parent = parent;
 
   if (parent != nullptr) {
-    if (added_node->value < parent->value) {
-      parent->left = added_node;
+    if (is_left_child) {
+      parent->left = node;
       if (parent == first_node_) {
-        first_node_ = added_node;
+        first_node_ = node;
       }
     } else {
-      parent->right = added_node;
+      parent->right = node;
       if (parent == last_node_) {
-        last_node_ = added_node;
+        last_node_ = node;
       }
     }
   } else {
-    root_ = added_node;
-    first_node_ = added_node;
-    last_node_ = added_node;
+    root_ = node;
+    first_node_ = node;
+    last_node_ = node;
   }
   ++size_;
+
+  if constexpr (kMerkleHash) {
+    // a node from a node handle may have a changed value
+    UpdateNode(node);
+  }
+  Rebalance(parent);
 }
 
-template<class T>
-int BinarySearchTree<T>::CalcCount(const TreeNode* node, const T& value) const {
-  if (node == nullptr) {
-    return 0;
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator
+BinarySearchTree<T, Compare, Allocator, Policy>::MakeIterator
+    (TreeNode* node) const {
+  return {node, this};
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::NodeOf
+    (ConstIterator iter) {
+  return iter.tree_node_;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::Count
+    (Counter counter, std::uint64_t n) const {
+  if constexpr (kCounters) {
+    (counters_.*counter).fetch_add(n, std::memory_order_relaxed);
   }
+}
 
-  if (value < node->value) {
-    return CalcCount(node->left, value);
-  } else {
-    return CalcCount(node->right, value) + (value == node->value ? 1 : 0);
+template<class T, class Compare, class Allocator, class Policy>
+template<class A, class B>
+bool BinarySearchTree<T, Compare, Allocator, Policy>::CountedLess
+    (const A& lhs, const B& rhs, Counter counter) const {
+  Count(counter);
+  return comp_(lhs, rhs);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::FindNode
+    (const K& key) const {
+  Count(&AtomicCounters::finds);
+  Counter comparisons = &AtomicCounters::find_comparisons;
+  TreeNode* cur_node = root_;
+  while (cur_node != nullptr) {
+    if (CountedLess(key, cur_node->value, comparisons)) {
+      cur_node = cur_node->left;
+    } else if (CountedLess(cur_node->value, key, comparisons)) {
+      cur_node = cur_node->right;
+    } else {
+      break;
+    }
   }
+
+  return cur_node;
 }
 
-template<class T>
-void BinarySearchTree<T>::FindFirstNode() {
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::LowerBoundNode
+    (const K& key) const {
+  Count(&AtomicCounters::finds);
+  TreeNode* bound = nullptr;
+  TreeNode* cur_node = root_;
+  while (cur_node != nullptr) {
+    if (CountedLess(cur_node->value, key,
+                    &AtomicCounters::find_comparisons)) {
+      cur_node = cur_node->right;
+    } else {
+      bound = cur_node;
+      cur_node = cur_node->left;
+    }
+  }
+  return bound;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::UpperBoundNode
+    (const K& key) const {
+  Count(&AtomicCounters::finds);
+  TreeNode* bound = nullptr;
+  TreeNode* cur_node = root_;
+  while (cur_node != nullptr) {
+    if (CountedLess(key, cur_node->value,
+                    &AtomicCounters::find_comparisons)) {
+      bound = cur_node;
+      cur_node = cur_node->left;
+    } else {
+      cur_node = cur_node->right;
+    }
+  }
+  return bound;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+int BinarySearchTree<T, Compare, Allocator, Policy>::CalcCount
+    (const K& key) const {
+  if constexpr (kOrderStatistics) {
+    return CalcRank(key, true) - CalcRank(key, false);
+  }
+
+  // iterative, so long runs of equivalent values can not exhaust the stack
+  ConstIterator last(UpperBoundNode(key), this);
+  int count = 0;
+  for (ConstIterator it(LowerBoundNode(key), this); it != last; ++it) {
+    ++count;
+  }
+  return count;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::FindFirstNode() {
   first_node_ = root_;
 
   if (root_ == nullptr) {
@@ -444,8 +2145,8 @@ void BinarySearchTree<T>::FindFirstNode() {
   }
 }
 
-template<class T>
-void BinarySearchTree<T>::FindLastNode() {
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::FindLastNode() {
   last_node_ = root_;
 
   if (root_ == nullptr) {
@@ -457,58 +2158,294 @@ void BinarySearchTree<T>::FindLastNode() {
   }
 }
 
-template<class T>
-typename BinarySearchTree<T>::TreeNode* BinarySearchTree<T>::CopyTree
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::CopyTree
     (const BinarySearchTree::TreeNode& node_to_copy) {
-  auto* copied_node = new TreeNode(node_to_copy.value);
-  if (node_to_copy.left != nullptr) {
-    copied_node->left = CopyTree(*(node_to_copy.left));
-    (copied_node->left)->parent = copied_node;
+  TreeNode* copied_root = CreateNode(node_to_copy.value);
+  CopyNodeData(copied_root, node_to_copy);
+
+  // walk both trees in preorder, a missing child in the copy means
+  // the child is not visited yet
+  const TreeNode* source = &node_to_copy;
+  TreeNode* copied_node = copied_root;
+  try {
+    while (true) {
+      if (source->left != nullptr && copied_node->left == nullptr) {
+        source = source->left;
+        copied_node->left = CreateNode(source->value);
+        copied_node->left->parent = copied_node;
+        copied_node = copied_node->left;
+      } else if (source->right != nullptr
+          && copied_node->right == nullptr) {
+        source = source->right;
+        copied_node->right = CreateNode(source->value);
+        copied_node->right->parent = copied_node;
+        copied_node = copied_node->right;
+      } else if (source == &node_to_copy) {
+        break;
+      } else {
+        source = source->parent;
+        copied_node = copied_node->parent;
+        continue;
+      }
+      CopyNodeData(copied_node, *source);
+    }
+  } catch (...) {
+    DeleteTree(copied_root);
+    throw;
   }
 
-  if (node_to_copy.right != nullptr) {
-    copied_node->right = CopyTree(*(node_to_copy.right));
-    (copied_node->right)->parent = copied_node;
+  return copied_root;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+int BinarySearchTree<T, Compare, Allocator, Policy>::DeleteTree
+    (BinarySearchTree::TreeNode* node) {
+  if (node == nullptr) {
+    return 0;
   }
 
-  return copied_node;
+  // delete leaves bottom-up, unlinking each from its parent, so that every
+  // node becomes a leaf after its children are gone
+  TreeNode* subtree_root = node;
+  int deleted = 0;
+  while (true) {
+    if (node->left != nullptr) {
+      node = node->left;
+    } else if (node->right != nullptr) {
+      node = node->right;
+    } else {
+      TreeNode* parent = node->parent;
+      bool is_subtree_root = node == subtree_root;
+      if (!is_subtree_root) {
+        *FindPointerToPointerToChild(parent, node) = nullptr;
+      }
+      DestroyNode(node);
+      ++deleted;
+      if (is_subtree_root) {
+        return deleted;
+      }
+      node = parent;
+    }
+  }
 }
 
-template<class T>
-void BinarySearchTree<T>::DeleteTree(BinarySearchTree::TreeNode* node) {
-  if (node == nullptr) {
-    return;
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::CopyTreeParallel
+    (const TreeNode& node_to_copy, unsigned threads) {
+  if (threads <= 1 || !NodeAllocatorTraits::is_always_equal::value) {
+    return CopyTree(node_to_copy);
   }
 
-  DeleteTree(node->left);
-  DeleteTree(node->right);
+  struct CopyTask {
+    const TreeNode* source;
+    TreeNode* parent;
+    bool is_left_child;
+    TreeNode* copy = nullptr;
+    std::exception_ptr error;
+  };
 
-  delete node;
+  // copy the levels above the split depth here, the subtrees below
+  // them become tasks
+  TreeNode* copied_root = CreateNode(node_to_copy.value);
+  CopyNodeData(copied_root, node_to_copy);
+  std::vector<CopyTask> tasks;
+  try {
+    std::vector<std::pair<const TreeNode*, TreeNode*>> level = {
+        {&node_to_copy, copied_root}};
+    int split_depth = ParallelSplitDepth(threads);
+    for (int depth = 0; depth <= split_depth && !level.empty(); ++depth) {
+      std::vector<std::pair<const TreeNode*, TreeNode*>> next_level;
+      for (auto [source, copied_node] : level) {
+        for (bool is_left_child : {true, false}) {
+          const TreeNode* child = is_left_child ? source->left : source->right;
+          if (child == nullptr) {
+            continue;
+          }
+          if (depth == split_depth) {
+            tasks.push_back({child, copied_node, is_left_child, nullptr, {}});
+            continue;
+          }
+          TreeNode* copied_child = CreateNode(child->value);
+          CopyNodeData(copied_child, *child);
+          copied_child->parent = copied_node;
+          (is_left_child ? copied_node->left : copied_node->right) =
+              copied_child;
+          next_level.emplace_back(child, copied_child);
+        }
+      }
+      level = std::move(next_level);
+    }
+  } catch (...) {
+    DeleteTree(copied_root);
+    throw;
+  }
+
+  RunInParallel(tasks.size(), threads, [&](std::size_t i) {
+    try {
+      tasks[i].copy = CopyTree(*tasks[i].source);
+    } catch (...) {
+      tasks[i].error = std::current_exception();
+    }
+  });
+
+  std::exception_ptr error;
+  for (CopyTask& task : tasks) {
+    if (task.copy != nullptr) {
+      task.copy->parent = task.parent;
+      (task.is_left_child ? task.parent->left : task.parent->right) =
+          task.copy;
+    } else {
+      error = task.error;
+    }
+  }
+  if (error) {
+    DeleteTree(copied_root);
+    std::rethrow_exception(error);
+  }
+  return copied_root;
 }
 
-// pointers in node do not change
-template<class T>
-void BinarySearchTree<T>::Detach(TreeNode* node) {
-  if (node->left == nullptr && node->right == nullptr) {
-    DetachBothNull(node);
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::DeleteTreeParallel
+    (TreeNode* node, unsigned threads) {
+  if (node == nullptr || threads <= 1
+      || !NodeAllocatorTraits::is_always_equal::value) {
+    DeleteTree(node);
     return;
   }
 
-  if (node->left != nullptr && node->right == nullptr) {
-    DetachRightNull(node);
-    return;
+  // cut the subtrees below the split depth off and delete them as tasks,
+  // what is left above them is deleted here afterwards
+  std::vector<TreeNode*> tasks;
+  std::vector<TreeNode*> level = {node};
+  int split_depth = ParallelSplitDepth(threads);
+  for (int depth = 0; depth <= split_depth && !level.empty(); ++depth) {
+    std::vector<TreeNode*> next_level;
+    for (TreeNode* level_node : level) {
+      for (TreeNode** child : {&level_node->left, &level_node->right}) {
+        if (*child == nullptr) {
+          continue;
+        }
+        if (depth == split_depth) {
+          tasks.push_back(*child);
+          *child = nullptr;
+        } else {
+          next_level.push_back(*child);
+        }
+      }
+    }
+    level = std::move(next_level);
   }
 
-  if (node->left == nullptr && node->right != nullptr) {
-    DetachLeftNull(node);
-    return;
+  RunInParallel(tasks.size(), threads, [&](std::size_t i) {
+    DeleteTree(tasks[i]);
+  });
+  DeleteTree(node);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+int BinarySearchTree<T, Compare, Allocator, Policy>::ParallelSplitDepth
+    (unsigned threads) {
+  // about four tasks per thread to even out unequal subtrees
+  int split_depth = 0;
+  while ((2u << split_depth) < 4 * threads && split_depth < 16) {
+    ++split_depth;
+  }
+  return split_depth;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class Task>
+void BinarySearchTree<T, Compare, Allocator, Policy>::RunInParallel
+    (std::size_t task_count, unsigned threads, Task task) {
+  std::atomic<std::size_t> next_task = 0;
+  auto worker = [&]() {
+    for (std::size_t i = next_task++; i < task_count; i = next_task++) {
+      task(i);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < threads && i < task_count; ++i) {
+    try {
+      workers.emplace_back(worker);
+    } catch (const std::system_error&) {
+      // out of threads, the ones already running take over the rest
+      break;
+    }
+  }
+  worker();
+  for (std::thread& thread : workers) {
+    thread.join();
+  }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class... Args>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::CreateNode
+    (Args&& ... args) {
+  TreeNode* node = NodeAllocatorTraits::allocate(allocator_, 1);
+  Count(&AtomicCounters::allocations);
+  try {
+    NodeAllocatorTraits::construct(allocator_, node,
+                                   std::forward<Args>(args)...);
+  } catch (...) {
+    NodeAllocatorTraits::deallocate(allocator_, node, 1);
+    Count(&AtomicCounters::frees);
+    throw;
   }
+  return node;
+}
 
-  DetachNeitherNull(node);
+template<class T, class Compare, class Allocator, class Policy>
+void
+BinarySearchTree<T, Compare, Allocator, Policy>::DestroyNode
+    (TreeNode* node) {
+  NodeAllocatorTraits::destroy(allocator_, node);
+  NodeAllocatorTraits::deallocate(allocator_, node, 1);
+  Count(&AtomicCounters::frees);
 }
 
-template<class T>
-void BinarySearchTree<T>::DetachBothNull(BinarySearchTree::TreeNode* node) {
+template<class T, class Compare, class Allocator, class Policy>
+bool BinarySearchTree<T, Compare, Allocator, Policy>::ReleaseArena() {
+  if constexpr (std::is_trivially_destructible_v<T>
+      && requires(NodeAllocator& allocator) { allocator.release(); }) {
+    bool is_released = allocator_.release();
+    if (is_released) {
+      Count(&AtomicCounters::frees, size_);
+    }
+    return is_released;
+  } else {
+    return false;
+  }
+}
+
+// pointers in node do not change
+template<class T, class Compare, class Allocator, class Policy>
+void
+BinarySearchTree<T, Compare, Allocator, Policy>::Detach(TreeNode* node) {
+  TreeNode* changed_node;
+  if (node->left == nullptr && node->right == nullptr) {
+    changed_node = DetachBothNull(node);
+  } else if (node->left != nullptr && node->right == nullptr) {
+    changed_node = DetachRightNull(node);
+  } else if (node->left == nullptr && node->right != nullptr) {
+    changed_node = DetachLeftNull(node);
+  } else {
+    changed_node = DetachNeitherNull(node);
+  }
+
+  Rebalance(changed_node);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::DetachBothNull
+    (BinarySearchTree::TreeNode* node) {
   if (node == first_node_) {
     first_node_ = node->parent;
   }
@@ -520,10 +2457,13 @@ void BinarySearchTree<T>::DetachBothNull(BinarySearchTree::TreeNode* node) {
   if (node == root_) {
     root_ = nullptr;
   }
+  return node->parent;
 }
 
-template<class T>
-void BinarySearchTree<T>::DetachRightNull(BinarySearchTree::TreeNode* node) {
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::DetachRightNull
+    (BinarySearchTree::TreeNode* node) {
   if (node == last_node_) {
     ConstIterator it(last_node_, this);
     --it;
@@ -535,10 +2475,13 @@ void BinarySearchTree<T>::DetachRightNull(BinarySearchTree::TreeNode* node) {
     root_ = node->left;
   }
   (node->left)->parent = node->parent;
+  return node->parent;
 }
 
-template<class T>
-void BinarySearchTree<T>::DetachLeftNull(BinarySearchTree::TreeNode* node) {
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::DetachLeftNull
+    (BinarySearchTree::TreeNode* node) {
   if (node == first_node_) {
     ConstIterator it(first_node_, this);
     ++it;
@@ -550,20 +2493,33 @@ void BinarySearchTree<T>::DetachLeftNull(BinarySearchTree::TreeNode* node) {
   if (node == root_) {
     root_ = node->right;
   }
+  return node->parent;
 }
 
-template<class T>
-void BinarySearchTree<T>::DetachNeitherNull(BinarySearchTree::TreeNode* node) {
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::DetachNeitherNull
+    (BinarySearchTree::TreeNode* node) {
   TreeNode* almost_left = node->right;
   while (almost_left->left != nullptr) {
     almost_left = almost_left->left;
   }
 
-  Detach(almost_left);
+  // almost_left has no left child, no rebalancing until it is in place
+  TreeNode* changed_node = almost_left->right == nullptr
+                           ? DetachBothNull(almost_left)
+                           : DetachLeftNull(almost_left);
+  if (changed_node == node) {
+    changed_node = almost_left;
+  }
+  if (last_node_ == node) {
+    last_node_ = almost_left;
+  }
 
   almost_left->parent = node->parent;
   almost_left->left = node->left;
   almost_left->right = node->right;
+  CopyNodeData(almost_left, *node);
 
   (almost_left->left)->parent = almost_left;
   if (almost_left->right != nullptr) {
@@ -574,11 +2530,12 @@ void BinarySearchTree<T>::DetachNeitherNull(BinarySearchTree::TreeNode* node) {
   if (node == root_) {
     root_ = almost_left;
   }
+  return changed_node;
 }
 
-template<class T>
-typename BinarySearchTree<T>::TreeNode**
-BinarySearchTree<T>::FindPointerToPointerToChild
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode**
+BinarySearchTree<T, Compare, Allocator, Policy>::FindPointerToPointerToChild
     (BinarySearchTree::TreeNode* parent,
      BinarySearchTree::TreeNode* child) const {
   if (parent == nullptr) {
@@ -593,10 +2550,11 @@ BinarySearchTree<T>::FindPointerToPointerToChild
 }
 
 // Do not change new_child, old_child
-template<class T>
-void BinarySearchTree<T>::ChangeChild(BinarySearchTree::TreeNode* parent,
-                                      BinarySearchTree::TreeNode* old_child,
-                                      BinarySearchTree::TreeNode* new_child) {
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::ChangeChild
+    (BinarySearchTree::TreeNode* parent,
+     BinarySearchTree::TreeNode* old_child,
+     BinarySearchTree::TreeNode* new_child) {
   TreeNode** place_for_child = FindPointerToPointerToChild(parent, old_child);
   if (place_for_child == nullptr) {
     return;
@@ -604,4 +2562,682 @@ void BinarySearchTree<T>::ChangeChild(BinarySearchTree::TreeNode* parent,
   *place_for_child = new_child;
 }
 
+// Balancing
+
+template<class T, class Compare, class Allocator, class Policy>
+void
+BinarySearchTree<T, Compare, Allocator, Policy>::Rebalance(TreeNode* node) {
+  if constexpr (kIsAvl || kIsAugmented) {
+    if (node == nullptr) {
+      return;
+    }
+    TreeNode* new_root = RebalanceUpwards(node);
+    if (new_root != nullptr) {
+      root_ = new_root;
+    }
+  }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::RebalanceUpwards
+    (TreeNode* node) {
+  while (true) {
+    if constexpr (kIsAvl) {
+      int old_height = node->height;
+      UpdateNode(node);
+
+      int balance = Height(node->left) - Height(node->right);
+      if (balance > 1) {
+        if (Height(node->left->left) < Height(node->left->right)) {
+          RotateLeft(node->left);
+        }
+        node = RotateRight(node);
+      } else if (balance < -1) {
+        if (Height(node->right->right) < Height(node->right->left)) {
+          RotateRight(node->right);
+        }
+        node = RotateLeft(node);
+      }
+
+      if (node->parent == nullptr) {
+        return node;
+      }
+      // the subtree has its old height and augmentations go all the way up
+      // anyway, so nothing above it changed
+      if (!kIsAugmented && node->height == old_height) {
+        return nullptr;
+      }
+    } else {
+      UpdateNode(node);
+      if (node->parent == nullptr) {
+        return node;
+      }
+    }
+    node = node->parent;
+  }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::RotateLeft(TreeNode* node) {
+  TreeNode* pivot = node->right;
+
+  node->right = pivot->left;
+  if (node->right != nullptr) {
+    (node->right)->parent = node;
+  }
+
+  pivot->parent = node->parent;
+  ChangeChild(node->parent, node, pivot);
+
+  pivot->left = node;
+  node->parent = pivot;
+
+  UpdateNode(node);
+  UpdateNode(pivot);
+  return pivot;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::RotateRight
+    (TreeNode* node) {
+  TreeNode* pivot = node->left;
+
+  node->left = pivot->right;
+  if (node->left != nullptr) {
+    (node->left)->parent = node;
+  }
+
+  pivot->parent = node->parent;
+  ChangeChild(node->parent, node, pivot);
+
+  pivot->right = node;
+  node->parent = pivot;
+
+  UpdateNode(node);
+  UpdateNode(pivot);
+  return pivot;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+int
+BinarySearchTree<T, Compare, Allocator, Policy>::Height
+    (const TreeNode* node) {
+  return node == nullptr ? 0 : node->height;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+int
+BinarySearchTree<T, Compare, Allocator, Policy>::Size(const TreeNode* node) {
+  return node == nullptr ? 0 : node->subtree_size;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+std::uint64_t BinarySearchTree<T, Compare, Allocator, Policy>::SubtreeHash
+    (const TreeNode* node) {
+  return node == nullptr ? 0 : node->subtree_hash;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+std::uint64_t BinarySearchTree<T, Compare, Allocator, Policy>::HashValue
+    (const T& value) {
+  // std::hash of integers is the identity, and sums of those collide for
+  // any two sets of equal total, so spread it first (splitmix64, whose
+  // increment keeps 0 from hashing to 0)
+  std::uint64_t hash = std::hash<T>()(value) + 0x9e3779b97f4a7c15;
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+  return hash ^ (hash >> 31);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void
+BinarySearchTree<T, Compare, Allocator, Policy>::UpdateNode(TreeNode* node) {
+  if constexpr (kIsAvl) {
+    int left_height = Height(node->left);
+    int right_height = Height(node->right);
+    node->height = (left_height > right_height ? left_height : right_height)
+        + 1;
+  }
+  if constexpr (kOrderStatistics) {
+    node->subtree_size = Size(node->left) + Size(node->right) + 1;
+  }
+  if constexpr (kMerkleHash) {
+    node->subtree_hash = SubtreeHash(node->left) + SubtreeHash(node->right)
+        + HashValue(node->value);
+  }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::CopyNodeData
+    (TreeNode* to, const TreeNode& from) {
+  static_cast<BalanceData&>(*to) = from;
+  static_cast<AugmentData&>(*to) = from;
+}
+
+// -Balancing
+
+// Split and join
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::Join
+    (TreeNode* left, TreeNode* mid, TreeNode* right) {
+  if constexpr (kIsAvl) {
+    // hang mid on the spine of the higher tree where the heights match
+    if (Height(left) > Height(right) + 1) {
+      TreeNode* parent = left;
+      while (Height(parent->right) > Height(right) + 1) {
+        parent = parent->right;
+      }
+      AttachChildren(mid, parent->right, right);
+      parent->right = mid;
+      mid->parent = parent;
+      return RebalanceSubtree(parent, left);
+    }
+    if (Height(right) > Height(left) + 1) {
+      TreeNode* parent = right;
+      while (Height(parent->left) > Height(left) + 1) {
+        parent = parent->left;
+      }
+      AttachChildren(mid, left, parent->left);
+      parent->left = mid;
+      mid->parent = parent;
+      return RebalanceSubtree(parent, right);
+    }
+  }
+  AttachChildren(mid, left, right);
+  mid->parent = nullptr;
+  return mid;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::Join
+    (TreeNode* left, TreeNode* right) {
+  if (left == nullptr) {
+    return right;
+  }
+  if (right == nullptr) {
+    return left;
+  }
+
+  // take the first node of right out and use it as the middle
+  TreeNode* mid;
+  right = PopFirst(right, &mid);
+  return Join(left, mid, right);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::Split
+    (TreeNode* node, TreeNode** before, TreeNode** rest) {
+  TreeNode* parent = node->parent;
+  bool from_left = parent != nullptr && parent->left == node;
+  TreeNode* left = Orphan(node->left);
+  TreeNode* right = Join(nullptr, node, Orphan(node->right));
+
+  // every ancestor goes to one side together with its other subtree
+  while (parent != nullptr) {
+    TreeNode* next_parent = parent->parent;
+    bool next_from_left =
+        next_parent != nullptr && next_parent->left == parent;
+    if (from_left) {
+      right = Join(right, parent, Orphan(parent->right));
+    } else {
+      left = Join(Orphan(parent->left), parent, left);
+    }
+    parent = next_parent;
+    from_left = next_from_left;
+  }
+
+  *before = left;
+  *rest = right;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+void BinarySearchTree<T, Compare, Allocator, Policy>::SplitByKey
+    (TreeNode* root, const K& key, bool inclusive, TreeNode** before,
+     TreeNode** rest) {
+  // the first node of the rest is where the descent went left last
+  TreeNode* boundary = nullptr;
+  bool went_right = false;
+  TreeNode* cur_node = root;
+  while (cur_node != nullptr) {
+    bool goes_before = inclusive ? !comp_(key, cur_node->value)
+                                 : comp_(cur_node->value, key);
+    if (goes_before) {
+      went_right = true;
+      cur_node = cur_node->right;
+    } else {
+      boundary = cur_node;
+      cur_node = cur_node->left;
+    }
+  }
+  if (boundary == nullptr || !went_right) {
+    // one of the parts is empty, nothing to restructure
+    *before = boundary == nullptr ? root : nullptr;
+    *rest = boundary == nullptr ? nullptr : root;
+    return;
+  }
+  Split(boundary, before, rest);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+void BinarySearchTree<T, Compare, Allocator, Policy>::SplitEquivalent
+    (TreeNode* root, const K& key, TreeNode** less, TreeNode** equal,
+     TreeNode** greater) {
+  TreeNode* rest;
+  SplitByKey(root, key, false, less, &rest);
+  SplitByKey(rest, key, true, equal, greater);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::SplitAtRoot
+    (TreeNode* root, TreeNode** less, TreeNode** equal, TreeNode** greater) {
+  const TreeNode* before = root->left;
+  while (before != nullptr && before->right != nullptr) {
+    before = before->right;
+  }
+  const TreeNode* after = root->right;
+  while (after != nullptr && after->left != nullptr) {
+    after = after->left;
+  }
+  if ((before != nullptr && !comp_(before->value, root->value))
+      || (after != nullptr && !comp_(root->value, after->value))) {
+    SplitEquivalent(root, root->value, less, equal, greater);
+    return;
+  }
+  *less = Orphan(root->left);
+  *greater = Orphan(root->right);
+  AttachChildren(root, nullptr, nullptr);
+  *equal = root;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::PopFirst
+    (TreeNode* root, TreeNode** first) {
+  TreeNode* node = root;
+  while (node->left != nullptr) {
+    node = node->left;
+  }
+  TreeNode* parent = node->parent;
+  if (node->right != nullptr) {
+    node->right->parent = parent;
+  }
+  if (parent == nullptr) {
+    root = node->right;
+  } else {
+    parent->left = node->right;
+    root = RebalanceSubtree(parent, root);
+  }
+  *first = node;
+  return root;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::Combine
+    (TreeNode* ours, TreeNode* theirs, SetOperation operation,
+     int* destroyed) {
+  if (ours == nullptr || theirs == nullptr) {
+    if (operation == SetOperation::kIntersection) {
+      *destroyed += DeleteTree(ours) + DeleteTree(theirs);
+      return nullptr;
+    }
+    if (operation == SetOperation::kDifference) {
+      *destroyed += DeleteTree(theirs);
+      return ours;
+    }
+    return ours != nullptr ? ours : theirs;
+  }
+
+  // split both at the root value of the lower tree, so the recursion runs
+  // over the smaller one and splits the larger
+  TreeNode* ours_less;
+  TreeNode* ours_equal;
+  TreeNode* ours_greater;
+  TreeNode* theirs_less;
+  TreeNode* theirs_equal;
+  TreeNode* theirs_greater;
+  if (Height(theirs) < Height(ours)) {
+    const T& key = theirs->value;
+    SplitAtRoot(theirs, &theirs_less, &theirs_equal, &theirs_greater);
+    SplitEquivalent(ours, key, &ours_less, &ours_equal, &ours_greater);
+  } else {
+    const T& key = ours->value;
+    SplitAtRoot(ours, &ours_less, &ours_equal, &ours_greater);
+    SplitEquivalent(theirs, key, &theirs_less, &theirs_equal,
+                    &theirs_greater);
+  }
+
+  TreeNode* less = Combine(ours_less, theirs_less, operation, destroyed);
+  TreeNode* greater =
+      Combine(ours_greater, theirs_greater, operation, destroyed);
+  TreeNode* equal =
+      CombineEquivalent(ours_equal, theirs_equal, operation, destroyed);
+  return Join(Join(less, equal), greater);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::CombineEquivalent
+    (TreeNode* ours, TreeNode* theirs, SetOperation operation,
+     int* destroyed) {
+  if (operation == SetOperation::kMerge) {
+    return Join(ours, theirs);
+  }
+  int ours_count = CountNodes(ours);
+  int theirs_count = CountNodes(theirs);
+  if (operation == SetOperation::kUnion) {
+    // the values theirs has more of than ours go after ours
+    theirs = DestroyFirst(theirs, ours_count, destroyed);
+    return Join(ours, theirs);
+  }
+  *destroyed += DeleteTree(theirs);
+  if (operation == SetOperation::kIntersection) {
+    return DestroyFirst(ours, ours_count - theirs_count, destroyed);
+  }
+  return DestroyFirst(ours, theirs_count, destroyed);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::DestroyFirst
+    (TreeNode* root, int count, int* destroyed) {
+  for (; count > 0 && root != nullptr; --count) {
+    TreeNode* first;
+    root = PopFirst(root, &first);
+    DestroyNode(first);
+    ++*destroyed;
+  }
+  return root;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+int BinarySearchTree<T, Compare, Allocator, Policy>::CountNodes
+    (const TreeNode* root) {
+  if constexpr (kOrderStatistics) {
+    return Size(root);
+  } else {
+    // in-order walk over the parent links, root is detached
+    int count = 0;
+    const TreeNode* node = root;
+    while (node != nullptr && node->left != nullptr) {
+      node = node->left;
+    }
+    while (node != nullptr) {
+      ++count;
+      if (node->right != nullptr) {
+        node = node->right;
+        while (node->left != nullptr) {
+          node = node->left;
+        }
+      } else {
+        const TreeNode* child;
+        do {
+          child = node;
+          node = node->parent;
+        } while (node != nullptr && node->right == child);
+      }
+    }
+    return count;
+  }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::AttachChildren
+    (TreeNode* node, TreeNode* left, TreeNode* right) {
+  node->left = left;
+  node->right = right;
+  if (left != nullptr) {
+    left->parent = node;
+  }
+  if (right != nullptr) {
+    right->parent = node;
+  }
+  UpdateNode(node);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::Orphan(TreeNode* node) {
+  if (node != nullptr) {
+    node->parent = nullptr;
+  }
+  return node;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::RebalanceSubtree
+    (TreeNode* node, TreeNode* root) {
+  if constexpr (kIsAvl || kIsAugmented) {
+    TreeNode* new_root = RebalanceUpwards(node);
+    if (new_root != nullptr) {
+      return new_root;
+    }
+  }
+  return root;
+}
+
+// -Split and join
+
+// Order statistics
+
+template<class T, class Compare, class Allocator, class Policy>
+typename BinarySearchTree<T, Compare, Allocator, Policy>::ConstIterator
+BinarySearchTree<T, Compare, Allocator, Policy>::select(int k) const {
+  static_assert(kOrderStatistics, "select() needs OrderStatistics");
+  TreeNode* cur_node = root_;
+  while (cur_node != nullptr) {
+    int left_size = Size(cur_node->left);
+    if (k < left_size) {
+      cur_node = cur_node->left;
+    } else if (k == left_size) {
+      break;
+    } else {
+      k -= left_size + 1;
+      cur_node = cur_node->right;
+    }
+  }
+  return {cur_node, this};
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+int BinarySearchTree<T, Compare, Allocator, Policy>::rank
+    (const T& value) const {
+  static_assert(kOrderStatistics, "rank() needs OrderStatistics");
+  return CalcRank(value, false);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K> requires TransparentCompare<Compare>
+int BinarySearchTree<T, Compare, Allocator, Policy>::rank
+    (const K& key) const {
+  static_assert(kOrderStatistics, "rank() needs OrderStatistics");
+  return CalcRank(key, false);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+int BinarySearchTree<T, Compare, Allocator, Policy>::index_of
+    (ConstIterator iter) const {
+  static_assert(kOrderStatistics, "index_of() needs OrderStatistics");
+  TreeNode* node = iter.tree_node_;
+  if (node == nullptr) {
+    return size_;
+  }
+
+  int index = Size(node->left);
+  while (node->parent != nullptr) {
+    if (node->parent->right == node) {
+      index += Size(node->parent->left) + 1;
+    }
+    node = node->parent;
+  }
+  return index;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+int BinarySearchTree<T, Compare, Allocator, Policy>::distance
+    (ConstIterator first, ConstIterator last) const {
+  return index_of(last) - index_of(first);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::advance
+    (ConstIterator& iter, int n) const {
+  iter = select(index_of(iter) + n);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+int BinarySearchTree<T, Compare, Allocator, Policy>::CalcRank
+    (const K& key, bool inclusive) const {
+  int rank = 0;
+  TreeNode* cur_node = root_;
+  while (cur_node != nullptr) {
+    bool goes_right = inclusive ? !comp_(key, cur_node->value)
+                                : comp_(cur_node->value, key);
+    if (goes_right) {
+      rank += Size(cur_node->left) + 1;
+      cur_node = cur_node->right;
+    } else {
+      cur_node = cur_node->left;
+    }
+  }
+  return rank;
+}
+
+// -Order statistics
+
+// Digests
+
+template<class T, class Compare, class Allocator, class Policy>
+std::uint64_t BinarySearchTree<T, Compare, Allocator, Policy>::digest() const {
+  static_assert(kMerkleHash, "digest() needs MerkleHash");
+  return SubtreeHash(root_);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+BinarySearchTreeDiff<T> BinarySearchTree<T, Compare, Allocator, Policy>::diff
+    (const BinarySearchTree& other) const {
+  static_assert(kMerkleHash, "diff() needs MerkleHash");
+  // the recursion follows the shape of this tree
+  static_assert(kIsAvl, "diff() needs AvlBalancing");
+  BinarySearchTreeDiff<T> result;
+  DiffBetween(other, nullptr, nullptr, &result);
+  return result;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+std::uint64_t BinarySearchTree<T, Compare, Allocator, Policy>::HashBelow
+    (const T& key, bool inclusive) const {
+  std::uint64_t hash = 0;
+  TreeNode* cur_node = root_;
+  while (cur_node != nullptr) {
+    bool goes_right = inclusive ? !comp_(key, cur_node->value)
+                                : comp_(cur_node->value, key);
+    if (goes_right) {
+      // the node and its left subtree
+      hash += cur_node->subtree_hash - SubtreeHash(cur_node->right);
+      cur_node = cur_node->right;
+    } else {
+      cur_node = cur_node->left;
+    }
+  }
+  return hash;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+std::uint64_t BinarySearchTree<T, Compare, Allocator, Policy>::HashBetween
+    (const T* low, const T* high) const {
+  std::uint64_t below_high = high == nullptr ? digest()
+                                             : HashBelow(*high, false);
+  return below_high - (low == nullptr ? 0 : HashBelow(*low, true));
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+const typename BinarySearchTree<T, Compare, Allocator, Policy>::TreeNode*
+BinarySearchTree<T, Compare, Allocator, Policy>::RootBetween
+    (const T* low, const T* high) const {
+  const TreeNode* cur_node = root_;
+  while (cur_node != nullptr) {
+    if (low != nullptr && !comp_(*low, cur_node->value)) {
+      cur_node = cur_node->right;
+    } else if (high != nullptr && !comp_(cur_node->value, *high)) {
+      cur_node = cur_node->left;
+    } else {
+      break;
+    }
+  }
+  return cur_node;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::DiffBetween
+    (const BinarySearchTree& other, const T* low, const T* high,
+     BinarySearchTreeDiff<T>* diff) const {
+  if (HashBetween(low, high) == other.HashBetween(low, high)) {
+    return;
+  }
+  const TreeNode* pivot = RootBetween(low, high);
+  if (pivot == nullptr) {
+    // nothing here, everything in other is new
+    TreeNode* node = low == nullptr ? other.first_node_
+                                    : other.UpperBoundNode(*low);
+    for (ConstIterator it(node, &other);
+         it != other.end() && (high == nullptr || comp_(*it, *high)); ++it) {
+      diff->added.push_back(*it);
+    }
+    return;
+  }
+  // each side of the pivot covers a subtree of this tree
+  DiffBetween(other, low, &pivot->value, diff);
+  DiffEquivalent(other, pivot->value, diff);
+  DiffBetween(other, &pivot->value, high, diff);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void BinarySearchTree<T, Compare, Allocator, Policy>::DiffEquivalent
+    (const BinarySearchTree& other, const T& key,
+     BinarySearchTreeDiff<T>* diff) const {
+  if (HashBelow(key, true) - HashBelow(key, false)
+      == other.HashBelow(key, true) - other.HashBelow(key, false)) {
+    return;
+  }
+  // equivalent values need not be equal, so pair them up by ==, in order
+  // so that runs of equal values pair up in one pass
+  auto [first, last] = equal_range(key);
+  auto [other_first, other_last] = other.equal_range(key);
+  std::vector<T> others(other_first, other_last);
+  std::vector<bool> is_paired(others.size());
+  std::size_t first_unpaired = 0;
+  for (auto it = first; it != last; ++it) {
+    std::size_t i = first_unpaired;
+    while (i < others.size() && (is_paired[i] || !(others[i] == *it))) {
+      ++i;
+    }
+    if (i == others.size()) {
+      diff->removed.push_back(*it);
+      continue;
+    }
+    is_paired[i] = true;
+    while (first_unpaired < others.size() && is_paired[first_unpaired]) {
+      ++first_unpaired;
+    }
+  }
+  for (std::size_t i = 0; i < others.size(); ++i) {
+    if (!is_paired[i]) {
+      diff->added.push_back(others[i]);
+    }
+  }
+}
+
+// -Digests
+
 #endif  // BINARY_SEARCH_TREE_H_
@@ -0,0 +1,779 @@
+#include "binary_search_tree.h"
+#include "compact_binary_search_tree.h"
+#include "concurrent_binary_search_tree.h"
+#include "concurrent_skip_list.h"
+#include "disk_binary_search_tree.h"
+#include "frozen_binary_search_tree.h"
+#include "mapped_binary_search_tree.h"
+#include "persistent_binary_search_tree.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Google Benchmark, link with -lbenchmark -lbenchmark_main -pthread
+// --benchmark_out=results.json --benchmark_out_format=json writes results
+// for tracking over time, --benchmark_filter=Standard runs only the
+// workloads against std::set and std::multiset.
+
+namespace {
+
+// even keys 0, 2, ..., 2 * (size - 1), so half of the random lookups miss
+std::vector<int> MakeSortedKeys(int size) {
+  std::vector<int> keys(size);
+  for (int i = 0; i < size; ++i) {
+    keys[i] = 2 * i;
+  }
+  return keys;
+}
+
+std::vector<int> MakeLookups(int size) {
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<int> key(0, 2 * size);
+  std::vector<int> lookups(1 << 16);
+  for (int& lookup : lookups) {
+    lookup = key(gen);
+  }
+  return lookups;
+}
+
+template<class Tree>
+void RunLookups(benchmark::State& state, const Tree& tree, int size) {
+  std::vector<int> lookups = MakeLookups(size);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tree.contains(lookups[i]));
+    i = (i + 1) & (lookups.size() - 1);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_TreeContains(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys = MakeSortedKeys(size);
+  auto tree = BinarySearchTree<int>::from_sorted(keys.begin(), keys.end());
+  RunLookups(state, tree, size);
+}
+
+void BM_FrozenContains(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys = MakeSortedKeys(size);
+  FrozenBinarySearchTree<int> frozen(keys.begin(), keys.end());
+  RunLookups(state, frozen, size);
+}
+
+void BM_CompactContains(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys = MakeSortedKeys(size);
+  CompactBinarySearchTree<int> tree;
+  tree.reserve(size);
+  for (int key : keys) {
+    tree.insert(key);
+  }
+  RunLookups(state, tree, size);
+}
+
+// Eytzinger layout, std::greater keeps the frozen tree off the block layout
+void BM_EytzingerContains(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys = MakeSortedKeys(size);
+  std::reverse(keys.begin(), keys.end());
+  FrozenBinarySearchTree<int, std::greater<int>> frozen(keys.begin(),
+                                                        keys.end());
+  RunLookups(state, frozen, size);
+}
+
+template<class Tree>
+void RunBatchedLookups(benchmark::State& state, const Tree& tree,
+                       int size) {
+  std::vector<int> lookups = MakeLookups(size);
+  std::unique_ptr<bool[]> results(new bool[lookups.size()]);
+  for (auto _ : state) {
+    tree.contains_many(lookups, {results.get(), lookups.size()});
+    benchmark::DoNotOptimize(results.get());
+  }
+  state.SetItemsProcessed(state.iterations() * lookups.size());
+}
+
+void BM_TreeContainsMany(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys = MakeSortedKeys(size);
+  auto tree = BinarySearchTree<int>::from_sorted(keys.begin(), keys.end());
+  RunBatchedLookups(state, tree, size);
+}
+
+void BM_FrozenContainsMany(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys = MakeSortedKeys(size);
+  FrozenBinarySearchTree<int> frozen(keys.begin(), keys.end());
+  RunBatchedLookups(state, frozen, size);
+}
+
+void BM_TreeIterate(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys = MakeSortedKeys(size);
+  auto tree = BinarySearchTree<int>::from_sorted(keys.begin(), keys.end());
+  for (auto _ : state) {
+    long long sum = 0;
+    for (int value : tree) {
+      sum += value;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * size);
+}
+
+void BM_FrozenIterate(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys = MakeSortedKeys(size);
+  FrozenBinarySearchTree<int> frozen(keys.begin(), keys.end());
+  for (auto _ : state) {
+    long long sum = 0;
+    for (int value : frozen) {
+      sum += value;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * size);
+}
+
+// export from a tree built by inserts in random order, as live trees are,
+// so neighbouring values do not sit next to each other in memory
+BinarySearchTree<int> MakeShuffledTree(int size) {
+  std::vector<int> keys = MakeSortedKeys(size);
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(7));
+  BinarySearchTree<int> tree;
+  for (int key : keys) {
+    tree.insert(key);
+  }
+  return tree;
+}
+
+void BM_TreeIterateShuffled(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  BinarySearchTree<int> tree = MakeShuffledTree(size);
+  for (auto _ : state) {
+    long long sum = 0;
+    for (int value : tree) {
+      sum += value;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * size);
+}
+
+void BM_TreeToVector(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  BinarySearchTree<int> tree = MakeShuffledTree(size);
+  for (auto _ : state) {
+    std::vector<int> values = tree.to_vector();
+    benchmark::DoNotOptimize(values.data());
+  }
+  state.SetItemsProcessed(state.iterations() * size);
+}
+
+void BM_TreeCopyTo(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  BinarySearchTree<int> tree = MakeShuffledTree(size);
+  std::vector<int> buffer(size);
+  for (auto _ : state) {
+    tree.copy_to(buffer.begin());
+    benchmark::DoNotOptimize(buffer.data());
+  }
+  state.SetItemsProcessed(state.iterations() * size);
+}
+
+// drain against clear, both free every node
+void BM_TreeDrain(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> buffer(size);
+  for (auto _ : state) {
+    state.PauseTiming();
+    BinarySearchTree<int> tree = MakeShuffledTree(size);
+    state.ResumeTiming();
+    tree.drain(buffer.begin());
+    benchmark::DoNotOptimize(buffer.data());
+  }
+  state.SetItemsProcessed(state.iterations() * size);
+}
+
+void BM_TreeClear(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  for (auto _ : state) {
+    state.PauseTiming();
+    BinarySearchTree<int> tree = MakeShuffledTree(size);
+    state.ResumeTiming();
+    tree.clear();
+    benchmark::DoNotOptimize(tree.size());
+  }
+  state.SetItemsProcessed(state.iterations() * size);
+}
+
+// 1024 odd keys added to and taken out of a tree of even keys
+void BM_TreeUnionDifference(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys = MakeSortedKeys(size);
+  auto tree = BinarySearchTree<int>::from_sorted(keys.begin(), keys.end());
+  BinarySearchTree<int> odd;
+  for (int i = 0; i < 1024; ++i) {
+    odd.insert(2 * (i * (size / 1024)) + 1);
+  }
+  for (auto _ : state) {
+    tree.union_with(odd);
+    tree.difference_with(odd);
+  }
+  state.SetItemsProcessed(state.iterations() * 2 * odd.size());
+}
+
+// the same one value at a time
+void BM_TreeInsertErase(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys = MakeSortedKeys(size);
+  auto tree = BinarySearchTree<int>::from_sorted(keys.begin(), keys.end());
+  std::vector<int> odd;
+  for (int i = 0; i < 1024; ++i) {
+    odd.push_back(2 * (i * (size / 1024)) + 1);
+  }
+  for (auto _ : state) {
+    for (int value : odd) {
+      tree.insert(value);
+    }
+    for (int value : odd) {
+      tree.erase(value);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * 2 * odd.size());
+}
+
+// a stream of increasing keys, like timestamps
+void BM_TreeAppend(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  for (auto _ : state) {
+    BinarySearchTree<int> tree;
+    for (int i = 0; i < size; ++i) {
+      tree.insert(i);
+    }
+    benchmark::DoNotOptimize(tree.height());
+  }
+  state.SetItemsProcessed(state.iterations() * size);
+}
+
+// move 1024 values to another shard and back
+void BM_TreeMoveValues(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys = MakeSortedKeys(size);
+  auto tree = BinarySearchTree<int>::from_sorted(keys.begin(), keys.end());
+  BinarySearchTree<int> shard;
+  for (auto _ : state) {
+    for (int i = 0; i < 1024; ++i) {
+      int key = keys[i * (size / 1024)];
+      tree.erase(key);
+      shard.insert(key);
+    }
+    for (int i = 0; i < 1024; ++i) {
+      int key = keys[i * (size / 1024)];
+      shard.erase(key);
+      tree.insert(key);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * 2 * 1024);
+}
+
+void BM_TreeMoveNodes(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys = MakeSortedKeys(size);
+  auto tree = BinarySearchTree<int>::from_sorted(keys.begin(), keys.end());
+  BinarySearchTree<int> shard;
+  for (auto _ : state) {
+    for (int i = 0; i < 1024; ++i) {
+      shard.insert(tree.extract(keys[i * (size / 1024)]));
+    }
+    for (int i = 0; i < 1024; ++i) {
+      tree.insert(shard.extract(keys[i * (size / 1024)]));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * 2 * 1024);
+}
+
+// warm start from a snapshot in memory against mapping it from a file
+void BM_TreeDeserialize(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::stringstream stream;
+  MakeShuffledTree(size).serialize(stream);
+  std::string bytes = stream.str();
+  for (auto _ : state) {
+    std::istringstream in(bytes);
+    auto tree = BinarySearchTree<int>::deserialize(in);
+    benchmark::DoNotOptimize(tree.size());
+  }
+  state.SetItemsProcessed(state.iterations() * size);
+}
+
+void BM_MappedOpen(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::string path = "bst_bench_" + std::to_string(size) + ".bin";
+  {
+    std::ofstream out(path, std::ios::binary);
+    MakeShuffledTree(size).serialize(out);
+  }
+  for (auto _ : state) {
+    MappedBinarySearchTree<int> mapped(path);
+    benchmark::DoNotOptimize(mapped.contains(size));
+  }
+  std::remove(path.c_str());
+}
+
+// a disk tree of the keys of MakeSortedKeys(kDiskSize) in path
+constexpr int kDiskSize = 1 << 20;
+
+void BuildDiskTree(const std::string& path) {
+  std::remove(path.c_str());
+  DiskBinarySearchTree<int> disk(path);
+  for (int key : MakeSortedKeys(kDiskSize)) {
+    disk.insert(key);
+  }
+}
+
+// page faults and writes per operation of the buffer pool
+void ReportDiskIo(benchmark::State& state, const DiskIoStats& stats) {
+  auto per_op = [&](std::uint64_t count) {
+    return benchmark::Counter(static_cast<double>(count),
+                              benchmark::Counter::kAvgIterations);
+  };
+  state.counters["fetches"] = per_op(stats.fetches);
+  state.counters["faults"] = per_op(stats.faults);
+  state.counters["writes"] = per_op(stats.writes);
+}
+
+// random point lookups through a pool of range(0) pages, from one that
+// holds only the path down to one that holds the whole file
+void BM_DiskLookup(benchmark::State& state) {
+  std::string path = "bst_bench_disk.db";
+  BuildDiskTree(path);
+  DiskBinarySearchTree<int> disk(path,
+                                 static_cast<std::size_t>(state.range(0)));
+  std::vector<int> lookups = MakeLookups(kDiskSize);
+  std::size_t i = 0;
+  for (int lookup : lookups) {
+    benchmark::DoNotOptimize(disk.contains(lookup));
+  }
+  disk.reset_io_stats();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(disk.contains(lookups[i]));
+    i = (i + 1) & (lookups.size() - 1);
+  }
+  ReportDiskIo(state, disk.io_stats());
+  state.SetItemsProcessed(state.iterations());
+  std::remove(path.c_str());
+}
+
+// scans of 1000 values from random starting points
+void BM_DiskScan(benchmark::State& state) {
+  constexpr int kScanLength = 1000;
+  std::string path = "bst_bench_disk.db";
+  BuildDiskTree(path);
+  DiskBinarySearchTree<int> disk(path,
+                                 static_cast<std::size_t>(state.range(0)));
+  std::vector<int> lookups = MakeLookups(kDiskSize);
+  std::size_t i = 0;
+  disk.reset_io_stats();
+  for (auto _ : state) {
+    long long sum = 0;
+    auto it = disk.lower_bound(lookups[i]);
+    for (int j = 0; j < kScanLength && it != disk.end(); ++j, ++it) {
+      sum += *it;
+    }
+    benchmark::DoNotOptimize(sum);
+    i = (i + 1) & (lookups.size() - 1);
+  }
+  ReportDiskIo(state, disk.io_stats());
+  state.SetItemsProcessed(state.iterations() * kScanLength);
+  std::remove(path.c_str());
+}
+
+// trees that differ only in their largest value
+template<class Tree>
+void BM_TreeCompareUnequal(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys = MakeSortedKeys(size);
+  auto tree = Tree::from_sorted(keys.begin(), keys.end());
+  Tree other = tree;
+  other.erase(keys.back());
+  other.insert(keys.back() + 1);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tree == other);
+  }
+}
+
+// a replica of 1 << 20 keys that missed range(0) inserts and erases
+MerkleTree<int> MakeReplica(const MerkleTree<int>& tree, int changes) {
+  MerkleTree<int> replica = tree;
+  std::mt19937 gen(25);
+  std::uniform_int_distribution<int> key(0, 2 * tree.size());
+  for (int i = 0; i < changes; ++i) {
+    if (i % 2 == 0) {
+      replica.insert(key(gen) | 1);
+    } else {
+      replica.erase(key(gen) & ~1);
+    }
+  }
+  return replica;
+}
+
+void BM_MerkleDiff(benchmark::State& state) {
+  std::vector<int> keys = MakeSortedKeys(1 << 20);
+  auto tree = MerkleTree<int>::from_sorted(keys.begin(), keys.end());
+  MerkleTree<int> replica =
+      MakeReplica(tree, static_cast<int>(state.range(0)));
+  for (auto _ : state) {
+    auto diff = tree.diff(replica);
+    benchmark::DoNotOptimize(diff.added.data());
+  }
+}
+
+// the same by shipping all values and comparing sorted vectors
+void BM_VectorDiff(benchmark::State& state) {
+  std::vector<int> keys = MakeSortedKeys(1 << 20);
+  auto tree = MerkleTree<int>::from_sorted(keys.begin(), keys.end());
+  MerkleTree<int> replica =
+      MakeReplica(tree, static_cast<int>(state.range(0)));
+  for (auto _ : state) {
+    std::vector<int> values = tree.to_vector();
+    std::vector<int> replica_values = replica.to_vector();
+    std::vector<int> added;
+    std::vector<int> removed;
+    std::set_difference(replica_values.begin(), replica_values.end(),
+                        values.begin(), values.end(),
+                        std::back_inserter(added));
+    std::set_difference(values.begin(), values.end(),
+                        replica_values.begin(), replica_values.end(),
+                        std::back_inserter(removed));
+    benchmark::DoNotOptimize(added.data());
+  }
+}
+
+// a consistent copy for a reporter, followed by one change to the live tree
+void BM_TreeCopy(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys = MakeSortedKeys(size);
+  auto tree = BinarySearchTree<int>::from_sorted(keys.begin(), keys.end());
+  for (auto _ : state) {
+    BinarySearchTree<int> copy = tree;
+    tree.insert(1);
+    tree.erase(1);
+    benchmark::DoNotOptimize(copy.size());
+  }
+}
+
+void BM_PersistentSnapshot(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  PersistentBinarySearchTree<int> tree;
+  for (int key : MakeSortedKeys(size)) {
+    tree.insert(key);
+  }
+  for (auto _ : state) {
+    PersistentBinarySearchTree<int> snapshot = tree.snapshot();
+    tree.insert(1);
+    tree.erase(1);
+    benchmark::DoNotOptimize(snapshot.size());
+  }
+}
+
+// lookups from 1 to N reader threads into one shared tree of 1 << 20 keys
+void BM_ConcurrentContains(benchmark::State& state) {
+  constexpr int kSize = 1 << 20;
+  static ConcurrentBinarySearchTree<int>* tree = [] {
+    auto* tree = new ConcurrentBinarySearchTree<int>;
+    for (int key : MakeSortedKeys(kSize)) {
+      tree->insert(key);
+    }
+    return tree;
+  }();
+  RunLookups(state, *tree, kSize);
+}
+
+// the same under a reader-writer lock, the baseline for the lock-free reads
+void BM_SharedMutexContains(benchmark::State& state) {
+  constexpr int kSize = 1 << 20;
+  static std::vector<int> keys = MakeSortedKeys(kSize);
+  static auto tree = BinarySearchTree<int>::from_sorted(keys.begin(),
+                                                        keys.end());
+  static std::shared_mutex mutex;
+  std::vector<int> lookups = MakeLookups(kSize);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    std::shared_lock lock(mutex);
+    benchmark::DoNotOptimize(tree.contains(lookups[i]));
+    i = (i + 1) & (lookups.size() - 1);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// writers from 1 to N threads, each inserts and erases random keys of its
+// own into one shared set that holds about 1 << 16 keys
+template<class Insert, class Erase>
+void RunChurn(benchmark::State& state, Insert insert, Erase erase) {
+  std::mt19937 gen(state.thread_index());
+  std::uniform_int_distribution<int> key(0, 1 << 17);
+  for (auto _ : state) {
+    int x = key(gen) * state.threads() + state.thread_index();
+    insert(x);
+    erase(x + state.threads());
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+}
+
+void BM_SkipListChurn(benchmark::State& state) {
+  static ConcurrentSkipList<int> list;
+  RunChurn(state, [](int x) { list.insert(x); },
+           [](int x) { list.erase(x); });
+}
+
+// the same through a mutex, the baseline for the lock-free writes
+void BM_MutexTreeChurn(benchmark::State& state) {
+  static BinarySearchTree<int> tree;
+  static std::mutex mutex;
+  RunChurn(state,
+           [](int x) {
+             std::lock_guard<std::mutex> lock(mutex);
+             tree.insert(x);
+           },
+           [](int x) {
+             std::lock_guard<std::mutex> lock(mutex);
+             tree.erase(x);
+           });
+}
+
+// Standard workloads, the same code runs on the tree and on the std
+// containers it replaces. Keys are distinct unless said otherwise.
+
+std::vector<int> MakeShuffledKeys(int size) {
+  std::vector<int> keys = MakeSortedKeys(size);
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(11));
+  return keys;
+}
+
+template<class Set>
+Set MakeSet(const std::vector<int>& keys) {
+  Set set;
+  for (int key : keys) {
+    set.insert(key);
+  }
+  return set;
+}
+
+// build a container from keys, destroying it is not timed
+template<class Set>
+void RunInserts(benchmark::State& state, const std::vector<int>& keys) {
+  for (auto _ : state) {
+    Set set = MakeSet<Set>(keys);
+    benchmark::DoNotOptimize(set.size());
+    state.PauseTiming();
+    set = Set();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+template<class Set>
+void BM_StandardInsertRandom(benchmark::State& state) {
+  RunInserts<Set>(state, MakeShuffledKeys(static_cast<int>(state.range(0))));
+}
+
+template<class Set>
+void BM_StandardInsertSorted(benchmark::State& state) {
+  RunInserts<Set>(state, MakeSortedKeys(static_cast<int>(state.range(0))));
+}
+
+template<class Set>
+void BM_StandardInsertReverse(benchmark::State& state) {
+  std::vector<int> keys = MakeSortedKeys(static_cast<int>(state.range(0)));
+  std::reverse(keys.begin(), keys.end());
+  RunInserts<Set>(state, keys);
+}
+
+// lookups where the k-th most popular key is hit with weight 1 / k, which
+// keeps the hot keys in cache like real traffic does
+std::vector<int> MakeZipfLookups(int size) {
+  std::vector<double> cdf(size);
+  double total = 0;
+  for (int i = 0; i < size; ++i) {
+    total += 1.0 / (i + 1);
+    cdf[i] = total;
+  }
+  std::vector<int> popular = MakeShuffledKeys(size);
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<double> point(0, total);
+  std::vector<int> lookups(1 << 16);
+  for (int& lookup : lookups) {
+    auto rank = std::lower_bound(cdf.begin(), cdf.end(), point(gen))
+        - cdf.begin();
+    lookup = popular[std::min<std::ptrdiff_t>(rank, size - 1)];
+  }
+  return lookups;
+}
+
+template<class Set>
+void BM_StandardZipfLookup(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  Set set = MakeSet<Set>(MakeShuffledKeys(size));
+  std::vector<int> lookups = MakeZipfLookups(size);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(set.contains(lookups[i]));
+    i = (i + 1) & (lookups.size() - 1);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// every step inserts a random key and erases the oldest one, so the size
+// stays the same
+template<class Set>
+void BM_StandardChurn(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys = MakeShuffledKeys(size);
+  Set set = MakeSet<Set>(keys);
+  std::mt19937 gen(5);
+  std::uniform_int_distribution<int> key(0, 2 * size);
+  std::size_t oldest = 0;
+  for (auto _ : state) {
+    set.erase(set.find(keys[oldest]));
+    keys[oldest] = key(gen);
+    set.insert(keys[oldest]);
+    oldest = oldest + 1 == keys.size() ? 0 : oldest + 1;
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+}
+
+template<class Set>
+void BM_StandardIterate(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  Set set = MakeSet<Set>(MakeShuffledKeys(size));
+  for (auto _ : state) {
+    long long sum = 0;
+    for (int value : set) {
+      sum += value;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * size);
+}
+
+template<class Set>
+void BM_StandardCopyDestroy(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  Set set = MakeSet<Set>(MakeShuffledKeys(size));
+  for (auto _ : state) {
+    Set copy = set;
+    benchmark::DoNotOptimize(copy.size());
+  }
+  state.SetItemsProcessed(state.iterations() * size);
+}
+
+// 16 distinct keys, each size / 16 times
+template<class Set>
+void BM_StandardCountDuplicates(benchmark::State& state) {
+  int size = static_cast<int>(state.range(0));
+  std::vector<int> keys(size);
+  for (int i = 0; i < size; ++i) {
+    keys[i] = i % 16;
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(3));
+  Set set = MakeSet<Set>(keys);
+  int key = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(set.count(key));
+    key = (key + 1) & 15;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// 1K to 10M elements
+void StandardSizes(benchmark::internal::Benchmark* benchmark) {
+  for (int size = 1000; size <= 10000000; size *= 10) {
+    benchmark->Arg(size);
+  }
+}
+
+using Tree = BinarySearchTree<int>;
+using RankTree = OrderStatisticsTree<int>;
+using StdSet = std::set<int>;
+using StdMultiset = std::multiset<int>;
+
+}  // namespace
+
+BENCHMARK(BM_TreeContains)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_FrozenContains)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_CompactContains)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_EytzingerContains)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_TreeContainsMany)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_FrozenContainsMany)
+    ->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_TreeIterate)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_FrozenIterate)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_TreeIterateShuffled)
+    ->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_TreeToVector)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_TreeCopyTo)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_TreeDrain)->RangeMultiplier(16)->Range(1 << 10, 1 << 20);
+BENCHMARK(BM_TreeClear)->RangeMultiplier(16)->Range(1 << 10, 1 << 20);
+BENCHMARK(BM_TreeUnionDifference)
+    ->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_TreeInsertErase)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_TreeAppend)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_TreeMoveValues)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_TreeMoveNodes)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_TreeDeserialize)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_MappedOpen)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_DiskLookup)->RangeMultiplier(8)->Range(8, 4096);
+BENCHMARK(BM_DiskScan)->RangeMultiplier(8)->Range(8, 4096);
+BENCHMARK_TEMPLATE(BM_TreeCompareUnequal, BinarySearchTree<int>)
+    ->RangeMultiplier(16)->Range(1 << 10, 1 << 20);
+BENCHMARK_TEMPLATE(BM_TreeCompareUnequal, MerkleTree<int>)
+    ->RangeMultiplier(16)->Range(1 << 10, 1 << 20);
+BENCHMARK(BM_MerkleDiff)->RangeMultiplier(10)->Range(1, 10000);
+BENCHMARK(BM_VectorDiff)->RangeMultiplier(10)->Range(1, 10000);
+BENCHMARK(BM_TreeCopy)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_PersistentSnapshot)
+    ->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_ConcurrentContains)->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK(BM_SharedMutexContains)->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK(BM_SkipListChurn)->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK(BM_MutexTreeChurn)->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_StandardInsertRandom, Tree)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardInsertRandom, StdSet)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardInsertRandom, StdMultiset)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardInsertSorted, Tree)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardInsertSorted, StdSet)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardInsertSorted, StdMultiset)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardInsertReverse, Tree)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardInsertReverse, StdSet)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardInsertReverse, StdMultiset)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardZipfLookup, Tree)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardZipfLookup, StdSet)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardZipfLookup, StdMultiset)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardChurn, Tree)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardChurn, StdMultiset)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardIterate, Tree)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardIterate, StdSet)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardIterate, StdMultiset)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardCopyDestroy, Tree)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardCopyDestroy, StdSet)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardCopyDestroy, StdMultiset)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardCountDuplicates, Tree)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardCountDuplicates, RankTree)->Apply(StandardSizes);
+BENCHMARK_TEMPLATE(BM_StandardCountDuplicates, StdMultiset)
+    ->Apply(StandardSizes);
@@ -1,8 +1,32 @@
 #include "binary_search_tree.h"
+#include "binary_search_map.h"
+#include "compact_binary_search_tree.h"
+#include "concurrent_binary_search_tree.h"
+#include "concurrent_skip_list.h"
+#include "disk_binary_search_tree.h"
+#include "frozen_binary_search_tree.h"
+#include "mapped_binary_search_tree.h"
+#include "node_pool.h"
+#include "persistent_binary_search_tree.h"
 
 #include <gtest/gtest.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
 
 class TrickyClass {
  public:
@@ -317,4 +341,1858 @@ TEST(BinarySearchTree, MiscTests) {
     bst_int.erase(1);
     EXPECT_EQ(bst_int.to_vector(), std::vector<int>({}));
   }
-}
\ No newline at end of file
+}
+TEST(BinarySearchTree, BalancingTests) {
+  {
+    BinarySearchTree<int> bst;
+    for (int i = 0; i < (1 << 16); ++i) {
+      bst.insert(i);
+    }
+    EXPECT_EQ(bst.size(), 1 << 16);
+    EXPECT_LE(bst.height(), 24);
+    EXPECT_EQ(*bst.begin(), 0);
+    EXPECT_EQ(*(--bst.end()), (1 << 16) - 1);
+
+    for (int i = 0; i < (1 << 16); i += 2) {
+      bst.erase(i);
+    }
+    EXPECT_EQ(bst.size(), 1 << 15);
+    EXPECT_LE(bst.height(), 23);
+    EXPECT_EQ(*bst.begin(), 1);
+    EXPECT_EQ(*(--bst.end()), (1 << 16) - 1);
+  }
+  {
+    BinarySearchTree<int> bst = {2, 1, 3};
+    bst.erase(2);
+    EXPECT_EQ(*(--bst.end()), 3);
+    EXPECT_EQ(bst.to_vector(), std::vector<int>({1, 3}));
+  }
+  {
+    BinarySearchTree<int, std::less<int>, std::allocator<int>, NoBalancing> bst;
+    for (int i = 0; i < 100; ++i) {
+      bst.insert(i);
+    }
+    EXPECT_EQ(bst.height(), 100);
+  }
+}
+
+template<class Policy>
+void CheckAgainstMultiset() {
+  std::mt19937 gen(17);
+  std::uniform_int_distribution<int> value(0, 300);
+  BinarySearchTree<int, std::less<int>, std::allocator<int>, Policy> bst;
+  std::multiset<int> expected;
+  for (int i = 0; i < 5000; ++i) {
+    int x = value(gen);
+    if (gen() % 3 == 0) {
+      bst.erase(x);
+      auto it = expected.find(x);
+      if (it != expected.end()) {
+        expected.erase(it);
+      }
+    } else {
+      bst.insert(x);
+      expected.insert(x);
+    }
+    ASSERT_EQ(bst.size(), static_cast<int>(expected.size()));
+    if (!expected.empty()) {
+      ASSERT_EQ(*bst.begin(), *expected.begin());
+      ASSERT_EQ(*(--bst.end()), *expected.rbegin());
+    }
+  }
+  EXPECT_EQ(bst.to_vector(),
+            std::vector<int>(expected.begin(), expected.end()));
+  std::vector<int> reversed;
+  for (auto it = bst.end(); it != bst.begin();) {
+    reversed.push_back(*(--it));
+  }
+  EXPECT_TRUE(std::equal(reversed.begin(), reversed.end(),
+                         expected.rbegin(), expected.rend()));
+  for (int x = 0; x <= 300; ++x) {
+    ASSERT_EQ(bst.count(x), static_cast<int>(expected.count(x)));
+    ASSERT_EQ(bst.contains(x), expected.count(x) > 0);
+  }
+  BinarySearchTree<int, std::less<int>, std::allocator<int>, Policy> copy =
+      bst;
+  EXPECT_EQ(copy, bst);
+}
+
+TEST(BinarySearchTree, RandomOperationsTests) {
+  CheckAgainstMultiset<AvlBalancing>();
+  CheckAgainstMultiset<NoBalancing>();
+  CheckAgainstMultiset<TreePolicy<AvlBalancing, OrderStatistics>>();
+  CheckAgainstMultiset<TreePolicy<NoBalancing, OrderStatistics>>();
+}
+
+struct alignas(64) CacheLine {
+  int key;
+
+  bool operator<(const CacheLine& rhs) const {
+    return key < rhs.key;
+  }
+};
+
+TEST(BinarySearchTree, PoolAllocatorTests) {
+  {
+    BinarySearchTree<int, std::less<int>, PoolAllocator<int>> bst;
+    for (int i = 0; i < 1000; ++i) {
+      bst.insert(i);
+    }
+    const int* address = &*bst.find(500);
+    bst.erase(500);
+    bst.insert(1000);
+    EXPECT_EQ(&*bst.find(1000), address);
+
+    BinarySearchTree<int, std::less<int>, PoolAllocator<int>> copy = bst;
+    EXPECT_EQ(copy, bst);
+    EXPECT_FALSE(copy.get_allocator() == bst.get_allocator());
+
+    bst.clear();
+    EXPECT_TRUE(bst.empty());
+    bst.insert(7);
+    EXPECT_EQ(bst.to_vector(), std::vector<int>({7}));
+
+    bst = std::move(copy);
+    EXPECT_EQ(bst.size(), 1000);
+    EXPECT_TRUE(copy.empty());
+    copy.insert(3);
+    EXPECT_EQ(copy.to_vector(), std::vector<int>({3}));
+  }
+  {
+    PoolAllocator<std::string> allocator(1024);
+    BinarySearchTree<std::string, std::less<std::string>,
+                     PoolAllocator<std::string>> bst(allocator);
+    for (int i = 0; i < 300; ++i) {
+      bst.insert(std::string(40, static_cast<char>('a' + i % 26)));
+    }
+    EXPECT_EQ(bst.count(std::string(40, 'a')), 12);
+    EXPECT_TRUE(bst.get_allocator() == allocator);
+    bst.clear();
+    EXPECT_TRUE(bst.empty());
+  }
+  {
+    BinarySearchTree<CacheLine, std::less<>, PoolAllocator<CacheLine>> bst(
+        PoolAllocator<CacheLine>(1024));
+    for (int i = 0; i < 100; ++i) {
+      bst.insert(CacheLine{i});
+    }
+    for (const CacheLine& value : bst) {
+      EXPECT_EQ(reinterpret_cast<std::uintptr_t>(&value) % 64, 0);
+    }
+    EXPECT_GE(bst.get_allocator().slab_bytes(), 100 * 64);
+    bst.erase(CacheLine{50});
+    bst.insert(CacheLine{100});
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(&*bst.find(CacheLine{100})) % 64,
+              0);
+    bst.clear();
+    EXPECT_TRUE(bst.empty());
+  }
+}
+
+struct Record {
+  int id;
+  std::string payload;
+};
+
+struct RecordById {
+  using is_transparent = void;
+
+  bool operator()(const Record& lhs, const Record& rhs) const {
+    return lhs.id < rhs.id;
+  }
+  bool operator()(const Record& lhs, int rhs) const {
+    return lhs.id < rhs;
+  }
+  bool operator()(int lhs, const Record& rhs) const {
+    return lhs < rhs.id;
+  }
+};
+
+TEST(BinarySearchTree, CompareTests) {
+  {
+    BinarySearchTree<TrickyClassTwo> bst =
+        {TrickyClassTwo(3), TrickyClassTwo(1), TrickyClassTwo(3)};
+    EXPECT_TRUE(bst.contains(TrickyClassTwo(1)));
+    EXPECT_FALSE(bst.contains(TrickyClassTwo(2)));
+    EXPECT_EQ(bst.count(TrickyClassTwo(3)), 2);
+    bst.erase(TrickyClassTwo(3));
+    EXPECT_EQ(bst.count(TrickyClassTwo(3)), 1);
+  }
+  {
+    BinarySearchTree<int, std::greater<int>> bst = {1, 5, 3, 5, 2};
+    EXPECT_EQ(bst.to_vector(), std::vector<int>({5, 5, 3, 2, 1}));
+    EXPECT_EQ(bst.count(5), 2);
+    EXPECT_EQ(*bst.find(3), 3);
+  }
+  {
+    BinarySearchTree<Record, RecordById> bst;
+    bst.insert(Record{2, "two"});
+    bst.insert(Record{1, "one"});
+    bst.insert(Record{2, "deux"});
+    EXPECT_TRUE(bst.contains(1));
+    EXPECT_FALSE(bst.contains(3));
+    EXPECT_EQ(bst.count(2), 2);
+    EXPECT_EQ(bst.find(1)->payload, "one");
+    bst.erase(2);
+    EXPECT_EQ(bst.count(2), 1);
+    EXPECT_EQ(bst.find(7), bst.end());
+  }
+}
+
+TEST(BinarySearchMap, MapTests) {
+  {
+    BinarySearchMap<std::string, int> map;
+    EXPECT_TRUE(map.empty());
+    map["b"] = 2;
+    map["a"] = 1;
+    ++map["b"];
+    EXPECT_EQ(map.size(), 2);
+    EXPECT_EQ(map.at("b"), 3);
+    EXPECT_TRUE(map.contains("a"));
+    EXPECT_FALSE(map.contains("c"));
+    EXPECT_THROW(map.at("c"), std::out_of_range);
+
+    auto [it, inserted] = map.try_emplace("a", 10);
+    EXPECT_FALSE(inserted);
+    EXPECT_EQ(it->second, 1);
+    std::tie(it, inserted) = map.try_emplace("c", 3);
+    EXPECT_TRUE(inserted);
+    EXPECT_EQ(it->first, "c");
+
+    std::tie(it, inserted) = map.insert_or_assign("a", 7);
+    EXPECT_FALSE(inserted);
+    EXPECT_EQ(map.at("a"), 7);
+    std::tie(it, inserted) = map.insert_or_assign("d", 4);
+    EXPECT_TRUE(inserted);
+
+    for (auto& [key, value] : map) {
+      value *= 10;
+    }
+    std::vector<std::pair<std::string, int>> expected =
+        {{"a", 70}, {"b", 30}, {"c", 30}, {"d", 40}};
+    std::vector<std::pair<std::string, int>> actual;
+    for (const auto& value : std::as_const(map)) {
+      actual.emplace_back(value.first, value.second);
+    }
+    EXPECT_EQ(actual, expected);
+
+    EXPECT_EQ(map.erase("b"), 1);
+    EXPECT_EQ(map.erase("b"), 0);
+    map.erase(map.find("a"));
+    EXPECT_EQ(map.size(), 2);
+    EXPECT_EQ(map.begin()->first, "c");
+  }
+  {
+    BinarySearchMap<int, std::string, std::greater<int>> map =
+        {{1, "one"}, {3, "three"}, {2, "two"}, {1, "uno"}};
+    EXPECT_EQ(map.size(), 3);
+    EXPECT_EQ(map.begin()->second, "three");
+    EXPECT_EQ(map[1], "one");
+    BinarySearchMap<int, std::string, std::greater<int>> copy = map;
+    EXPECT_EQ(copy, map);
+    copy[4];
+    EXPECT_NE(copy, map);
+  }
+}
+
+int allocation_count = 0;
+
+template<class T>
+struct CountingAllocator {
+  using value_type = T;
+
+  CountingAllocator() = default;
+  template<class U>
+  CountingAllocator(const CountingAllocator<U>&) {}
+
+  T* allocate(std::size_t n) {
+    ++allocation_count;
+    return std::allocator<T>().allocate(n);
+  }
+  void deallocate(T* pointer, std::size_t n) {
+    std::allocator<T>().deallocate(pointer, n);
+  }
+
+  template<class U>
+  bool operator==(const CountingAllocator<U>&) const {
+    return true;
+  }
+};
+
+TEST(BinarySearchTree, InsertUniqueTests) {
+  {
+    BinarySearchTree<TrickyClass> bst;
+    auto [it, inserted] = bst.insert_unique(TrickyClass(3));
+    EXPECT_TRUE(inserted);
+    EXPECT_EQ(*it, TrickyClass(3));
+    std::tie(it, inserted) = bst.insert_unique(TrickyClass(3));
+    EXPECT_FALSE(inserted);
+    EXPECT_EQ(it, bst.find(TrickyClass(3)));
+    std::tie(it, inserted) = bst.emplace_unique(1);
+    EXPECT_TRUE(inserted);
+    std::tie(it, inserted) = bst.emplace_unique(1);
+    EXPECT_FALSE(inserted);
+    EXPECT_EQ(bst.size(), 2);
+    EXPECT_EQ(bst.to_vector(), std::vector<TrickyClass>(
+        {TrickyClass(1), TrickyClass(3)}));
+  }
+  {
+    BinarySearchTree<int, std::less<int>, CountingAllocator<int>> bst;
+    for (int i = 0; i < 100; ++i) {
+      bst.insert_unique(i % 10);
+    }
+    EXPECT_EQ(bst.size(), 10);
+    EXPECT_EQ(allocation_count, 10);
+    for (int i = 0; i < 100; ++i) {
+      bst.emplace_unique(i % 20);
+    }
+    EXPECT_EQ(bst.size(), 20);
+    EXPECT_EQ(allocation_count, 20);
+  }
+}
+
+TEST(BinarySearchTree, BoundsTests) {
+  {
+    BinarySearchTree<int> bst = {5, 1, 3, 3, 7, 3, 9};
+    EXPECT_EQ(*bst.lower_bound(3), 3);
+    EXPECT_EQ(*bst.upper_bound(3), 5);
+    EXPECT_EQ(*bst.lower_bound(4), 5);
+    EXPECT_EQ(*bst.lower_bound(0), 1);
+    EXPECT_EQ(bst.lower_bound(10), bst.end());
+    EXPECT_EQ(bst.upper_bound(9), bst.end());
+    auto [first, last] = bst.equal_range(3);
+    EXPECT_EQ(std::distance(first, last), 3);
+    EXPECT_EQ(first, bst.lower_bound(3));
+    auto [first_2, last_2] = bst.equal_range(4);
+    EXPECT_EQ(first_2, last_2);
+  }
+  {
+    BinarySearchTree<int> bst;
+    for (int i = 0; i < 100000; ++i) {
+      bst.insert(i % 4);
+    }
+    EXPECT_EQ(bst.count(2), 25000);
+    EXPECT_EQ(bst.count(4), 0);
+  }
+  {
+    BinarySearchTree<Record, RecordById> bst;
+    bst.insert(Record{1, "one"});
+    bst.insert(Record{3, "three"});
+    EXPECT_EQ(bst.lower_bound(2)->payload, "three");
+    EXPECT_EQ(bst.upper_bound(1)->payload, "three");
+    auto [first, last] = bst.equal_range(1);
+    EXPECT_EQ(first->payload, "one");
+    EXPECT_EQ(last->payload, "three");
+  }
+}
+
+TEST(BinarySearchTree, OrderStatisticsTests) {
+  {
+    OrderStatisticsTree<int> bst;
+    EXPECT_EQ(bst.select(0), bst.end());
+    EXPECT_EQ(bst.rank(5), 0);
+    EXPECT_EQ(bst.index_of(bst.end()), 0);
+  }
+  {
+    std::mt19937 gen(3);
+    OrderStatisticsTree<int> bst;
+    std::vector<int> expected;
+    for (int i = 0; i < 2000; ++i) {
+      int x = static_cast<int>(gen() % 500);
+      if (gen() % 4 == 0) {
+        bst.erase(x);
+        auto it = std::lower_bound(expected.begin(), expected.end(), x);
+        if (it != expected.end() && *it == x) {
+          expected.erase(it);
+        }
+      } else {
+        bst.insert(x);
+        expected.insert(
+            std::upper_bound(expected.begin(), expected.end(), x), x);
+      }
+    }
+    OrderStatisticsTree<int> copy = bst;
+    int size = static_cast<int>(expected.size());
+    for (int k = 0; k < size; ++k) {
+      ASSERT_EQ(*bst.select(k), expected[k]);
+      ASSERT_EQ(*copy.select(k), expected[k]);
+      ASSERT_EQ(bst.index_of(bst.select(k)), k);
+    }
+    EXPECT_EQ(bst.select(size), bst.end());
+    EXPECT_EQ(bst.index_of(bst.end()), size);
+    for (int x = -1; x <= 500; ++x) {
+      auto lower = std::lower_bound(expected.begin(), expected.end(), x);
+      ASSERT_EQ(bst.rank(x), lower - expected.begin());
+    }
+    EXPECT_EQ(bst.distance(bst.begin(), bst.end()), size);
+
+    auto it = bst.begin();
+    bst.advance(it, size / 2);
+    EXPECT_EQ(*it, expected[size / 2]);
+    bst.advance(it, -size / 4);
+    EXPECT_EQ(*it, expected[size / 2 - size / 4]);
+  }
+  {
+    OrderStatisticsTree<Record, RecordById> bst;
+    for (int i = 0; i < 10; ++i) {
+      bst.insert(Record{i * 2, "r"});
+    }
+    EXPECT_EQ(bst.rank(7), 4);
+    EXPECT_EQ(bst.select(4)->id, 8);
+  }
+}
+
+template<class Policy>
+void CheckRangeErase() {
+  std::mt19937 gen(11);
+  for (int round = 0; round < 200; ++round) {
+    BinarySearchTree<int, std::less<int>, std::allocator<int>, Policy> bst;
+    std::multiset<int> expected;
+    int n = static_cast<int>(gen() % 300);
+    for (int i = 0; i < n; ++i) {
+      int x = static_cast<int>(gen() % 100);
+      bst.insert(x);
+      expected.insert(x);
+    }
+    int lo = static_cast<int>(gen() % 110) - 5;
+    int hi = static_cast<int>(gen() % 110) - 5;
+    int erased = bst.erase_range(lo, hi);
+    if (lo < hi) {
+      auto first = expected.lower_bound(lo);
+      auto last = expected.lower_bound(hi);
+      ASSERT_EQ(erased, std::distance(first, last));
+      expected.erase(first, last);
+    } else {
+      ASSERT_EQ(erased, 0);
+    }
+    ASSERT_EQ(bst.size(), static_cast<int>(expected.size()));
+    ASSERT_EQ(bst.to_vector(),
+              std::vector<int>(expected.begin(), expected.end()));
+    if (!expected.empty()) {
+      ASSERT_EQ(*bst.begin(), *expected.begin());
+      ASSERT_EQ(*(--bst.end()), *expected.rbegin());
+    }
+    if constexpr (!std::is_same_v<Policy, NoBalancing>) {
+      ASSERT_LE(bst.height(), 1.45 * std::log2(bst.size() + 2));
+    }
+
+    // the tree stays usable after the split and join
+    for (int i = 0; i < 50; ++i) {
+      int x = static_cast<int>(gen() % 100);
+      bst.insert(x);
+      expected.insert(x);
+    }
+    ASSERT_EQ(bst.to_vector(),
+              std::vector<int>(expected.begin(), expected.end()));
+  }
+}
+
+TEST(BinarySearchTree, RangeTests) {
+  CheckRangeErase<AvlBalancing>();
+  CheckRangeErase<NoBalancing>();
+  CheckRangeErase<TreePolicy<AvlBalancing, OrderStatistics>>();
+  {
+    BinarySearchTree<int> bst;
+    for (int i = 0; i < 1 << 12; ++i) {
+      bst.insert(i);
+    }
+    auto first = bst.find(100);
+    auto last = bst.find(4000);
+    EXPECT_EQ(*bst.erase(first, last), 4000);
+    EXPECT_EQ(bst.size(), 196);
+    EXPECT_LE(bst.height(), 11);
+    EXPECT_EQ(bst.erase(bst.begin(), bst.begin()), bst.begin());
+    EXPECT_EQ(bst.erase(bst.begin(), bst.end()), bst.end());
+    EXPECT_TRUE(bst.empty());
+  }
+  {
+    OrderStatisticsTree<int> bst;
+    for (int i = 0; i < 1000; ++i) {
+      bst.insert(i);
+    }
+    bst.erase_range(250, 750);
+    EXPECT_EQ(*bst.select(250), 750);
+    EXPECT_EQ(bst.rank(800), 300);
+  }
+  {
+    BinarySearchTree<int> bst{5, 1, 9, 3, 7, 3};
+    std::vector<int> visited;
+    bst.for_each_in_range(3, 8, [&](int x) { visited.push_back(x); });
+    EXPECT_EQ(visited, std::vector<int>({3, 3, 5, 7}));
+    visited.clear();
+    bst.for_each_in_range(10, 20, [&](int x) { visited.push_back(x); });
+    EXPECT_TRUE(visited.empty());
+  }
+  {
+    BinarySearchTree<Record, RecordById> bst;
+    for (int i = 0; i < 10; ++i) {
+      bst.insert(Record{i, "r"});
+    }
+    EXPECT_EQ(bst.erase_range(2, 5), 3);
+    int sum = 0;
+    bst.for_each_in_range(0, 7, [&](const Record& r) { sum += r.id; });
+    EXPECT_EQ(sum, 0 + 1 + 5 + 6);
+  }
+}
+
+TEST(BinarySearchTree, BulkConstructionTests) {
+  {
+    std::vector<int> sorted(100000);
+    for (int i = 0; i < static_cast<int>(sorted.size()); ++i) {
+      sorted[i] = i / 3;
+    }
+    BinarySearchTree<int, std::less<int>, std::allocator<int>, NoBalancing>
+        bst(sorted.begin(), sorted.end());
+    EXPECT_EQ(bst.size(), 100000);
+    EXPECT_EQ(bst.height(), 17);
+    EXPECT_EQ(bst.to_vector(), sorted);
+    EXPECT_EQ(bst.count(5), 3);
+
+    auto from_sorted = BinarySearchTree<int>::from_sorted(sorted.begin(),
+                                                          sorted.end());
+    EXPECT_EQ(from_sorted.height(), 17);
+    EXPECT_EQ(*from_sorted.begin(), 0);
+    EXPECT_EQ(*(--from_sorted.end()), 33333);
+    for (int i = 0; i < 1000; ++i) {
+      from_sorted.insert(i);
+      from_sorted.erase(i * 7);
+    }
+    EXPECT_LE(from_sorted.height(), 24);
+  }
+  {
+    std::vector<int> unsorted = {5, 3, 9, 1, 3, 7};
+    BinarySearchTree<int> bst(unsorted.begin(), unsorted.end());
+    EXPECT_EQ(bst.to_vector(), std::vector<int>({1, 3, 3, 5, 7, 9}));
+
+    BinarySearchTree<int, std::greater<int>> reversed(unsorted.begin(),
+                                                      unsorted.end());
+    EXPECT_EQ(reversed.to_vector(), std::vector<int>({9, 7, 5, 3, 3, 1}));
+  }
+  {
+    std::istringstream input("1 2 3 4 5 6 7");
+    BinarySearchTree<int> bst{std::istream_iterator<int>(input),
+                              std::istream_iterator<int>()};
+    EXPECT_EQ(bst.size(), 7);
+    EXPECT_EQ(bst.height(), 3);
+  }
+  {
+    std::vector<int> empty;
+    OrderStatisticsTree<int> bst(empty.begin(), empty.end());
+    EXPECT_TRUE(bst.empty());
+    EXPECT_EQ(bst.begin(), bst.end());
+
+    std::vector<int> sorted = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    auto stats = OrderStatisticsTree<int>::from_sorted(sorted.begin(),
+                                                       sorted.end());
+    EXPECT_EQ(*stats.select(6), 7);
+    EXPECT_EQ(stats.rank(4), 3);
+  }
+}
+
+TEST(BinarySearchTree, CopyAndClearTests) {
+  {
+    BinarySearchTree<int, std::less<int>, std::allocator<int>, NoBalancing>
+        chain;
+    for (int i = 0; i < 5000; ++i) {
+      chain.insert(i);
+    }
+    auto copy = chain;
+    EXPECT_EQ(copy, chain);
+    EXPECT_EQ(copy.height(), 5000);
+    copy.clear();
+    EXPECT_TRUE(copy.empty());
+  }
+  {
+    std::vector<int> values(100000);
+    for (int i = 0; i < static_cast<int>(values.size()); ++i) {
+      values[i] = i * 2;
+    }
+    auto bst = OrderStatisticsTree<int>::from_sorted(values.begin(),
+                                                     values.end());
+    for (unsigned threads : {1u, 2u, 3u, 8u, 64u}) {
+      OrderStatisticsTree<int> copy(bst, ParallelExecution{threads});
+      ASSERT_EQ(copy, bst);
+      ASSERT_EQ(*copy.select(777), 1554);
+      ASSERT_EQ(copy.height(), bst.height());
+      copy.insert(5);
+      copy.erase(6);
+      ASSERT_EQ(copy.rank(7), 4);
+      copy.clear(ParallelExecution{threads});
+      ASSERT_TRUE(copy.empty());
+      copy.insert(1);
+      ASSERT_EQ(copy.size(), 1);
+    }
+  }
+  {
+    BinarySearchTree<int> small{3, 1, 2};
+    BinarySearchTree<int> copy(small, ParallelExecution{4});
+    EXPECT_EQ(copy, small);
+    BinarySearchTree<int> empty;
+    BinarySearchTree<int> empty_copy(empty, ParallelExecution{4});
+    EXPECT_TRUE(empty_copy.empty());
+    empty_copy.clear(ParallelExecution{4});
+  }
+  {
+    // the pool is not thread-safe, the copy stays on this thread
+    BinarySearchTree<int, std::less<int>, PoolAllocator<int>> pooled;
+    for (int i = 0; i < 1000; ++i) {
+      pooled.insert(i);
+    }
+    BinarySearchTree<int, std::less<int>, PoolAllocator<int>> copy(
+        pooled, ParallelExecution{4});
+    EXPECT_EQ(copy, pooled);
+    copy.clear(ParallelExecution{4});
+  }
+}
+
+TEST(BinarySearchTree, FrozenTests) {
+  {
+    FrozenBinarySearchTree<int> frozen;
+    EXPECT_TRUE(frozen.empty());
+    EXPECT_EQ(frozen.begin(), frozen.end());
+    EXPECT_EQ(frozen.find(1), frozen.end());
+    EXPECT_EQ(frozen.lower_bound(1), frozen.end());
+  }
+  std::mt19937 gen(5);
+  for (int size = 1; size < 200; ++size) {
+    BinarySearchTree<int> bst;
+    for (int i = 0; i < size; ++i) {
+      bst.insert(static_cast<int>(gen() % (size + 1)) * 2);
+    }
+    auto frozen = bst.freeze();
+    ASSERT_EQ(frozen.size(), bst.size());
+    ASSERT_EQ(frozen.to_vector(), bst.to_vector());
+    std::vector<int> reversed;
+    for (auto it = frozen.end(); it != frozen.begin();) {
+      reversed.push_back(*--it);
+    }
+    std::reverse(reversed.begin(), reversed.end());
+    ASSERT_EQ(reversed, bst.to_vector());
+    for (int x = -1; x <= 2 * size + 3; ++x) {
+      auto lower = frozen.lower_bound(x);
+      auto upper = frozen.upper_bound(x);
+      ASSERT_EQ(lower == frozen.end(), bst.lower_bound(x) == bst.end());
+      ASSERT_EQ(upper == frozen.end(), bst.upper_bound(x) == bst.end());
+      if (lower != frozen.end()) {
+        ASSERT_EQ(*lower, *bst.lower_bound(x));
+      }
+      if (upper != frozen.end()) {
+        ASSERT_EQ(*upper, *bst.upper_bound(x));
+      }
+      ASSERT_EQ(frozen.contains(x), bst.contains(x));
+      ASSERT_EQ(frozen.count(x), bst.count(x));
+    }
+  }
+  {
+    BinarySearchTree<Record, RecordById> bst;
+    for (int i = 0; i < 10; ++i) {
+      bst.insert(Record{i * 3, std::to_string(i)});
+    }
+    auto frozen = bst.freeze();
+    EXPECT_EQ(frozen.find(9)->payload, "3");
+    EXPECT_FALSE(frozen.contains(10));
+    auto [first, last] = frozen.equal_range(12);
+    EXPECT_EQ(first->id, 12);
+    EXPECT_EQ(last->id, 15);
+
+    std::vector<int> sorted = {1, 2, 2, 3};
+    FrozenBinarySearchTree<int> lhs(sorted.begin(), sorted.end());
+    FrozenBinarySearchTree<int> rhs = BinarySearchTree<int>{2, 1, 3, 2}
+        .freeze();
+    EXPECT_EQ(lhs, rhs);
+  }
+  {
+    // infinities sort around the padding of the last block
+    constexpr double kInf = std::numeric_limits<double>::infinity();
+    for (int size = 0; size < 40; ++size) {
+      BinarySearchTree<double> bst{-kInf, kInf, kInf};
+      for (int i = 0; i < size; ++i) {
+        bst.insert(i * 0.5);
+      }
+      auto frozen = bst.freeze();
+      std::vector<double> keys = {-kInf, kInf, -1.0, 0.0, 1.0, 1e300};
+      for (double key : keys) {
+        ASSERT_EQ(frozen.contains(key), bst.contains(key));
+        ASSERT_EQ(frozen.count(key), bst.count(key));
+        ASSERT_EQ(frozen.lower_bound(key) == frozen.end(),
+                  bst.lower_bound(key) == bst.end());
+        ASSERT_EQ(*frozen.lower_bound(key), *bst.lower_bound(key));
+      }
+      EXPECT_EQ(*frozen.find(kInf), kInf);
+      EXPECT_EQ(frozen.upper_bound(kInf), frozen.end());
+      std::unique_ptr<bool[]> results(new bool[keys.size()]);
+      frozen.contains_many(keys, {results.get(), keys.size()});
+      EXPECT_TRUE(results[0]);
+      EXPECT_TRUE(results[1]);
+    }
+  }
+}
+
+template<class T, class Compare = std::less<T>>
+void CheckFrozenLayout() {
+  std::mt19937 gen(9);
+  for (int size : {0, 1, 2, 15, 16, 17, 100, 271, 272, 273, 1000, 5000}) {
+    BinarySearchTree<T, Compare> bst;
+    for (int i = 0; i < size; ++i) {
+      bst.insert(static_cast<T>(gen() % (size + 1) * 2));
+    }
+    auto frozen = bst.freeze();
+    ASSERT_EQ(frozen.to_vector(), bst.to_vector());
+    if (size > 0) {
+      ASSERT_EQ(*(--frozen.end()), *(--bst.end()));
+    }
+
+    std::vector<T> keys;
+    for (int x = -1; x <= 2 * size + 3; ++x) {
+      keys.push_back(static_cast<T>(x));
+    }
+    keys.push_back(std::numeric_limits<T>::max());
+    keys.push_back(std::numeric_limits<T>::lowest());
+    for (const T& key : keys) {
+      auto lower = frozen.lower_bound(key);
+      auto upper = frozen.upper_bound(key);
+      ASSERT_EQ(lower == frozen.end(), bst.lower_bound(key) == bst.end());
+      ASSERT_EQ(upper == frozen.end(), bst.upper_bound(key) == bst.end());
+      if (lower != frozen.end()) {
+        ASSERT_EQ(*lower, *bst.lower_bound(key));
+      }
+      if (upper != frozen.end()) {
+        ASSERT_EQ(*upper, *bst.upper_bound(key));
+      }
+      ASSERT_EQ(frozen.count(key), bst.count(key));
+    }
+
+    std::unique_ptr<bool[]> frozen_results(new bool[keys.size()]);
+    std::unique_ptr<bool[]> tree_results(new bool[keys.size()]);
+    frozen.contains_many(keys, {frozen_results.get(), keys.size()});
+    bst.contains_many(keys, {tree_results.get(), keys.size()});
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+      ASSERT_EQ(frozen_results[i], bst.contains(keys[i]));
+      ASSERT_EQ(tree_results[i], bst.contains(keys[i]));
+    }
+  }
+}
+
+TEST(BinarySearchTree, FrozenLayoutTests) {
+  CheckFrozenLayout<int>();
+  CheckFrozenLayout<int, std::greater<int>>();
+  CheckFrozenLayout<float>();
+  CheckFrozenLayout<double>();
+  CheckFrozenLayout<long long>();
+  CheckFrozenLayout<unsigned short>();
+}
+
+TEST(BinarySearchTree, CompactTests) {
+  static_assert(CompactBinarySearchTree<int>::node_size() == 12);
+  {
+    CompactBinarySearchTree<int> bst;
+    EXPECT_TRUE(bst.empty());
+    EXPECT_EQ(bst.begin(), bst.end());
+    EXPECT_EQ(bst.height(), 0);
+    for (int i = 0; i < 1000; ++i) {
+      bst.insert(i);
+    }
+    EXPECT_EQ(bst.height(), 10);
+    EXPECT_EQ(*bst.lower_bound(500), 500);
+    EXPECT_EQ(*--bst.end(), 999);
+  }
+  {
+    std::mt19937 gen(23);
+    CompactBinarySearchTree<int> bst;
+    std::multiset<int> expected;
+    for (int i = 0; i < 20000; ++i) {
+      int x = static_cast<int>(gen() % 500);
+      switch (gen() % 4) {
+        case 0: {
+          bst.erase(x);
+          auto it = expected.find(x);
+          if (it != expected.end()) {
+            expected.erase(it);
+          }
+          break;
+        }
+        case 1: {
+          auto it = bst.lower_bound(x);
+          auto expected_it = expected.lower_bound(x);
+          ASSERT_EQ(it == bst.end(), expected_it == expected.end());
+          if (it != bst.end()) {
+            ASSERT_EQ(*it, *expected_it);
+            bst.erase(it);
+            expected.erase(expected_it);
+          }
+          break;
+        }
+        default:
+          bst.insert(x);
+          expected.insert(x);
+      }
+      ASSERT_EQ(bst.size(), static_cast<int>(expected.size()));
+    }
+    EXPECT_EQ(bst.to_vector(),
+              std::vector<int>(expected.begin(), expected.end()));
+    EXPECT_LE(bst.height(), 1.45 * std::log2(bst.size() + 2));
+    std::vector<int> reversed;
+    for (auto it = bst.end(); it != bst.begin();) {
+      reversed.push_back(*--it);
+    }
+    EXPECT_TRUE(std::equal(reversed.begin(), reversed.end(),
+                           expected.rbegin(), expected.rend()));
+    for (int x = -1; x <= 500; ++x) {
+      ASSERT_EQ(bst.count(x), static_cast<int>(expected.count(x)));
+      auto upper = bst.upper_bound(x);
+      auto expected_upper = expected.upper_bound(x);
+      ASSERT_EQ(upper == bst.end(), expected_upper == expected.end());
+      if (upper != bst.end()) {
+        ASSERT_EQ(*upper, *expected_upper);
+      }
+    }
+
+    CompactBinarySearchTree<int> copy = bst;
+    EXPECT_EQ(copy, bst);
+    copy.insert(1);
+    EXPECT_NE(copy, bst);
+    copy.clear();
+    EXPECT_TRUE(copy.empty());
+  }
+  {
+    CompactBinarySearchTree<Record, RecordById> bst;
+    for (int i = 0; i < 10; ++i) {
+      bst.emplace(Record{i, std::to_string(i)});
+    }
+    EXPECT_EQ(bst.find(4)->payload, "4");
+    bst.erase(4);
+    EXPECT_FALSE(bst.contains(4));
+    auto [first, last] = bst.equal_range(5);
+    EXPECT_EQ(first->id, 5);
+    EXPECT_EQ(last->id, 6);
+  }
+  {
+    // erased values are destroyed at once, not when their slot is reused
+    auto resource = std::make_shared<int>(1);
+    CompactBinarySearchTree<std::shared_ptr<int>> bst;
+    bst.insert(resource);
+    bst.insert(std::make_shared<int>(2));
+    EXPECT_EQ(resource.use_count(), 2);
+    bst.erase(resource);
+    EXPECT_EQ(resource.use_count(), 1);
+    bst.insert(resource);
+    CompactBinarySearchTree<std::shared_ptr<int>> copy = bst;
+    EXPECT_EQ(resource.use_count(), 3);
+    copy.erase(resource);
+    bst.clear();
+    EXPECT_EQ(resource.use_count(), 1);
+  }
+  {
+    // values need not be assignable
+    struct Fixed {
+      const int key;
+    };
+    struct FixedByKey {
+      bool operator()(const Fixed& lhs, const Fixed& rhs) const {
+        return lhs.key < rhs.key;
+      }
+    };
+    CompactBinarySearchTree<Fixed, FixedByKey> bst;
+    for (int i = 0; i < 100; ++i) {
+      bst.emplace(Fixed{i});
+    }
+    for (int i = 0; i < 100; i += 2) {
+      bst.erase(Fixed{i});
+    }
+    for (int i = 0; i < 100; i += 2) {
+      bst.emplace(Fixed{i});
+    }
+    EXPECT_EQ(bst.size(), 100);
+    EXPECT_EQ(bst.lower_bound(Fixed{50})->key, 50);
+  }
+}
+
+TEST(BinarySearchTree, ConcurrentTests) {
+  {
+    std::mt19937 gen(31);
+    std::uniform_int_distribution<int> value(0, 300);
+    std::uniform_int_distribution<int> operation(0, 2);
+    ConcurrentBinarySearchTree<int> bst;
+    std::multiset<int> expected;
+    for (int i = 0; i < 3000; ++i) {
+      int x = value(gen);
+      if (operation(gen) == 0) {
+        bst.erase(x);
+        if (auto it = expected.find(x); it != expected.end()) {
+          expected.erase(it);
+        }
+      } else {
+        bst.insert(x);
+        expected.insert(x);
+      }
+      ASSERT_EQ(bst.size(), static_cast<int>(expected.size()));
+    }
+    EXPECT_EQ(bst.to_vector(),
+              std::vector<int>(expected.begin(), expected.end()));
+    for (int x = -1; x <= 301; ++x) {
+      ASSERT_EQ(bst.count(x), static_cast<int>(expected.count(x)));
+      ASSERT_EQ(bst.find(x).has_value(), expected.count(x) != 0);
+    }
+    bst.clear();
+    EXPECT_TRUE(bst.empty());
+    EXPECT_EQ(bst.find(1), std::nullopt);
+  }
+  {
+    ConcurrentBinarySearchTree<Record, RecordById> bst;
+    bst.emplace(Record{1, "one"});
+    bst.emplace(Record{2, "two"});
+    EXPECT_EQ(bst.find(2)->payload, "two");
+    bst.erase(2);
+    EXPECT_FALSE(bst.contains(2));
+    EXPECT_EQ(bst.count(1), 1);
+  }
+  {
+    // odd values stay in the tree while writers churn the even ones, every
+    // reader has to see all odd values all the time
+    constexpr int kValues = 2000;
+    ConcurrentBinarySearchTree<int> bst;
+    for (int x = 1; x < kValues; x += 2) {
+      bst.insert(x);
+    }
+    std::atomic<bool> stop = false;
+    std::atomic<int> failures = 0;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 2; ++i) {
+      threads.emplace_back([&, i] {
+        std::mt19937 gen(i);
+        std::uniform_int_distribution<int> value(0, kValues / 2 - 1);
+        for (int j = 0; j < 20000; ++j) {
+          int x = 2 * value(gen);
+          if (j % 2 == 0) {
+            bst.insert(x);
+          } else {
+            bst.erase(x);
+          }
+        }
+      });
+    }
+    for (int i = 0; i < 4; ++i) {
+      threads.emplace_back([&, i] {
+        std::mt19937 gen(100 + i);
+        std::uniform_int_distribution<int> value(0, kValues / 2 - 1);
+        while (!stop.load()) {
+          int x = 2 * value(gen) + 1;
+          if (!bst.contains(x) || bst.count(x) != 1 || bst.find(x) != x) {
+            ++failures;
+          }
+          if (bst.size() < kValues / 2) {
+            ++failures;
+          }
+        }
+      });
+    }
+    for (int i = 0; i < 2; ++i) {
+      threads[i].join();
+    }
+    stop = true;
+    for (int i = 2; i < 6; ++i) {
+      threads[i].join();
+    }
+    EXPECT_EQ(failures.load(), 0);
+    std::vector<int> values = bst.to_vector();
+    EXPECT_TRUE(std::is_sorted(values.begin(), values.end()));
+    EXPECT_EQ(bst.size(), static_cast<int>(values.size()));
+  }
+}
+
+TEST(BinarySearchTree, SkipListTests) {
+  {
+    std::mt19937 gen(37);
+    std::uniform_int_distribution<int> value(0, 300);
+    std::uniform_int_distribution<int> operation(0, 2);
+    ConcurrentSkipList<int> list;
+    std::set<int> expected;
+    for (int i = 0; i < 3000; ++i) {
+      int x = value(gen);
+      if (operation(gen) == 0) {
+        ASSERT_EQ(list.erase(x), expected.erase(x) == 1);
+      } else {
+        ASSERT_EQ(list.insert(x), expected.insert(x).second);
+      }
+      ASSERT_EQ(list.size(), static_cast<int>(expected.size()));
+    }
+    EXPECT_EQ(list.to_vector(),
+              std::vector<int>(expected.begin(), expected.end()));
+    for (int x = -1; x <= 301; ++x) {
+      ASSERT_EQ(list.count(x), static_cast<int>(expected.count(x)));
+    }
+    EXPECT_EQ(list.empty(), expected.empty());
+  }
+  {
+    ConcurrentSkipList<Record, RecordById> list;
+    EXPECT_TRUE(list.emplace(Record{2, "two"}));
+    EXPECT_FALSE(list.emplace(Record{2, "second two"}));
+    EXPECT_TRUE(list.emplace(Record{1, "one"}));
+    EXPECT_TRUE(list.contains(2));
+    std::string payloads;
+    list.for_each([&payloads](const Record& record) {
+      payloads += record.payload;
+    });
+    EXPECT_EQ(payloads, "onetwo");
+    EXPECT_TRUE(list.erase(2));
+    EXPECT_FALSE(list.erase(2));
+    EXPECT_EQ(list.count(1), 1);
+  }
+  {
+    // every thread fights over the same keys, a linearizable set has each
+    // key present exactly when its successful inserts outnumber its
+    // successful erases, which can only be by one
+    constexpr int kKeys = 64;
+    constexpr int kThreads = 4;
+    ConcurrentSkipList<int> list;
+    std::vector<std::vector<int>> balances(kThreads,
+                                           std::vector<int>(kKeys));
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kThreads; ++i) {
+      threads.emplace_back([&, i] {
+        std::mt19937 gen(i);
+        std::uniform_int_distribution<int> key(0, kKeys - 1);
+        for (int j = 0; j < 20000; ++j) {
+          int x = key(gen);
+          if (gen() % 2 == 0) {
+            balances[i][x] += list.insert(x) ? 1 : 0;
+          } else {
+            balances[i][x] -= list.erase(x) ? 1 : 0;
+          }
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    int size = 0;
+    for (int x = 0; x < kKeys; ++x) {
+      int balance = 0;
+      for (int i = 0; i < kThreads; ++i) {
+        balance += balances[i][x];
+      }
+      ASSERT_EQ(balance, list.count(x));
+      size += balance;
+    }
+    EXPECT_EQ(list.size(), size);
+  }
+  {
+    // odd values stay in the list while writers churn the even ones, every
+    // reader has to see all odd values and iterate in order
+    constexpr int kValues = 2000;
+    ConcurrentSkipList<int> list;
+    for (int x = 1; x < kValues; x += 2) {
+      list.insert(x);
+    }
+    std::atomic<bool> stop = false;
+    std::atomic<int> failures = 0;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 2; ++i) {
+      threads.emplace_back([&, i] {
+        std::mt19937 gen(i);
+        std::uniform_int_distribution<int> value(0, kValues / 2 - 1);
+        for (int j = 0; j < 20000; ++j) {
+          int x = 2 * value(gen);
+          if (j % 2 == 0) {
+            list.insert(x);
+          } else {
+            list.erase(x);
+          }
+        }
+      });
+    }
+    for (int i = 0; i < 2; ++i) {
+      threads.emplace_back([&, i] {
+        std::mt19937 gen(100 + i);
+        std::uniform_int_distribution<int> value(0, kValues / 2 - 1);
+        while (!stop.load()) {
+          int x = 2 * value(gen) + 1;
+          if (!list.contains(x)) {
+            ++failures;
+          }
+        }
+      });
+    }
+    threads.emplace_back([&] {
+      while (!stop.load()) {
+        int previous = -1;
+        int odd_count = 0;
+        list.for_each([&](int x) {
+          if (x <= previous) {
+            ++failures;
+          }
+          previous = x;
+          odd_count += x % 2;
+        });
+        if (odd_count != kValues / 2) {
+          ++failures;
+        }
+      }
+    });
+    for (int i = 0; i < 2; ++i) {
+      threads[i].join();
+    }
+    stop = true;
+    for (std::size_t i = 2; i < threads.size(); ++i) {
+      threads[i].join();
+    }
+    EXPECT_EQ(failures.load(), 0);
+  }
+}
+
+TEST(BinarySearchTree, PersistentTests) {
+  {
+    std::mt19937 gen(41);
+    std::uniform_int_distribution<int> value(0, 300);
+    std::uniform_int_distribution<int> operation(0, 2);
+    PersistentBinarySearchTree<int> bst;
+    std::multiset<int> expected;
+    // every snapshot has to keep the values it was taken with
+    std::vector<PersistentBinarySearchTree<int>> snapshots;
+    std::vector<std::vector<int>> snapshot_values;
+    for (int i = 0; i < 3000; ++i) {
+      int x = value(gen);
+      if (operation(gen) == 0) {
+        bst.erase(x);
+        if (auto it = expected.find(x); it != expected.end()) {
+          expected.erase(it);
+        }
+      } else {
+        bst.insert(x);
+        expected.insert(x);
+      }
+      ASSERT_EQ(bst.size(), static_cast<int>(expected.size()));
+      if (i % 100 == 0) {
+        snapshots.push_back(bst.snapshot());
+        snapshot_values.emplace_back(expected.begin(), expected.end());
+      }
+    }
+    EXPECT_EQ(bst.to_vector(),
+              std::vector<int>(expected.begin(), expected.end()));
+    EXPECT_LE(bst.height(), 1.45 * std::log2(bst.size() + 2));
+    for (int x = -1; x <= 301; ++x) {
+      ASSERT_EQ(bst.count(x), static_cast<int>(expected.count(x)));
+    }
+    for (std::size_t i = 0; i < snapshots.size(); ++i) {
+      ASSERT_EQ(snapshots[i].to_vector(), snapshot_values[i]);
+    }
+
+    // changing a snapshot leaves the tree it was taken from alone
+    PersistentBinarySearchTree<int> copy = bst;
+    EXPECT_EQ(copy, bst);
+    copy.insert(1);
+    copy.erase(*bst.begin());
+    EXPECT_NE(copy, bst);
+    EXPECT_EQ(bst.to_vector(),
+              std::vector<int>(expected.begin(), expected.end()));
+    copy = snapshots[5];
+    EXPECT_EQ(copy.to_vector(), snapshot_values[5]);
+    copy.clear();
+    EXPECT_TRUE(copy.empty());
+    EXPECT_EQ(snapshots[5].to_vector(), snapshot_values[5]);
+
+    std::vector<int> reversed;
+    for (auto it = bst.end(); it != bst.begin();) {
+      reversed.push_back(*--it);
+    }
+    EXPECT_TRUE(std::equal(reversed.begin(), reversed.end(),
+                           expected.rbegin(), expected.rend()));
+  }
+  {
+    PersistentBinarySearchTree<Record, RecordById> bst;
+    for (int i = 0; i < 10; ++i) {
+      bst.emplace(Record{i, std::to_string(i)});
+    }
+    auto snapshot = bst.snapshot();
+    bst.erase(4);
+    EXPECT_FALSE(bst.contains(4));
+    EXPECT_EQ(snapshot.find(4)->payload, "4");
+    auto [first, last] = snapshot.equal_range(5);
+    EXPECT_EQ(first->id, 5);
+    EXPECT_EQ(last->id, 6);
+  }
+  {
+    // a reporter iterates a snapshot while the live tree keeps changing
+    PersistentBinarySearchTree<int> bst;
+    for (int i = 0; i < 2000; ++i) {
+      bst.insert(i);
+    }
+    auto snapshot = bst.snapshot();
+    long long sum = 0;
+    std::thread reporter([&snapshot, &sum] {
+      for (int i = 0; i < 20; ++i) {
+        for (int value : snapshot) {
+          sum += value;
+        }
+      }
+    });
+    for (int i = 0; i < 2000; ++i) {
+      bst.erase(i);
+      bst.insert(i + 2000);
+    }
+    reporter.join();
+    EXPECT_EQ(sum, 20LL * 1999 * 2000 / 2);
+    EXPECT_EQ(*bst.begin(), 2000);
+  }
+}
+
+template<class Policy>
+void CheckSetOperations() {
+  using Tree = BinarySearchTree<int, std::less<int>, std::allocator<int>,
+                                Policy>;
+  std::mt19937 gen(43);
+  for (int round = 0; round < 40; ++round) {
+    // sizes from tiny against large to equal, with plenty of duplicates
+    int lhs_size = std::uniform_int_distribution<int>(0, 300)(gen);
+    int rhs_size = round % 2 == 0
+        ? std::uniform_int_distribution<int>(0, 10)(gen) : lhs_size;
+    std::uniform_int_distribution<int> value(0, 100);
+    std::multiset<int> lhs;
+    std::multiset<int> rhs;
+    for (int i = 0; i < lhs_size; ++i) {
+      lhs.insert(value(gen));
+    }
+    for (int i = 0; i < rhs_size; ++i) {
+      rhs.insert(value(gen));
+    }
+    Tree lhs_tree(lhs.begin(), lhs.end());
+    Tree rhs_tree(rhs.begin(), rhs.end());
+
+    std::vector<int> expected;
+    std::set_union(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+                   std::back_inserter(expected));
+    Tree tree = lhs_tree;
+    tree.union_with(rhs_tree);
+    ASSERT_EQ(tree.to_vector(), expected);
+    ASSERT_EQ(tree.size(), static_cast<int>(expected.size()));
+    ASSERT_EQ(rhs_tree.size(), rhs_size);
+
+    expected.clear();
+    std::set_intersection(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+                          std::back_inserter(expected));
+    tree = lhs_tree;
+    tree.intersect_with(Tree(rhs_tree));
+    ASSERT_EQ(tree.to_vector(), expected);
+    ASSERT_EQ(tree.size(), static_cast<int>(expected.size()));
+
+    expected.clear();
+    std::set_difference(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+                        std::back_inserter(expected));
+    tree = lhs_tree;
+    tree.difference_with(rhs_tree);
+    ASSERT_EQ(tree.to_vector(), expected);
+    ASSERT_EQ(tree.size(), static_cast<int>(expected.size()));
+    if (!tree.empty()) {
+      ASSERT_EQ(*tree.begin(), expected.front());
+      ASSERT_EQ(*--tree.end(), expected.back());
+    }
+
+    expected.clear();
+    std::merge(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+               std::back_inserter(expected));
+    tree = lhs_tree;
+    Tree other = rhs_tree;
+    tree.merge(std::move(other));
+    ASSERT_EQ(tree.to_vector(), expected);
+    ASSERT_EQ(tree.size(), static_cast<int>(expected.size()));
+    ASSERT_TRUE(other.empty());
+    ASSERT_LE(tree.height(), 1.45 * std::log2(tree.size() + 2));
+
+    int key = value(gen);
+    Tree rest = tree.split(key);
+    auto middle = std::lower_bound(expected.begin(), expected.end(), key);
+    ASSERT_EQ(tree.to_vector(), std::vector<int>(expected.begin(), middle));
+    ASSERT_EQ(rest.to_vector(), std::vector<int>(middle, expected.end()));
+    ASSERT_EQ(rest.size(), static_cast<int>(expected.end() - middle));
+    rest.insert(key);
+    tree.insert(key);
+  }
+}
+
+TEST(BinarySearchTree, SetOperationsTests) {
+  CheckSetOperations<AvlBalancing>();
+  CheckSetOperations<TreePolicy<AvlBalancing, OrderStatistics>>();
+  {
+    // kept values come from the tree the operation is called on
+    BinarySearchTree<Record, RecordById> lhs;
+    BinarySearchTree<Record, RecordById> rhs;
+    for (int i = 0; i < 10; ++i) {
+      lhs.emplace(Record{i, "lhs"});
+      rhs.emplace(Record{i + 5, "rhs"});
+    }
+    rhs.emplace(Record{7, "rhs"});
+    lhs.union_with(rhs);
+    EXPECT_EQ(lhs.size(), 16);
+    EXPECT_EQ(lhs.find(3)->payload, "lhs");
+    EXPECT_EQ(lhs.find(12)->payload, "rhs");
+    EXPECT_EQ(lhs.count(7), 2);
+    lhs.intersect_with(rhs);
+    EXPECT_EQ(lhs.size(), 11);
+    EXPECT_EQ(lhs.find(5)->payload, "lhs");
+    BinarySearchTree<Record, RecordById> high = lhs.split(8);
+    EXPECT_EQ(high.size(), 7);
+    EXPECT_EQ(high.begin()->id, 8);
+    EXPECT_EQ(lhs.size(), 4);
+  }
+  {
+    // the other tree lives in another pool, its values are copied over
+    BinarySearchTree<int, std::less<int>, PoolAllocator<int>> lhs;
+    BinarySearchTree<int, std::less<int>, PoolAllocator<int>> rhs;
+    for (int i = 0; i < 100; ++i) {
+      lhs.insert(i);
+      rhs.insert(i + 50);
+    }
+    lhs.merge(std::move(rhs));
+    EXPECT_EQ(lhs.size(), 200);
+    EXPECT_TRUE(rhs.empty());
+    EXPECT_EQ(lhs.count(70), 2);
+  }
+}
+
+TEST(BinarySearchTree, NodeHandleTests) {
+  {
+    // values move between trees and get new keys without allocating
+    using CountingTree =
+        BinarySearchTree<int, std::less<int>, CountingAllocator<int>,
+                         TreePolicy<AvlBalancing, OrderStatistics>>;
+    CountingTree lhs;
+    CountingTree rhs;
+    for (int i = 0; i < 100; ++i) {
+      lhs.insert(i);
+    }
+    int allocations = allocation_count;
+    for (int i = 0; i < 100; i += 2) {
+      CountingTree::node_type node = lhs.extract(i);
+      ASSERT_FALSE(node.empty());
+      node.value() += 1000;
+      auto it = rhs.insert(std::move(node));
+      EXPECT_EQ(*it, i + 1000);
+      EXPECT_TRUE(node.empty());
+    }
+    EXPECT_EQ(allocation_count, allocations);
+    EXPECT_EQ(lhs.size(), 50);
+    EXPECT_EQ(rhs.size(), 50);
+    EXPECT_EQ(*lhs.begin(), 1);
+    EXPECT_EQ(*rhs.begin(), 1000);
+    EXPECT_EQ(*--rhs.end(), 1098);
+    EXPECT_EQ(rhs.rank(1050), 25);
+    EXPECT_EQ(*lhs.select(10), 21);
+    EXPECT_LE(rhs.height(), 8);
+    EXPECT_FALSE(lhs.extract(0));
+    EXPECT_EQ(rhs.insert(CountingTree::node_type()), rhs.end());
+  }
+  {
+    BinarySearchTree<Record, RecordById> bst;
+    for (int i = 0; i < 10; ++i) {
+      bst.emplace(Record{i, std::to_string(i)});
+    }
+    auto node = bst.extract(bst.begin());
+    EXPECT_EQ(node.value().payload, "0");
+    // a handle that is dropped or overwritten frees its node
+    node = bst.extract(5);
+    EXPECT_EQ(node.value().payload, "5");
+    decltype(node) moved(std::move(node));
+    EXPECT_TRUE(node.empty());
+    EXPECT_TRUE(moved);
+    node = bst.extract(9);
+    EXPECT_EQ(bst.size(), 7);
+    EXPECT_EQ(bst.begin()->id, 1);
+    EXPECT_EQ((--bst.end())->id, 8);
+    bst.insert(std::move(moved));
+    EXPECT_EQ(bst.find(5)->payload, "5");
+  }
+}
+
+TEST(BinarySearchTree, HintTests) {
+  {
+    // appends and prepends compare against the ends only
+    int comparisons = 0;
+    auto counting_less = [&comparisons](int lhs, int rhs) {
+      ++comparisons;
+      return lhs < rhs;
+    };
+    BinarySearchTree<int, decltype(counting_less)> bst(counting_less);
+    for (int i = 0; i < 1000; ++i) {
+      bst.insert(i);
+    }
+    for (int i = -1; i >= -1000; --i) {
+      bst.emplace_hint(bst.begin(), i);
+    }
+    EXPECT_LE(comparisons, 4000);
+    EXPECT_EQ(bst.size(), 2000);
+    EXPECT_LE(bst.height(), 12);
+    EXPECT_EQ(*bst.begin(), -1000);
+    EXPECT_EQ(*--bst.end(), 999);
+  }
+  {
+    OrderStatisticsTree<int> bst;
+    std::multiset<int> expected;
+    std::mt19937 random(19);
+    for (int i = 0; i < 2000; ++i) {
+      int value = static_cast<int>(random() % 500);
+      auto hint = bst.begin();
+      switch (i % 4) {
+        case 0:
+          hint = bst.lower_bound(value);
+          break;
+        case 1:
+          hint = bst.upper_bound(value);
+          break;
+        case 2:
+          // a wrong hint still inserts at the right place
+          hint = bst.lower_bound(value + 100);
+          break;
+        default:
+          hint = bst.end();
+      }
+      auto it = bst.emplace_hint(hint, value);
+      EXPECT_EQ(*it, value);
+      expected.insert(value);
+    }
+    EXPECT_EQ(bst.to_vector(),
+              std::vector<int>(expected.begin(), expected.end()));
+    EXPECT_EQ(bst.rank(250), std::distance(expected.begin(),
+                                           expected.lower_bound(250)));
+    EXPECT_EQ(*bst.select(1000), *std::next(expected.begin(), 1000));
+    EXPECT_LE(bst.height(), 16);
+  }
+  {
+    BinarySearchTree<int> bst;
+    for (int i = 0; i < 100; ++i) {
+      bst.insert_unique(i);
+      bst.insert_unique(-i);
+    }
+    EXPECT_EQ(bst.size(), 199);
+    EXPECT_FALSE(bst.insert_unique(99).second);
+    EXPECT_FALSE(bst.insert_unique(-99).second);
+  }
+}
+
+TEST(BinarySearchTree, ExportTests) {
+  {
+    std::vector<int> values(1000);
+    std::iota(values.begin(), values.end(), 0);
+    std::shuffle(values.begin(), values.end(), std::mt19937(20));
+    OrderStatisticsTree<int> bst(values.begin(), values.end());
+    std::vector<int> sorted(1000);
+    std::iota(sorted.begin(), sorted.end(), 0);
+    EXPECT_EQ(bst.to_vector(), sorted);
+    std::vector<int> buffer(1001, -1);
+    EXPECT_EQ(bst.copy_to(buffer.begin()), buffer.begin() + 1000);
+    EXPECT_TRUE(std::equal(sorted.begin(), sorted.end(), buffer.begin()));
+    EXPECT_EQ(buffer.back(), -1);
+    std::vector<int> drained;
+    bst.drain(std::back_inserter(drained));
+    EXPECT_EQ(drained, sorted);
+    EXPECT_TRUE(bst.empty());
+    EXPECT_EQ(bst.begin(), bst.end());
+    bst.insert(5);
+    EXPECT_EQ(bst.to_vector(), std::vector<int>({5}));
+  }
+  {
+    // values are moved out, and a tree of any shape drains in order
+    BinarySearchTree<std::string, std::less<std::string>,
+                     std::allocator<std::string>, NoBalancing> bst;
+    for (int i = 0; i < 200; ++i) {
+      bst.insert(std::string(20, static_cast<char>('a' + i % 26)));
+    }
+    std::vector<std::string> expected = bst.to_vector();
+    std::vector<std::string> copied;
+    bst.copy_to(std::back_inserter(copied));
+    EXPECT_EQ(copied, expected);
+    std::vector<std::string> drained(200);
+    bst.drain(drained.begin());
+    EXPECT_EQ(drained, expected);
+    EXPECT_EQ(bst.size(), 0);
+  }
+  {
+    // an output that throws still leaves an empty tree and leaks nothing
+    struct ThrowingOutput {
+      int* written;
+      ThrowingOutput& operator*() {
+        return *this;
+      }
+      ThrowingOutput& operator=(std::string&&) {
+        if (++*written == 50) {
+          throw std::runtime_error("full");
+        }
+        return *this;
+      }
+      ThrowingOutput& operator++() {
+        return *this;
+      }
+    };
+    BinarySearchTree<std::string> bst;
+    for (int i = 0; i < 100; ++i) {
+      bst.insert(std::string(30, 'x') + std::to_string(i));
+    }
+    int written = 0;
+    EXPECT_THROW(bst.drain(ThrowingOutput{&written}), std::runtime_error);
+    EXPECT_EQ(written, 50);
+    EXPECT_TRUE(bst.empty());
+  }
+}
+
+TEST(BinarySearchTree, StatsTests) {
+  {
+    BinarySearchTree<int> bst;
+    BinarySearchTreeStats stats = bst.stats();
+    EXPECT_EQ(stats.node_count, 0);
+    EXPECT_EQ(stats.height, 0);
+    EXPECT_EQ(stats.average_depth, 0);
+    EXPECT_TRUE(stats.duplicate_runs.empty());
+  }
+  {
+    // runs of length 1, 2, 3, 4 and 9 of equivalent values
+    BinarySearchTree<int> bst({1, 2, 2, 3, 3, 3, 4, 4, 4, 4});
+    for (int i = 0; i < 9; ++i) {
+      bst.insert(5);
+    }
+    BinarySearchTreeStats stats = bst.stats();
+    EXPECT_EQ(stats.node_count, 19);
+    EXPECT_EQ(stats.height, bst.height());
+    EXPECT_GE(stats.average_depth, 1);
+    EXPECT_LE(stats.average_depth, stats.height);
+    EXPECT_EQ(stats.bytes_allocated, 19 * stats.node_bytes);
+    EXPECT_EQ(stats.duplicate_runs, std::vector<int>({1, 2, 1, 1}));
+  }
+  {
+    // a pool keeps its slabs, freed nodes included
+    BinarySearchTree<int, std::less<int>, PoolAllocator<int>> bst(
+        PoolAllocator<int>(4096));
+    for (int i = 0; i < 1000; ++i) {
+      bst.insert(i);
+    }
+    std::size_t slab_bytes = bst.get_allocator().slab_bytes();
+    EXPECT_EQ(bst.stats().bytes_allocated, slab_bytes);
+    EXPECT_GE(slab_bytes, 1000 * bst.stats().node_bytes);
+    EXPECT_EQ(slab_bytes % 4096, 0u);
+    for (int i = 0; i < 900; ++i) {
+      bst.erase(i);
+    }
+    EXPECT_EQ(bst.stats().bytes_allocated, slab_bytes);
+    // clear() hands the slabs back
+    bst.clear();
+    bst.insert(1);
+    EXPECT_EQ(bst.stats().bytes_allocated, 4096u);
+  }
+  {
+    // a degenerate shape shows up in the depths
+    BinarySearchTree<int, std::less<int>, std::allocator<int>, NoBalancing>
+        bst;
+    for (int i = 0; i < 100; ++i) {
+      bst.insert(i);
+    }
+    BinarySearchTreeStats stats = bst.stats();
+    EXPECT_EQ(stats.height, 100);
+    EXPECT_DOUBLE_EQ(stats.average_depth, 50.5);
+    EXPECT_EQ(stats.duplicate_runs, std::vector<int>({100}));
+  }
+  {
+    BinarySearchTree<int> bst;
+    for (int i = 0; i < 100; ++i) {
+      bst.insert(i * 7 % 100);
+    }
+    bst.reset_counters();
+    EXPECT_TRUE(bst.contains(42));
+    EXPECT_EQ(std::distance(bst.begin(), bst.end()), 100);
+    bst.erase(42);
+    BinarySearchTreeCounters counters = bst.stats().counters;
+    if constexpr (kBinarySearchTreeCounters) {
+      EXPECT_EQ(counters.finds, 2u);
+      EXPECT_GE(counters.find_comparisons, 2u);
+      EXPECT_LE(counters.find_comparisons, 2u * 2 * bst.height());
+      EXPECT_EQ(counters.iterator_steps, 100u);
+      EXPECT_LE(counters.parent_climbs, 200u);
+      EXPECT_EQ(counters.allocations, 0u);
+      EXPECT_EQ(counters.frees, 1u);
+      bst.insert(42);
+      BinarySearchTree<int> copy = bst;
+      EXPECT_EQ(bst.stats().counters.inserts, 1u);
+      EXPECT_EQ(copy.stats().counters.allocations, 100u);
+      copy.clear();
+      EXPECT_EQ(copy.stats().counters.frees, 100u);
+    } else {
+      EXPECT_EQ(counters.finds, 0u);
+      EXPECT_EQ(counters.allocations, 0u);
+    }
+  }
+}
+
+TEST(BinarySearchTree, SerializationTests) {
+  struct Point {
+    int x;
+    double y;
+  };
+  struct PointByX {
+    using is_transparent = void;
+
+    bool operator()(const Point& lhs, const Point& rhs) const {
+      return lhs.x < rhs.x;
+    }
+    bool operator()(const Point& lhs, int rhs) const {
+      return lhs.x < rhs;
+    }
+    bool operator()(int lhs, const Point& rhs) const {
+      return lhs < rhs.x;
+    }
+  };
+  {
+    std::vector<int> values(10000);
+    std::iota(values.begin(), values.end(), 0);
+    std::shuffle(values.begin(), values.end(), std::mt19937(23));
+    BinarySearchTree<int> bst(values.begin(), values.end());
+    bst.insert(17);
+    std::stringstream stream;
+    bst.serialize(stream);
+    auto loaded = BinarySearchTree<int>::deserialize(stream);
+    EXPECT_EQ(loaded, bst);
+    EXPECT_EQ(loaded.count(17), 2);
+    EXPECT_LE(loaded.height(), 14);
+
+    std::stringstream empty_stream;
+    BinarySearchTree<int>().serialize(empty_stream);
+    EXPECT_TRUE(BinarySearchTree<int>::deserialize(empty_stream).empty());
+  }
+  {
+    // a file of another type or a cut off one is rejected
+    BinarySearchTree<int> bst({3, 1, 2});
+    std::stringstream stream;
+    bst.serialize(stream);
+    EXPECT_THROW(BinarySearchTree<double>::deserialize(stream),
+                 std::runtime_error);
+    std::string bytes = stream.str();
+    std::stringstream truncated(bytes.substr(0, bytes.size() - 1));
+    EXPECT_THROW(BinarySearchTree<int>::deserialize(truncated),
+                 std::runtime_error);
+    std::stringstream reversed(bytes);
+    EXPECT_THROW(
+        (BinarySearchTree<int, std::greater<int>>::deserialize(reversed)),
+        std::runtime_error);
+
+    // the count is not trusted before the values arrive
+    SerializedTreeHeader header;
+    header.value_size = sizeof(Point);
+    header.value_alignment = alignof(Point);
+    header.count = std::numeric_limits<int>::max();
+    std::stringstream corrupt(
+        std::string(reinterpret_cast<const char*>(&header), sizeof(header)));
+    EXPECT_THROW((BinarySearchTree<Point, PointByX>::deserialize(corrupt)),
+                 std::runtime_error);
+  }
+  {
+    std::filesystem::path path = std::filesystem::temp_directory_path()
+        / ("bst_mapped_" + std::to_string(::getpid()) + ".bin");
+    BinarySearchTree<Point, PointByX> bst;
+    for (int i = 0; i < 1000; ++i) {
+      bst.emplace(Point{i * 3 % 1000, i * 0.5});
+    }
+    bst.emplace(Point{500, -1.0});
+    {
+      std::ofstream out(path, std::ios::binary);
+      bst.serialize(out);
+    }
+    MappedBinarySearchTree<Point, PointByX> mapped(path.string());
+    EXPECT_EQ(mapped.size(), 1001);
+    EXPECT_TRUE(mapped.contains(999));
+    EXPECT_FALSE(mapped.contains(1000));
+    EXPECT_EQ(mapped.count(500), 2);
+    EXPECT_EQ(mapped.find(3)->y, 0.5);
+    EXPECT_EQ(mapped.find(-1), mapped.end());
+    EXPECT_EQ(mapped.lower_bound(10)->x, 10);
+    EXPECT_EQ(mapped.upper_bound(998)->x, 999);
+    EXPECT_TRUE(std::is_sorted(mapped.begin(), mapped.end(), PointByX()));
+    EXPECT_EQ(std::distance(mapped.begin(), mapped.end()), 1001);
+
+    MappedBinarySearchTree<Point, PointByX> moved = std::move(mapped);
+    EXPECT_TRUE(mapped.empty());
+    EXPECT_EQ(moved.to_vector().size(), 1001u);
+    EXPECT_THROW((MappedBinarySearchTree<int>(path.string())),
+                 std::runtime_error);
+    std::filesystem::remove(path);
+    EXPECT_THROW((MappedBinarySearchTree<int>(path.string())),
+                 std::system_error);
+  }
+}
+
+TEST(BinarySearchTree, DiskTests) {
+  // values this large leave four to a page, so a few thousand of them make
+  // a deep tree that the small pool below cannot hold
+  struct Record {
+    int key;
+    char payload[996];
+  };
+  struct RecordByKey {
+    using is_transparent = void;
+
+    bool operator()(const Record& lhs, const Record& rhs) const {
+      return lhs.key < rhs.key;
+    }
+    bool operator()(const Record& lhs, int rhs) const {
+      return lhs.key < rhs;
+    }
+    bool operator()(int lhs, const Record& rhs) const {
+      return lhs < rhs.key;
+    }
+  };
+  std::filesystem::path path = std::filesystem::temp_directory_path()
+      / ("bst_disk_" + std::to_string(::getpid()) + ".db");
+  std::mt19937 gen(24);
+  std::multiset<int> expected;
+  {
+    DiskBinarySearchTree<Record, RecordByKey> disk(path.string(), 8);
+    EXPECT_TRUE(disk.empty());
+    EXPECT_EQ(disk.begin(), disk.end());
+    for (int i = 0; i < 3000; ++i) {
+      int key = static_cast<int>(gen() % 1000);
+      Record record{key, {}};
+      record.payload[0] = static_cast<char>(key);
+      disk.insert(record);
+      expected.insert(key);
+    }
+    EXPECT_EQ(disk.size(), 3000u);
+    EXPECT_GE(disk.height(), 4);
+    EXPECT_GT(disk.io_stats().faults, 0u);
+    EXPECT_GT(disk.io_stats().evictions, 0u);
+
+    for (int key = -1; key <= 1000; ++key) {
+      ASSERT_EQ(disk.count(key), expected.count(key));
+      EXPECT_EQ(disk.contains(key), expected.contains(key));
+    }
+    auto it = disk.find(500);
+    ASSERT_NE(it, disk.end());
+    EXPECT_EQ(it->payload[0], static_cast<char>(500));
+    EXPECT_EQ(disk.lower_bound(500)->key, *expected.lower_bound(500));
+    EXPECT_EQ(disk.upper_bound(500)->key, *expected.upper_bound(500));
+    auto [first, last] = disk.equal_range(500);
+    EXPECT_EQ(std::distance(first, last),
+              static_cast<std::ptrdiff_t>(expected.count(500)));
+
+    std::vector<int> keys;
+    for (const Record& record : disk) {
+      keys.push_back(record.key);
+    }
+    EXPECT_EQ(keys, std::vector<int>(expected.begin(), expected.end()));
+    keys.clear();
+    for (auto back = disk.end(); back != disk.begin();) {
+      keys.push_back((--back)->key);
+    }
+    EXPECT_EQ(keys, std::vector<int>(expected.rbegin(), expected.rend()));
+
+    // erase most of it, emptied pages are freed and then reused
+    for (int i = 0; i < 2500; ++i) {
+      int key = static_cast<int>(gen() % 1000);
+      disk.erase(key);
+      if (expected.contains(key)) {
+        expected.erase(expected.find(key));
+      }
+    }
+    for (int key = 0; key < 200; ++key) {
+      disk.insert(Record{key, {}});
+      expected.insert(key);
+    }
+    EXPECT_EQ(disk.size(), expected.size());
+  }
+  {
+    // the tree is still there after reopening
+    DiskBinarySearchTree<Record, RecordByKey> disk(path.string(), 16);
+    EXPECT_EQ(disk.size(), expected.size());
+    std::vector<int> keys;
+    for (const Record& record : disk) {
+      keys.push_back(record.key);
+    }
+    EXPECT_EQ(keys, std::vector<int>(expected.begin(), expected.end()));
+    while (!expected.empty()) {
+      disk.erase(*expected.begin());
+      expected.erase(expected.begin());
+    }
+    EXPECT_TRUE(disk.empty());
+    EXPECT_EQ(disk.height(), 1);
+    EXPECT_EQ(disk.begin(), disk.end());
+    disk.insert(Record{7, {}});
+    EXPECT_EQ(disk.begin()->key, 7);
+  }
+  EXPECT_THROW((DiskBinarySearchTree<double>(path.string())),
+               std::runtime_error);
+  std::filesystem::remove(path);
+  {
+    DiskBinarySearchTree<std::uint64_t> disk(path.string());
+    for (std::uint64_t i = 0; i < 100000; ++i) {
+      disk.insert(i);
+    }
+    EXPECT_EQ(disk.size(), 100000u);
+    EXPECT_EQ(disk.count(99999), 1u);
+    EXPECT_EQ(*disk.lower_bound(50000), 50000u);
+    EXPECT_EQ(std::distance(disk.begin(), disk.end()), 100000);
+  }
+  std::filesystem::remove(path);
+}
+
+TEST(BinarySearchTree, MerkleTests) {
+  std::vector<int> values(2000);
+  std::iota(values.begin(), values.end(), 0);
+  std::shuffle(values.begin(), values.end(), std::mt19937(25));
+  MerkleTree<int> bst(values.begin(), values.end());
+  std::sort(values.begin(), values.end());
+  // other shapes of the same values have the same digest
+  auto sorted = MerkleTree<int>::from_sorted(values.begin(), values.end());
+  EXPECT_EQ(bst.digest(), sorted.digest());
+  EXPECT_EQ(bst, sorted);
+  EXPECT_NE(bst.digest(), MerkleTree<int>().digest());
+  EXPECT_TRUE(bst.diff(sorted).added.empty());
+  EXPECT_TRUE(bst.diff(sorted).removed.empty());
+
+  MerkleTree<int> replica = bst;
+  EXPECT_EQ(replica.digest(), bst.digest());
+  replica.erase(10);
+  replica.erase(1500);
+  replica.insert(777);
+  replica.insert(5000);
+  replica.insert(-3);
+  EXPECT_NE(replica.digest(), bst.digest());
+  EXPECT_NE(replica, bst);
+  auto diff = bst.diff(replica);
+  EXPECT_EQ(diff.added, (std::vector<int>{-3, 777, 5000}));
+  EXPECT_EQ(diff.removed, (std::vector<int>{10, 1500}));
+  auto back = replica.diff(bst);
+  EXPECT_EQ(back.added, diff.removed);
+  EXPECT_EQ(back.removed, diff.added);
+
+  // applying the diff brings the trees back in sync
+  for (int value : diff.added) {
+    bst.insert(value);
+  }
+  for (int value : diff.removed) {
+    bst.erase(value);
+  }
+  EXPECT_EQ(bst.digest(), replica.digest());
+  EXPECT_EQ(bst, replica);
+
+  // digests follow node handles, splits and joins
+  auto handle = bst.extract(777);
+  handle.value() = 778;
+  bst.insert(std::move(handle));
+  EXPECT_EQ(bst.diff(replica).added, (std::vector<int>{777}));
+  EXPECT_EQ(bst.diff(replica).removed, (std::vector<int>{778}));
+  MerkleTree<int> upper = bst.split(1000);
+  bst.merge(std::move(upper));
+  EXPECT_EQ(bst.digest(),
+            MerkleTree<int>(bst.begin(), bst.end()).digest());
+
+  // whole ranges on one side only
+  MerkleTree<int> empty;
+  EXPECT_EQ(empty.diff(replica).added.size(), replica.size());
+  EXPECT_EQ(replica.diff(empty).removed.size(), replica.size());
+
+  // equivalent values are told apart by ==
+  struct ByLength {
+    bool operator()(const std::string& lhs, const std::string& rhs) const {
+      return lhs.size() < rhs.size();
+    }
+  };
+  MerkleTree<std::string, ByLength> words({"a", "bb", "cc", "cc", "ddd"});
+  MerkleTree<std::string, ByLength> other({"a", "cc", "ee", "cc", "ddd"});
+  auto word_diff = words.diff(other);
+  EXPECT_EQ(word_diff.added, (std::vector<std::string>{"ee"}));
+  EXPECT_EQ(word_diff.removed, (std::vector<std::string>{"bb"}));
+}
@@ -0,0 +1,968 @@
+#ifndef COMPACT_BINARY_SEARCH_TREE_H_
+#define COMPACT_BINARY_SEARCH_TREE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "binary_search_tree.h"
+
+// AVL multiset with small nodes for small values. Nodes live in one
+// vector and link by 32-bit indices. There are no parent links, and the
+// AVL height is kept in the top bits of the two links. A node holding an
+// int takes 12 bytes. Iterators carry the path from the root instead of
+// a parent chain. Any insert or erase invalidates all iterators.
+template<class T, class Compare = std::less<T>,
+    class Allocator = std::allocator<T>>
+class CompactBinarySearchTree {
+ public:
+  using value_compare = Compare;
+  using allocator_type = Allocator;
+
+  CompactBinarySearchTree() = default;
+  explicit CompactBinarySearchTree(const Compare& comp,
+                                   const Allocator& allocator = Allocator());
+
+  CompactBinarySearchTree(const std::initializer_list<T>& list,
+                          const Compare& comp = Compare(),
+                          const Allocator& allocator = Allocator());
+
+  value_compare value_comp() const;
+  allocator_type get_allocator() const;
+
+  int size() const;
+  bool empty() const;
+
+  // height of the empty tree is 0
+  int height() const;
+
+  // bytes taken by one node in the arena
+  static constexpr std::size_t node_size();
+
+  void reserve(int count);
+
+  bool contains(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  bool contains(const K& key) const;
+
+  int count(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  int count(const K& key) const;
+
+  template<class... Args>
+  void emplace(Args&& ... args);
+
+  template<class U>
+  void insert(U&& value);
+
+  void erase(const T& value);
+  template<class K> requires TransparentCompare<Compare>
+  void erase(const K& key);
+
+  void clear();
+
+  std::vector<T> to_vector() const;
+
+  bool operator==(const CompactBinarySearchTree& rhs) const;
+  bool operator!=(const CompactBinarySearchTree& rhs) const;
+
+ private:
+  using Index = std::uint32_t;
+
+  // Each link word keeps a 29-bit index; the top 3 bits of the left and
+  // right words hold the high and low half of the 6-bit height.
+  static constexpr int kIndexBits = 29;
+  static constexpr Index kIndexMask = (Index(1) << kIndexBits) - 1;
+  static constexpr Index kNil = kIndexMask;
+  static constexpr int kMaxHeight = 64;
+  // right link of a free slot, no node in the tree has it: a node without
+  // a right child has a height of at most 2, not 7 mod 8
+  static constexpr Index kFree = ~Index(0);
+
+  // the value lives only while the slot is in the tree, free slots hold
+  // the next free slot in their left link
+  struct Node {
+    template<class... Args>
+    explicit Node(std::in_place_t, Args&& ... args);
+
+    Node(const Node& rhs);
+    Node(Node&& rhs) noexcept(std::is_nothrow_move_constructible_v<T>);
+
+    Node& operator=(const Node& rhs);
+    Node& operator=(Node&& rhs)
+        noexcept(std::is_nothrow_move_constructible_v<T>);
+
+    ~Node();
+
+    bool IsFree() const;
+
+    union {
+      T value;
+    };
+    Index left_link;
+    Index right_link;
+  };
+
+  using NodeAllocator =
+      typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+
+  // nodes from the root down to the current node, empty for end()
+  struct Path {
+    void Push(Index node);
+    Index Pop();
+    Index Top() const;
+
+    Index nodes[kMaxHeight];
+    int depth = 0;
+  };
+
+ public:
+  class ConstIterator {
+    friend class CompactBinarySearchTree;
+   public:
+    using difference_type = std::ptrdiff_t;
+    using value_type = T;
+    using pointer = const T*;
+    using reference = const T&;
+    using iterator_category = std::bidirectional_iterator_tag;
+
+    ConstIterator() = default;
+
+    const T& operator*() const;
+
+    const T* operator->() const;
+
+    ConstIterator& operator++();
+    ConstIterator operator++(int);
+
+    ConstIterator& operator--();
+    ConstIterator operator--(int);
+
+    bool operator==(const ConstIterator& rhs) const;
+    bool operator!=(const ConstIterator& rhs) const;
+
+   private:
+    ConstIterator(const Path& path, const CompactBinarySearchTree* owner);
+
+    Index Current() const;
+
+    Path path_;
+    const CompactBinarySearchTree* owner_ = nullptr;
+  };
+  ConstIterator begin() const;
+
+  ConstIterator end() const;
+
+  ConstIterator find(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator find(const K& key) const;
+
+  // first value that is not less than value
+  ConstIterator lower_bound(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator lower_bound(const K& key) const;
+
+  // first value that is greater than value
+  ConstIterator upper_bound(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator upper_bound(const K& key) const;
+
+  std::pair<ConstIterator, ConstIterator> equal_range(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  std::pair<ConstIterator, ConstIterator> equal_range(const K& key) const;
+
+  void erase(ConstIterator iter);
+
+ private:
+  Index Left(Index node) const;
+  Index Right(Index node) const;
+  Index Child(Index node, bool is_right) const;
+  void SetLeft(Index node, Index child);
+  void SetRight(Index node, Index child);
+  void SetChild(Index node, bool is_right, Index child);
+
+  int Height(Index node) const;
+  void SetHeight(Index node, int height);
+  void UpdateHeight(Index node);
+
+  template<class K>
+  Index FindNode(const K& key) const;
+  template<class K>
+  Path FindPath(const K& key) const;
+
+  // path to the first node that goes after key, for the lower bound the
+  // nodes not less than key, for the upper bound the nodes greater than key
+  template<class K>
+  Path BoundPath(const K& key, bool is_upper) const;
+
+  template<class K>
+  int CalcCount(const K& key) const;
+
+  // extend path down to the first or last node of the subtree at node
+  void DescendLeftmost(Path* path, Index node) const;
+  void DescendRightmost(Path* path, Index node) const;
+
+  template<class... Args>
+  Index CreateNode(Args&& ... args);
+
+  // destroys the value
+  void FreeNode(Index node);
+
+  void InsertNode(Index node);
+
+  // erase the node at the end of path
+  void EraseAt(Path path);
+
+  // replace child of the node above path.nodes[depth] with new_child
+  void Relink(const Path& path, int depth, Index new_child);
+
+  // restore the balance on the way from the end of path to the root
+  void RebalancePath(Path& path);
+
+  // return the new root of the subtree
+  Index Balance(Index node);
+  Index RotateLeft(Index node);
+  Index RotateRight(Index node);
+
+  [[no_unique_address]] Compare comp_;
+  std::vector<Node, NodeAllocator> nodes_;
+  Index root_ = kNil;
+  // freed slots, chained through their left links
+  Index free_head_ = kNil;
+  int size_ = 0;
+};
+
+// definitions
+
+template<class T, class Compare, class Allocator>
+CompactBinarySearchTree<T, Compare, Allocator>::CompactBinarySearchTree
+    (const Compare& comp, const Allocator& allocator) :
+    comp_(comp), nodes_(NodeAllocator(allocator)) {}
+
+template<class T, class Compare, class Allocator>
+CompactBinarySearchTree<T, Compare, Allocator>::CompactBinarySearchTree
+    (const std::initializer_list<T>& list, const Compare& comp,
+     const Allocator& allocator) :
+    comp_(comp), nodes_(NodeAllocator(allocator)) {
+  reserve(static_cast<int>(list.size()));
+  for (const T& value : list) {
+    insert(value);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::value_compare
+CompactBinarySearchTree<T, Compare, Allocator>::value_comp() const {
+  return comp_;
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::allocator_type
+CompactBinarySearchTree<T, Compare, Allocator>::get_allocator() const {
+  return Allocator(nodes_.get_allocator());
+}
+
+template<class T, class Compare, class Allocator>
+int CompactBinarySearchTree<T, Compare, Allocator>::size() const {
+  return size_;
+}
+
+template<class T, class Compare, class Allocator>
+bool CompactBinarySearchTree<T, Compare, Allocator>::empty() const {
+  return size_ == 0;
+}
+
+template<class T, class Compare, class Allocator>
+int CompactBinarySearchTree<T, Compare, Allocator>::height() const {
+  return Height(root_);
+}
+
+template<class T, class Compare, class Allocator>
+constexpr std::size_t
+CompactBinarySearchTree<T, Compare, Allocator>::node_size() {
+  return sizeof(Node);
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::reserve(int count) {
+  nodes_.reserve(count);
+}
+
+template<class T, class Compare, class Allocator>
+bool CompactBinarySearchTree<T, Compare, Allocator>::contains
+    (const T& value) const {
+  return FindNode(value) != kNil;
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+bool CompactBinarySearchTree<T, Compare, Allocator>::contains
+    (const K& key) const {
+  return FindNode(key) != kNil;
+}
+
+template<class T, class Compare, class Allocator>
+int CompactBinarySearchTree<T, Compare, Allocator>::count
+    (const T& value) const {
+  return CalcCount(value);
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+int CompactBinarySearchTree<T, Compare, Allocator>::count
+    (const K& key) const {
+  return CalcCount(key);
+}
+
+template<class T, class Compare, class Allocator>
+template<class... Args>
+void CompactBinarySearchTree<T, Compare, Allocator>::emplace
+    (Args&& ... args) {
+  InsertNode(CreateNode(std::forward<Args>(args)...));
+}
+
+template<class T, class Compare, class Allocator>
+template<class U>
+void CompactBinarySearchTree<T, Compare, Allocator>::insert(U&& value) {
+  emplace(std::forward<U>(value));
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::erase(const T& value) {
+  Path path = FindPath(value);
+  if (path.depth != 0) {
+    EraseAt(path);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+void CompactBinarySearchTree<T, Compare, Allocator>::erase(const K& key) {
+  Path path = FindPath(key);
+  if (path.depth != 0) {
+    EraseAt(path);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::erase
+    (ConstIterator iter) {
+  EraseAt(iter.path_);
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::clear() {
+  nodes_.clear();
+  root_ = kNil;
+  free_head_ = kNil;
+  size_ = 0;
+}
+
+template<class T, class Compare, class Allocator>
+std::vector<T> CompactBinarySearchTree<T, Compare, Allocator>::to_vector()
+    const {
+  std::vector<T> result;
+  result.reserve(size_);
+  for (const T& value : *this) {
+    result.push_back(value);
+  }
+  return result;
+}
+
+template<class T, class Compare, class Allocator>
+bool CompactBinarySearchTree<T, Compare, Allocator>::operator==
+    (const CompactBinarySearchTree& rhs) const {
+  return size_ == rhs.size_ && std::equal(begin(), end(), rhs.begin());
+}
+
+template<class T, class Compare, class Allocator>
+bool CompactBinarySearchTree<T, Compare, Allocator>::operator!=
+    (const CompactBinarySearchTree& rhs) const {
+  return !(*this == rhs);
+}
+
+// Path
+
+template<class T, class Compare, class Allocator>
+template<class... Args>
+CompactBinarySearchTree<T, Compare, Allocator>::Node::Node
+    (std::in_place_t, Args&& ... args) : left_link(kNil), right_link(kNil) {
+  std::construct_at(std::addressof(value), std::forward<Args>(args)...);
+}
+
+template<class T, class Compare, class Allocator>
+CompactBinarySearchTree<T, Compare, Allocator>::Node::Node(const Node& rhs) :
+    left_link(rhs.left_link), right_link(rhs.right_link) {
+  if (!rhs.IsFree()) {
+    std::construct_at(std::addressof(value), rhs.value);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+CompactBinarySearchTree<T, Compare, Allocator>::Node::Node(Node&& rhs)
+    noexcept(std::is_nothrow_move_constructible_v<T>) :
+    left_link(rhs.left_link), right_link(rhs.right_link) {
+  if (!rhs.IsFree()) {
+    std::construct_at(std::addressof(value), std::move(rhs.value));
+  }
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::Node&
+CompactBinarySearchTree<T, Compare, Allocator>::Node::operator=
+    (const Node& rhs) {
+  if (this != &rhs) {
+    if (!IsFree()) {
+      std::destroy_at(std::addressof(value));
+      right_link = kFree;
+    }
+    if (!rhs.IsFree()) {
+      std::construct_at(std::addressof(value), rhs.value);
+    }
+    left_link = rhs.left_link;
+    right_link = rhs.right_link;
+  }
+  return *this;
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::Node&
+CompactBinarySearchTree<T, Compare, Allocator>::Node::operator=(Node&& rhs)
+    noexcept(std::is_nothrow_move_constructible_v<T>) {
+  if (this != &rhs) {
+    if (!IsFree()) {
+      std::destroy_at(std::addressof(value));
+      right_link = kFree;
+    }
+    if (!rhs.IsFree()) {
+      std::construct_at(std::addressof(value), std::move(rhs.value));
+    }
+    left_link = rhs.left_link;
+    right_link = rhs.right_link;
+  }
+  return *this;
+}
+
+template<class T, class Compare, class Allocator>
+CompactBinarySearchTree<T, Compare, Allocator>::Node::~Node() {
+  if (!IsFree()) {
+    std::destroy_at(std::addressof(value));
+  }
+}
+
+template<class T, class Compare, class Allocator>
+bool CompactBinarySearchTree<T, Compare, Allocator>::Node::IsFree() const {
+  return right_link == kFree;
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::Path::Push
+    (Index node) {
+  nodes[depth++] = node;
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::Index
+CompactBinarySearchTree<T, Compare, Allocator>::Path::Pop() {
+  return nodes[--depth];
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::Index
+CompactBinarySearchTree<T, Compare, Allocator>::Path::Top() const {
+  return depth == 0 ? kNil : nodes[depth - 1];
+}
+
+// -Path
+
+// ConstIterator
+
+template<class T, class Compare, class Allocator>
+CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator::ConstIterator
+    (const Path& path, const CompactBinarySearchTree* owner) :
+    path_(path), owner_(owner) {}
+
+template<class T, class Compare, class Allocator>
+const T& CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator::
+    operator*() const {
+  return owner_->nodes_[Current()].value;
+}
+
+template<class T, class Compare, class Allocator>
+const T* CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator::
+    operator->() const {
+  return &owner_->nodes_[Current()].value;
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator&
+CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator::operator++() {
+  Index node = path_.Top();
+  if (owner_->Right(node) != kNil) {
+    owner_->DescendLeftmost(&path_, owner_->Right(node));
+    return *this;
+  }
+  // go up until we come from a left child
+  Index child;
+  do {
+    child = path_.Pop();
+  } while (path_.depth != 0 && owner_->Right(path_.Top()) == child);
+  return *this;
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator
+CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator::operator++
+    (int) {
+  ConstIterator old = *this;
+  ++*this;
+  return old;
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator&
+CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator::operator--() {
+  if (path_.depth == 0) {
+    owner_->DescendRightmost(&path_, owner_->root_);
+    return *this;
+  }
+  Index node = path_.Top();
+  if (owner_->Left(node) != kNil) {
+    owner_->DescendRightmost(&path_, owner_->Left(node));
+    return *this;
+  }
+  // go up until we come from a right child
+  Index child;
+  do {
+    child = path_.Pop();
+  } while (path_.depth != 0 && owner_->Left(path_.Top()) == child);
+  return *this;
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator
+CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator::operator--
+    (int) {
+  ConstIterator old = *this;
+  --*this;
+  return old;
+}
+
+template<class T, class Compare, class Allocator>
+bool CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator::
+    operator==(const ConstIterator& rhs) const {
+  return Current() == rhs.Current() && owner_ == rhs.owner_;
+}
+
+template<class T, class Compare, class Allocator>
+bool CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator::
+    operator!=(const ConstIterator& rhs) const {
+  return !(*this == rhs);
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::Index
+CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator::Current()
+    const {
+  return path_.Top();
+}
+
+// -ConstIterator
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator
+CompactBinarySearchTree<T, Compare, Allocator>::begin() const {
+  Path path;
+  DescendLeftmost(&path, root_);
+  return {path, this};
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator
+CompactBinarySearchTree<T, Compare, Allocator>::end() const {
+  return {Path(), this};
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator
+CompactBinarySearchTree<T, Compare, Allocator>::find(const T& value) const {
+  return {FindPath(value), this};
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+typename CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator
+CompactBinarySearchTree<T, Compare, Allocator>::find(const K& key) const {
+  return {FindPath(key), this};
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator
+CompactBinarySearchTree<T, Compare, Allocator>::lower_bound
+    (const T& value) const {
+  return {BoundPath(value, false), this};
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+typename CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator
+CompactBinarySearchTree<T, Compare, Allocator>::lower_bound
+    (const K& key) const {
+  return {BoundPath(key, false), this};
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator
+CompactBinarySearchTree<T, Compare, Allocator>::upper_bound
+    (const T& value) const {
+  return {BoundPath(value, true), this};
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+typename CompactBinarySearchTree<T, Compare, Allocator>::ConstIterator
+CompactBinarySearchTree<T, Compare, Allocator>::upper_bound
+    (const K& key) const {
+  return {BoundPath(key, true), this};
+}
+
+template<class T, class Compare, class Allocator>
+auto CompactBinarySearchTree<T, Compare, Allocator>::equal_range
+    (const T& value) const -> std::pair<ConstIterator, ConstIterator> {
+  return {lower_bound(value), upper_bound(value)};
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+auto CompactBinarySearchTree<T, Compare, Allocator>::equal_range
+    (const K& key) const -> std::pair<ConstIterator, ConstIterator> {
+  return {lower_bound(key), upper_bound(key)};
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::Index
+CompactBinarySearchTree<T, Compare, Allocator>::Left(Index node) const {
+  return nodes_[node].left_link & kIndexMask;
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::Index
+CompactBinarySearchTree<T, Compare, Allocator>::Right(Index node) const {
+  return nodes_[node].right_link & kIndexMask;
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::Index
+CompactBinarySearchTree<T, Compare, Allocator>::Child
+    (Index node, bool is_right) const {
+  return is_right ? Right(node) : Left(node);
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::SetLeft
+    (Index node, Index child) {
+  Index& link = nodes_[node].left_link;
+  link = (link & ~kIndexMask) | child;
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::SetRight
+    (Index node, Index child) {
+  Index& link = nodes_[node].right_link;
+  link = (link & ~kIndexMask) | child;
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::SetChild
+    (Index node, bool is_right, Index child) {
+  if (is_right) {
+    SetRight(node, child);
+  } else {
+    SetLeft(node, child);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+int CompactBinarySearchTree<T, Compare, Allocator>::Height(Index node)
+    const {
+  if (node == kNil) {
+    return 0;
+  }
+  const Node& tree_node = nodes_[node];
+  return static_cast<int>((tree_node.left_link >> kIndexBits) << 3
+      | tree_node.right_link >> kIndexBits);
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::SetHeight
+    (Index node, int height) {
+  Node& tree_node = nodes_[node];
+  tree_node.left_link = (tree_node.left_link & kIndexMask)
+      | static_cast<Index>(height >> 3) << kIndexBits;
+  tree_node.right_link = (tree_node.right_link & kIndexMask)
+      | static_cast<Index>(height & 7) << kIndexBits;
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::UpdateHeight
+    (Index node) {
+  SetHeight(node, std::max(Height(Left(node)), Height(Right(node))) + 1);
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+typename CompactBinarySearchTree<T, Compare, Allocator>::Index
+CompactBinarySearchTree<T, Compare, Allocator>::FindNode
+    (const K& key) const {
+  Index node = root_;
+  while (node != kNil) {
+    if (comp_(key, nodes_[node].value)) {
+      node = Left(node);
+    } else if (comp_(nodes_[node].value, key)) {
+      node = Right(node);
+    } else {
+      break;
+    }
+  }
+  return node;
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+typename CompactBinarySearchTree<T, Compare, Allocator>::Path
+CompactBinarySearchTree<T, Compare, Allocator>::FindPath
+    (const K& key) const {
+  Path path;
+  Index node = root_;
+  while (node != kNil) {
+    path.Push(node);
+    if (comp_(key, nodes_[node].value)) {
+      node = Left(node);
+    } else if (comp_(nodes_[node].value, key)) {
+      node = Right(node);
+    } else {
+      return path;
+    }
+  }
+  return Path();
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+typename CompactBinarySearchTree<T, Compare, Allocator>::Path
+CompactBinarySearchTree<T, Compare, Allocator>::BoundPath
+    (const K& key, bool is_upper) const {
+  // the bound is the last node where the descent went left, the path to it
+  // is a prefix of the descent
+  Path path;
+  int bound_depth = 0;
+  Index node = root_;
+  while (node != kNil) {
+    path.Push(node);
+    const T& value = nodes_[node].value;
+    bool goes_left = is_upper ? comp_(key, value) : !comp_(value, key);
+    if (goes_left) {
+      bound_depth = path.depth;
+      node = Left(node);
+    } else {
+      node = Right(node);
+    }
+  }
+  path.depth = bound_depth;
+  return path;
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+int CompactBinarySearchTree<T, Compare, Allocator>::CalcCount
+    (const K& key) const {
+  ConstIterator last(BoundPath(key, true), this);
+  int count = 0;
+  for (ConstIterator it(BoundPath(key, false), this); it != last; ++it) {
+    ++count;
+  }
+  return count;
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::DescendLeftmost
+    (Path* path, Index node) const {
+  for (; node != kNil; node = Left(node)) {
+    path->Push(node);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::DescendRightmost
+    (Path* path, Index node) const {
+  for (; node != kNil; node = Right(node)) {
+    path->Push(node);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+template<class... Args>
+typename CompactBinarySearchTree<T, Compare, Allocator>::Index
+CompactBinarySearchTree<T, Compare, Allocator>::CreateNode
+    (Args&& ... args) {
+  if (free_head_ != kNil) {
+    Index node = free_head_;
+    // the slot stays free if the constructor throws
+    std::construct_at(std::addressof(nodes_[node].value),
+                      std::forward<Args>(args)...);
+    free_head_ = Left(node);
+    nodes_[node].left_link = kNil;
+    nodes_[node].right_link = kNil;
+    SetHeight(node, 1);
+    return node;
+  }
+
+  if (nodes_.size() >= kNil) {
+    throw std::length_error("CompactBinarySearchTree is full");
+  }
+  Index node = static_cast<Index>(nodes_.size());
+  nodes_.emplace_back(std::in_place, std::forward<Args>(args)...);
+  SetHeight(node, 1);
+  return node;
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::FreeNode(Index node) {
+  std::destroy_at(std::addressof(nodes_[node].value));
+  nodes_[node].left_link = free_head_;
+  nodes_[node].right_link = kFree;
+  free_head_ = node;
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::InsertNode
+    (Index node) {
+  Path path;
+  bool is_right = false;
+  for (Index cur_node = root_; cur_node != kNil;
+       cur_node = Child(cur_node, is_right)) {
+    path.Push(cur_node);
+    is_right = !comp_(nodes_[node].value, nodes_[cur_node].value);
+  }
+
+  if (path.depth == 0) {
+    root_ = node;
+  } else {
+    SetChild(path.Top(), is_right, node);
+  }
+  ++size_;
+  RebalancePath(path);
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::EraseAt(Path path) {
+  int depth = path.depth - 1;
+  Index node = path.nodes[depth];
+
+  if (Left(node) != kNil && Right(node) != kNil) {
+    // the successor takes the place of node
+    DescendLeftmost(&path, Right(node));
+    Index successor = path.Pop();
+    Index successor_parent = path.Top();
+    if (successor_parent == node) {
+      SetRight(node, Right(successor));
+    } else {
+      SetLeft(successor_parent, Right(successor));
+    }
+    SetLeft(successor, Left(node));
+    SetRight(successor, Right(node));
+    SetHeight(successor, Height(node));
+    Relink(path, depth, successor);
+    path.nodes[depth] = successor;
+  } else {
+    Index child = Left(node) != kNil ? Left(node) : Right(node);
+    Relink(path, depth, child);
+    path.Pop();
+  }
+
+  FreeNode(node);
+  --size_;
+  RebalancePath(path);
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::Relink
+    (const Path& path, int depth, Index new_child) {
+  if (depth == 0) {
+    root_ = new_child;
+    return;
+  }
+  Index parent = path.nodes[depth - 1];
+  SetChild(parent, Right(parent) == path.nodes[depth], new_child);
+}
+
+template<class T, class Compare, class Allocator>
+void CompactBinarySearchTree<T, Compare, Allocator>::RebalancePath
+    (Path& path) {
+  for (int depth = path.depth - 1; depth >= 0; --depth) {
+    Index node = path.nodes[depth];
+    int old_height = Height(node);
+    Index new_node = Balance(node);
+    if (new_node != node) {
+      Relink(path, depth, new_node);
+      path.nodes[depth] = new_node;
+    } else if (Height(node) == old_height) {
+      // nothing changed above this subtree
+      return;
+    }
+  }
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::Index
+CompactBinarySearchTree<T, Compare, Allocator>::Balance(Index node) {
+  UpdateHeight(node);
+  int balance = Height(Left(node)) - Height(Right(node));
+  if (balance > 1) {
+    Index left = Left(node);
+    if (Height(Left(left)) < Height(Right(left))) {
+      SetLeft(node, RotateLeft(left));
+    }
+    return RotateRight(node);
+  }
+  if (balance < -1) {
+    Index right = Right(node);
+    if (Height(Right(right)) < Height(Left(right))) {
+      SetRight(node, RotateRight(right));
+    }
+    return RotateLeft(node);
+  }
+  return node;
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::Index
+CompactBinarySearchTree<T, Compare, Allocator>::RotateLeft(Index node) {
+  Index pivot = Right(node);
+  SetRight(node, Left(pivot));
+  SetLeft(pivot, node);
+  UpdateHeight(node);
+  UpdateHeight(pivot);
+  return pivot;
+}
+
+template<class T, class Compare, class Allocator>
+typename CompactBinarySearchTree<T, Compare, Allocator>::Index
+CompactBinarySearchTree<T, Compare, Allocator>::RotateRight(Index node) {
+  Index pivot = Left(node);
+  SetLeft(node, Right(pivot));
+  SetRight(pivot, node);
+  UpdateHeight(node);
+  UpdateHeight(pivot);
+  return pivot;
+}
+
+#endif  // COMPACT_BINARY_SEARCH_TREE_H_
@@ -0,0 +1,596 @@
+#ifndef CONCURRENT_BINARY_SEARCH_TREE_H_
+#define CONCURRENT_BINARY_SEARCH_TREE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "binary_search_tree.h"
+#include "epoch_reclamation.h"
+
+// AVL multiset that many threads may use at once. Published nodes are never
+// changed: a writer copies the path it touches, links the copies into a new
+// root and swaps the root in. Readers load the root and walk a consistent
+// snapshot without taking any lock. Nodes replaced by a write are freed by
+// epoch-based reclamation once no reader can still be walking them. Writers
+// are serialized by a mutex.
+//
+// Lookups return copies of the values since nodes may be freed as soon as
+// the call returns.
+template<class T, class Compare = std::less<T>,
+    class Allocator = std::allocator<T>>
+class ConcurrentBinarySearchTree {
+ public:
+  using value_compare = Compare;
+  using allocator_type = Allocator;
+
+  ConcurrentBinarySearchTree() = default;
+  explicit ConcurrentBinarySearchTree(const Compare& comp,
+                                      const Allocator& allocator = Allocator());
+
+  ConcurrentBinarySearchTree(const std::initializer_list<T>& list,
+                             const Compare& comp = Compare(),
+                             const Allocator& allocator = Allocator());
+
+  ConcurrentBinarySearchTree(const ConcurrentBinarySearchTree&) = delete;
+  ConcurrentBinarySearchTree& operator=(const ConcurrentBinarySearchTree&) =
+      delete;
+
+  // no other thread may use the tree anymore
+  ~ConcurrentBinarySearchTree();
+
+  value_compare value_comp() const;
+  allocator_type get_allocator() const;
+
+  // readers, lock-free
+
+  int size() const;
+  bool empty() const;
+
+  bool contains(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  bool contains(const K& key) const;
+
+  int count(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  int count(const K& key) const;
+
+  // copy of an element equivalent to value
+  std::optional<T> find(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  std::optional<T> find(const K& key) const;
+
+  // all values of one snapshot of the tree
+  std::vector<T> to_vector() const;
+
+  // writers, serialized
+
+  template<class... Args>
+  void emplace(Args&& ... args);
+
+  template<class U>
+  void insert(U&& value);
+
+  // erase one element equivalent to value
+  void erase(const T& value);
+  template<class K> requires TransparentCompare<Compare>
+  void erase(const K& key);
+
+  void clear();
+
+ private:
+  struct Node {
+    template<class... Args>
+    explicit Node(std::uint64_t version, Args&& ... args);
+
+    T value;
+    Node* left = nullptr;
+    Node* right = nullptr;
+    int height = 1;
+    int size = 1;
+    // write that created the node, only nodes of the running write change
+    std::uint64_t version;
+  };
+
+  using NodeAllocator =
+      typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+  using NodeAllocatorTraits = std::allocator_traits<NodeAllocator>;
+
+  static int Height(const Node* node);
+  static int Size(const Node* node);
+  static void UpdateNode(Node* node);
+
+  template<class K>
+  const Node* FindNode(const Node* root, const K& key) const;
+
+  // number of values less than key, or not greater than key if inclusive
+  template<class K>
+  int CalcRank(const Node* root, const K& key, bool inclusive) const;
+
+  template<class K>
+  int CalcCount(const K& key) const;
+
+  // run write on the current root under the writer lock and publish the
+  // root it returns, on exception the tree is left as it was
+  template<class F>
+  void Write(F write);
+
+  // node itself if the running write created it, else a copy of it, the
+  // original is retired once the new root is published
+  Node* Mutable(Node* node);
+
+  Node* InsertNode(Node* node, Node* added);
+
+  template<class K>
+  Node* EraseNode(Node* node, const K& key);
+
+  // erase the leftmost node of the subtree, which is returned in *min
+  Node* EraseMin(Node* node, Node** min);
+
+  // return the new root of the subtree
+  Node* Balance(Node* node);
+  Node* RotateLeft(Node* node);
+  Node* RotateRight(Node* node);
+
+  template<class... Args>
+  Node* CreateNode(Args&& ... args);
+  void DestroyNode(Node* node);
+  void DestroyTree(Node* node);
+
+  static void DestroyRetired(void* tree, void* node);
+
+  [[no_unique_address]] Compare comp_;
+  [[no_unique_address]] NodeAllocator allocator_;
+  mutable EpochReclamation reclamation_;
+  std::atomic<Node*> root_ = nullptr;
+
+  std::mutex writer_mutex_;
+  std::uint64_t version_ = 0;
+  // nodes created and nodes replaced by the running write
+  std::vector<Node*> created_;
+  std::vector<Node*> replaced_;
+};
+
+// definitions
+
+template<class T, class Compare, class Allocator>
+template<class... Args>
+ConcurrentBinarySearchTree<T, Compare, Allocator>::Node::Node
+    (std::uint64_t version, Args&& ... args) :
+    value(std::forward<Args>(args)...), version(version) {}
+
+template<class T, class Compare, class Allocator>
+ConcurrentBinarySearchTree<T, Compare, Allocator>::ConcurrentBinarySearchTree
+    (const Compare& comp, const Allocator& allocator) :
+    comp_(comp), allocator_(allocator) {}
+
+template<class T, class Compare, class Allocator>
+ConcurrentBinarySearchTree<T, Compare, Allocator>::ConcurrentBinarySearchTree
+    (const std::initializer_list<T>& list, const Compare& comp,
+     const Allocator& allocator) :
+    comp_(comp), allocator_(allocator) {
+  for (const T& value : list) {
+    insert(value);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+ConcurrentBinarySearchTree<T, Compare, Allocator>::
+    ~ConcurrentBinarySearchTree() {
+  DestroyTree(root_.load(std::memory_order_relaxed));
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentBinarySearchTree<T, Compare, Allocator>::value_compare
+ConcurrentBinarySearchTree<T, Compare, Allocator>::value_comp() const {
+  return comp_;
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentBinarySearchTree<T, Compare, Allocator>::allocator_type
+ConcurrentBinarySearchTree<T, Compare, Allocator>::get_allocator() const {
+  return Allocator(allocator_);
+}
+
+template<class T, class Compare, class Allocator>
+int ConcurrentBinarySearchTree<T, Compare, Allocator>::size() const {
+  EpochReclamation::Guard guard = reclamation_.Pin();
+  return Size(root_.load(std::memory_order_acquire));
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentBinarySearchTree<T, Compare, Allocator>::empty() const {
+  return root_.load(std::memory_order_acquire) == nullptr;
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentBinarySearchTree<T, Compare, Allocator>::contains
+    (const T& value) const {
+  EpochReclamation::Guard guard = reclamation_.Pin();
+  return FindNode(root_.load(std::memory_order_acquire), value) != nullptr;
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+bool ConcurrentBinarySearchTree<T, Compare, Allocator>::contains
+    (const K& key) const {
+  EpochReclamation::Guard guard = reclamation_.Pin();
+  return FindNode(root_.load(std::memory_order_acquire), key) != nullptr;
+}
+
+template<class T, class Compare, class Allocator>
+int ConcurrentBinarySearchTree<T, Compare, Allocator>::count
+    (const T& value) const {
+  return CalcCount(value);
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+int ConcurrentBinarySearchTree<T, Compare, Allocator>::count
+    (const K& key) const {
+  return CalcCount(key);
+}
+
+template<class T, class Compare, class Allocator>
+std::optional<T> ConcurrentBinarySearchTree<T, Compare, Allocator>::find
+    (const T& value) const {
+  EpochReclamation::Guard guard = reclamation_.Pin();
+  const Node* node = FindNode(root_.load(std::memory_order_acquire), value);
+  if (node == nullptr) {
+    return std::nullopt;
+  }
+  return node->value;
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+std::optional<T> ConcurrentBinarySearchTree<T, Compare, Allocator>::find
+    (const K& key) const {
+  EpochReclamation::Guard guard = reclamation_.Pin();
+  const Node* node = FindNode(root_.load(std::memory_order_acquire), key);
+  if (node == nullptr) {
+    return std::nullopt;
+  }
+  return node->value;
+}
+
+template<class T, class Compare, class Allocator>
+std::vector<T>
+ConcurrentBinarySearchTree<T, Compare, Allocator>::to_vector() const {
+  EpochReclamation::Guard guard = reclamation_.Pin();
+  const Node* node = root_.load(std::memory_order_acquire);
+  std::vector<T> values;
+  values.reserve(Size(node));
+  std::vector<const Node*> stack;
+  while (node != nullptr || !stack.empty()) {
+    while (node != nullptr) {
+      stack.push_back(node);
+      node = node->left;
+    }
+    node = stack.back();
+    stack.pop_back();
+    values.push_back(node->value);
+    node = node->right;
+  }
+  return values;
+}
+
+template<class T, class Compare, class Allocator>
+template<class... Args>
+void ConcurrentBinarySearchTree<T, Compare, Allocator>::emplace
+    (Args&& ... args) {
+  Write([&](Node* root) {
+    return InsertNode(root, CreateNode(version_, std::forward<Args>(args)...));
+  });
+}
+
+template<class T, class Compare, class Allocator>
+template<class U>
+void ConcurrentBinarySearchTree<T, Compare, Allocator>::insert(U&& value) {
+  emplace(std::forward<U>(value));
+}
+
+template<class T, class Compare, class Allocator>
+void ConcurrentBinarySearchTree<T, Compare, Allocator>::erase
+    (const T& value) {
+  Write([&](Node* root) {
+    return FindNode(root, value) == nullptr ? root : EraseNode(root, value);
+  });
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+void ConcurrentBinarySearchTree<T, Compare, Allocator>::erase(const K& key) {
+  Write([&](Node* root) {
+    return FindNode(root, key) == nullptr ? root : EraseNode(root, key);
+  });
+}
+
+template<class T, class Compare, class Allocator>
+void ConcurrentBinarySearchTree<T, Compare, Allocator>::clear() {
+  Write([&](Node* root) {
+    std::vector<Node*> stack;
+    if (root != nullptr) {
+      stack.push_back(root);
+    }
+    while (!stack.empty()) {
+      Node* node = stack.back();
+      stack.pop_back();
+      replaced_.push_back(node);
+      if (node->left != nullptr) {
+        stack.push_back(node->left);
+      }
+      if (node->right != nullptr) {
+        stack.push_back(node->right);
+      }
+    }
+    return static_cast<Node*>(nullptr);
+  });
+}
+
+template<class T, class Compare, class Allocator>
+int ConcurrentBinarySearchTree<T, Compare, Allocator>::Height
+    (const Node* node) {
+  return node == nullptr ? 0 : node->height;
+}
+
+template<class T, class Compare, class Allocator>
+int ConcurrentBinarySearchTree<T, Compare, Allocator>::Size
+    (const Node* node) {
+  return node == nullptr ? 0 : node->size;
+}
+
+template<class T, class Compare, class Allocator>
+void ConcurrentBinarySearchTree<T, Compare, Allocator>::UpdateNode
+    (Node* node) {
+  node->height = std::max(Height(node->left), Height(node->right)) + 1;
+  node->size = Size(node->left) + Size(node->right) + 1;
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+const typename ConcurrentBinarySearchTree<T, Compare, Allocator>::Node*
+ConcurrentBinarySearchTree<T, Compare, Allocator>::FindNode
+    (const Node* root, const K& key) const {
+  const Node* node = root;
+  while (node != nullptr) {
+    if (comp_(key, node->value)) {
+      node = node->left;
+    } else if (comp_(node->value, key)) {
+      node = node->right;
+    } else {
+      return node;
+    }
+  }
+  return nullptr;
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+int ConcurrentBinarySearchTree<T, Compare, Allocator>::CalcRank
+    (const Node* root, const K& key, bool inclusive) const {
+  int rank = 0;
+  const Node* node = root;
+  while (node != nullptr) {
+    bool goes_right =
+        inclusive ? !comp_(key, node->value) : comp_(node->value, key);
+    if (goes_right) {
+      rank += Size(node->left) + 1;
+      node = node->right;
+    } else {
+      node = node->left;
+    }
+  }
+  return rank;
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+int ConcurrentBinarySearchTree<T, Compare, Allocator>::CalcCount
+    (const K& key) const {
+  EpochReclamation::Guard guard = reclamation_.Pin();
+  // both ranks have to come from the same snapshot
+  const Node* root = root_.load(std::memory_order_acquire);
+  return CalcRank(root, key, true) - CalcRank(root, key, false);
+}
+
+template<class T, class Compare, class Allocator>
+template<class F>
+void ConcurrentBinarySearchTree<T, Compare, Allocator>::Write(F write) {
+  std::lock_guard<std::mutex> lock(writer_mutex_);
+  ++version_;
+  Node* root;
+  try {
+    // only writers free nodes, so the writer walks the tree unpinned
+    root = write(root_.load(std::memory_order_relaxed));
+  } catch (...) {
+    for (Node* node : created_) {
+      DestroyNode(node);
+    }
+    created_.clear();
+    replaced_.clear();
+    throw;
+  }
+  root_.store(root, std::memory_order_release);
+  for (Node* node : replaced_) {
+    reclamation_.Retire(node, &DestroyRetired, this);
+  }
+  created_.clear();
+  replaced_.clear();
+  reclamation_.Collect();
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentBinarySearchTree<T, Compare, Allocator>::Node*
+ConcurrentBinarySearchTree<T, Compare, Allocator>::Mutable(Node* node) {
+  if (node->version == version_) {
+    return node;
+  }
+  Node* copy = CreateNode(version_, node->value);
+  copy->left = node->left;
+  copy->right = node->right;
+  copy->height = node->height;
+  copy->size = node->size;
+  replaced_.push_back(node);
+  return copy;
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentBinarySearchTree<T, Compare, Allocator>::Node*
+ConcurrentBinarySearchTree<T, Compare, Allocator>::InsertNode
+    (Node* node, Node* added) {
+  if (node == nullptr) {
+    return added;
+  }
+  node = Mutable(node);
+  if (comp_(added->value, node->value)) {
+    node->left = InsertNode(node->left, added);
+  } else {
+    node->right = InsertNode(node->right, added);
+  }
+  return Balance(node);
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+typename ConcurrentBinarySearchTree<T, Compare, Allocator>::Node*
+ConcurrentBinarySearchTree<T, Compare, Allocator>::EraseNode
+    (Node* node, const K& key) {
+  if (comp_(key, node->value)) {
+    node = Mutable(node);
+    node->left = EraseNode(node->left, key);
+    return Balance(node);
+  }
+  if (comp_(node->value, key)) {
+    node = Mutable(node);
+    node->right = EraseNode(node->right, key);
+    return Balance(node);
+  }
+  replaced_.push_back(node);
+  if (node->left == nullptr) {
+    return node->right;
+  }
+  if (node->right == nullptr) {
+    return node->left;
+  }
+  Node* successor;
+  Node* right = EraseMin(node->right, &successor);
+  successor->left = node->left;
+  successor->right = right;
+  return Balance(successor);
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentBinarySearchTree<T, Compare, Allocator>::Node*
+ConcurrentBinarySearchTree<T, Compare, Allocator>::EraseMin
+    (Node* node, Node** min) {
+  if (node->left == nullptr) {
+    *min = Mutable(node);
+    return node->right;
+  }
+  node = Mutable(node);
+  node->left = EraseMin(node->left, min);
+  return Balance(node);
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentBinarySearchTree<T, Compare, Allocator>::Node*
+ConcurrentBinarySearchTree<T, Compare, Allocator>::Balance(Node* node) {
+  UpdateNode(node);
+  int balance = Height(node->left) - Height(node->right);
+  if (balance > 1) {
+    if (Height(node->left->left) < Height(node->left->right)) {
+      node->left = RotateLeft(Mutable(node->left));
+    }
+    return RotateRight(node);
+  }
+  if (balance < -1) {
+    if (Height(node->right->right) < Height(node->right->left)) {
+      node->right = RotateRight(Mutable(node->right));
+    }
+    return RotateLeft(node);
+  }
+  return node;
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentBinarySearchTree<T, Compare, Allocator>::Node*
+ConcurrentBinarySearchTree<T, Compare, Allocator>::RotateLeft(Node* node) {
+  Node* pivot = Mutable(node->right);
+  node->right = pivot->left;
+  pivot->left = node;
+  UpdateNode(node);
+  UpdateNode(pivot);
+  return pivot;
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentBinarySearchTree<T, Compare, Allocator>::Node*
+ConcurrentBinarySearchTree<T, Compare, Allocator>::RotateRight(Node* node) {
+  Node* pivot = Mutable(node->left);
+  node->left = pivot->right;
+  pivot->right = node;
+  UpdateNode(node);
+  UpdateNode(pivot);
+  return pivot;
+}
+
+template<class T, class Compare, class Allocator>
+template<class... Args>
+typename ConcurrentBinarySearchTree<T, Compare, Allocator>::Node*
+ConcurrentBinarySearchTree<T, Compare, Allocator>::CreateNode
+    (Args&& ... args) {
+  created_.reserve(created_.size() + 1);
+  Node* node = NodeAllocatorTraits::allocate(allocator_, 1);
+  try {
+    NodeAllocatorTraits::construct(allocator_, node,
+                                   std::forward<Args>(args)...);
+  } catch (...) {
+    NodeAllocatorTraits::deallocate(allocator_, node, 1);
+    throw;
+  }
+  created_.push_back(node);
+  return node;
+}
+
+template<class T, class Compare, class Allocator>
+void ConcurrentBinarySearchTree<T, Compare, Allocator>::DestroyNode
+    (Node* node) {
+  NodeAllocatorTraits::destroy(allocator_, node);
+  NodeAllocatorTraits::deallocate(allocator_, node, 1);
+}
+
+template<class T, class Compare, class Allocator>
+void ConcurrentBinarySearchTree<T, Compare, Allocator>::DestroyTree
+    (Node* node) {
+  std::vector<Node*> stack;
+  if (node != nullptr) {
+    stack.push_back(node);
+  }
+  while (!stack.empty()) {
+    node = stack.back();
+    stack.pop_back();
+    if (node->left != nullptr) {
+      stack.push_back(node->left);
+    }
+    if (node->right != nullptr) {
+      stack.push_back(node->right);
+    }
+    DestroyNode(node);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+void ConcurrentBinarySearchTree<T, Compare, Allocator>::DestroyRetired
+    (void* tree, void* node) {
+  static_cast<ConcurrentBinarySearchTree*>(tree)->DestroyNode(
+      static_cast<Node*>(node));
+}
+
+#endif  // CONCURRENT_BINARY_SEARCH_TREE_H_
@@ -0,0 +1,540 @@
+#ifndef CONCURRENT_SKIP_LIST_H_
+#define CONCURRENT_SKIP_LIST_H_
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "binary_search_tree.h"
+#include "epoch_reclamation.h"
+
+// Lock-free ordered set, a skip list after Herlihy and Shavit. Any number
+// of threads may insert, erase and look up at once and none of them ever
+// waits for another. Unlike BinarySearchTree it keeps unique values, so
+// insert and erase report whether they changed the set.
+//
+// A node is erased by marking its links from the top level down, the mark
+// on the bottom link is the moment it leaves the set. Traversals unlink
+// marked nodes as they pass them. Each node counts the levels it is linked
+// on, the thread that unlinks the last one retires the node to epoch-based
+// reclamation. The allocator has to be safe to use from several threads.
+//
+// for_each and to_vector see every value that was in the set for the whole
+// walk and no value that was erased before it started, values inserted or
+// erased meanwhile may or may not show up.
+template<class T, class Compare = std::less<T>,
+    class Allocator = std::allocator<T>>
+class ConcurrentSkipList {
+ public:
+  using value_compare = Compare;
+  using allocator_type = Allocator;
+
+  ConcurrentSkipList() = default;
+  explicit ConcurrentSkipList(const Compare& comp,
+                              const Allocator& allocator = Allocator());
+
+  ConcurrentSkipList(const std::initializer_list<T>& list,
+                     const Compare& comp = Compare(),
+                     const Allocator& allocator = Allocator());
+
+  ConcurrentSkipList(const ConcurrentSkipList&) = delete;
+  ConcurrentSkipList& operator=(const ConcurrentSkipList&) = delete;
+
+  // no other thread may use the list anymore
+  ~ConcurrentSkipList();
+
+  value_compare value_comp() const;
+  allocator_type get_allocator() const;
+
+  // exact when no writer runs concurrently
+  int size() const;
+  bool empty() const;
+
+  bool contains(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  bool contains(const K& key) const;
+
+  int count(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  int count(const K& key) const;
+
+  // false if an equivalent value is in the set already
+  template<class... Args>
+  bool emplace(Args&& ... args);
+
+  template<class U>
+  bool insert(U&& value);
+
+  // false if no equivalent value is in the set
+  bool erase(const T& value);
+  template<class K> requires TransparentCompare<Compare>
+  bool erase(const K& key);
+
+  // f(value) for the values in order
+  template<class F>
+  void for_each(F f) const;
+
+  std::vector<T> to_vector() const;
+
+ private:
+  static constexpr int kMaxHeight = 32;
+
+  // pointer to the next node, the low bit marks the owner as erased
+  using Link = std::uintptr_t;
+  using AtomicLink = std::atomic<Link>;
+
+  // followed in memory by height links, one per level
+  struct Node {
+    template<class... Args>
+    explicit Node(int height, Args&& ... args);
+
+    AtomicLink* Links();
+
+    T value;
+    int height;
+    // levels the node is linked on plus one while its insert runs
+    std::atomic<int> references = 1;
+  };
+
+  static constexpr std::size_t kLinksOffset =
+      (sizeof(Node) + alignof(AtomicLink) - 1) / alignof(AtomicLink)
+          * alignof(AtomicLink);
+
+  // nodes are allocated as arrays of units to fit their links
+  struct alignas(std::max(alignof(Node), alignof(AtomicLink))) Unit {
+    unsigned char bytes[std::max(alignof(Node), alignof(AtomicLink))];
+  };
+
+  using UnitAllocator =
+      typename std::allocator_traits<Allocator>::template rebind_alloc<Unit>;
+  using UnitAllocatorTraits = std::allocator_traits<UnitAllocator>;
+
+  static Link ToLink(Node* node);
+  static Node* ToNode(Link link);
+  static bool IsMarked(Link link);
+
+  static int RandomHeight();
+  static std::size_t UnitCount(int height);
+
+  // preds[level] are the links of the last node before key on each level,
+  // succs[level] the first node not less than key, marked nodes on the
+  // way are unlinked, true if succs[0] is equivalent to key
+  template<class K>
+  bool Find(const K& key, AtomicLink** preds, Node** succs);
+
+  // the first node not less than key, without unlinking anything
+  template<class K>
+  Node* LowerBound(const K& key) const;
+
+  template<class K>
+  bool Contains(const K& key) const;
+
+  template<class K>
+  bool EraseKey(const K& key);
+
+  // drop one reference, the last one retires the node
+  void Release(Node* node);
+
+  template<class... Args>
+  Node* CreateNode(int height, Args&& ... args);
+  void DestroyNode(Node* node);
+
+  static void DestroyRetired(void* list, void* node);
+
+  [[no_unique_address]] Compare comp_;
+  [[no_unique_address]] UnitAllocator allocator_;
+  mutable EpochReclamation reclamation_;
+  AtomicLink head_[kMaxHeight] = {};
+  std::atomic<int> size_ = 0;
+};
+
+// definitions
+
+template<class T, class Compare, class Allocator>
+template<class... Args>
+ConcurrentSkipList<T, Compare, Allocator>::Node::Node
+    (int height, Args&& ... args) :
+    value(std::forward<Args>(args)...), height(height) {}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentSkipList<T, Compare, Allocator>::AtomicLink*
+ConcurrentSkipList<T, Compare, Allocator>::Node::Links() {
+  return std::launder(reinterpret_cast<AtomicLink*>(
+      reinterpret_cast<unsigned char*>(this) + kLinksOffset));
+}
+
+template<class T, class Compare, class Allocator>
+ConcurrentSkipList<T, Compare, Allocator>::ConcurrentSkipList
+    (const Compare& comp, const Allocator& allocator) :
+    comp_(comp), allocator_(allocator) {}
+
+template<class T, class Compare, class Allocator>
+ConcurrentSkipList<T, Compare, Allocator>::ConcurrentSkipList
+    (const std::initializer_list<T>& list, const Compare& comp,
+     const Allocator& allocator) :
+    comp_(comp), allocator_(allocator) {
+  for (const T& value : list) {
+    insert(value);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+ConcurrentSkipList<T, Compare, Allocator>::~ConcurrentSkipList() {
+  // an erased node can stay linked on an upper level after it left the
+  // bottom one, so gather the nodes of every level
+  std::vector<Node*> nodes;
+  for (int level = 0; level < kMaxHeight; ++level) {
+    for (Node* node = ToNode(head_[level].load()); node != nullptr;
+         node = ToNode(node->Links()[level].load())) {
+      nodes.push_back(node);
+    }
+  }
+  std::sort(nodes.begin(), nodes.end());
+  nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+  for (Node* node : nodes) {
+    DestroyNode(node);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentSkipList<T, Compare, Allocator>::value_compare
+ConcurrentSkipList<T, Compare, Allocator>::value_comp() const {
+  return comp_;
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentSkipList<T, Compare, Allocator>::allocator_type
+ConcurrentSkipList<T, Compare, Allocator>::get_allocator() const {
+  return Allocator(allocator_);
+}
+
+template<class T, class Compare, class Allocator>
+int ConcurrentSkipList<T, Compare, Allocator>::size() const {
+  return size_.load(std::memory_order_relaxed);
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentSkipList<T, Compare, Allocator>::empty() const {
+  EpochReclamation::Guard guard = reclamation_.Pin();
+  Node* node = ToNode(head_[0].load());
+  while (node != nullptr) {
+    Link next = node->Links()[0].load();
+    if (!IsMarked(next)) {
+      return false;
+    }
+    node = ToNode(next);
+  }
+  return true;
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentSkipList<T, Compare, Allocator>::contains
+    (const T& value) const {
+  return Contains(value);
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+bool ConcurrentSkipList<T, Compare, Allocator>::contains(const K& key) const {
+  return Contains(key);
+}
+
+template<class T, class Compare, class Allocator>
+int ConcurrentSkipList<T, Compare, Allocator>::count(const T& value) const {
+  return Contains(value) ? 1 : 0;
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+int ConcurrentSkipList<T, Compare, Allocator>::count(const K& key) const {
+  return Contains(key) ? 1 : 0;
+}
+
+template<class T, class Compare, class Allocator>
+template<class... Args>
+bool ConcurrentSkipList<T, Compare, Allocator>::emplace(Args&& ... args) {
+  Node* node = CreateNode(RandomHeight(), std::forward<Args>(args)...);
+  AtomicLink* links = node->Links();
+  AtomicLink* preds[kMaxHeight];
+  Node* succs[kMaxHeight];
+  {
+    EpochReclamation::Guard guard = reclamation_.Pin();
+    while (true) {
+      if (Find(node->value, preds, succs)) {
+        DestroyNode(node);
+        return false;
+      }
+      for (int level = 0; level < node->height; ++level) {
+        links[level].store(ToLink(succs[level]), std::memory_order_relaxed);
+      }
+      // the bottom level decides, the node is in the set once linked there
+      node->references.fetch_add(1);
+      Link expected = ToLink(succs[0]);
+      if (preds[0][0].compare_exchange_strong(expected, ToLink(node))) {
+        break;
+      }
+      node->references.fetch_sub(1);
+    }
+    size_.fetch_add(1, std::memory_order_relaxed);
+
+    bool is_erased = false;
+    for (int level = 1; level < node->height && !is_erased; ++level) {
+      while (true) {
+        // nobody links after the node on a level it is not on yet, so
+        // only an erase that marks it changes the link meanwhile
+        Link next = links[level].load();
+        if (IsMarked(next) || (ToNode(next) != succs[level]
+            && !links[level].compare_exchange_strong(
+                next, ToLink(succs[level])))) {
+          is_erased = true;
+          break;
+        }
+        node->references.fetch_add(1);
+        Link expected = ToLink(succs[level]);
+        if (preds[level][level].compare_exchange_strong(expected,
+                                                        ToLink(node))) {
+          break;
+        }
+        node->references.fetch_sub(1);
+        Find(node->value, preds, succs);
+      }
+    }
+    // an erase that ran meanwhile may have missed the levels linked late
+    if (IsMarked(links[0].load())) {
+      Find(node->value, preds, succs);
+    }
+    Release(node);
+  }
+  reclamation_.Collect();
+  return true;
+}
+
+template<class T, class Compare, class Allocator>
+template<class U>
+bool ConcurrentSkipList<T, Compare, Allocator>::insert(U&& value) {
+  return emplace(std::forward<U>(value));
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentSkipList<T, Compare, Allocator>::erase(const T& value) {
+  return EraseKey(value);
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+bool ConcurrentSkipList<T, Compare, Allocator>::erase(const K& key) {
+  return EraseKey(key);
+}
+
+template<class T, class Compare, class Allocator>
+template<class F>
+void ConcurrentSkipList<T, Compare, Allocator>::for_each(F f) const {
+  EpochReclamation::Guard guard = reclamation_.Pin();
+  Node* node = ToNode(head_[0].load());
+  while (node != nullptr) {
+    Link next = node->Links()[0].load();
+    if (!IsMarked(next)) {
+      f(node->value);
+    }
+    node = ToNode(next);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+std::vector<T> ConcurrentSkipList<T, Compare, Allocator>::to_vector() const {
+  std::vector<T> values;
+  values.reserve(size());
+  for_each([&values](const T& value) {
+    values.push_back(value);
+  });
+  return values;
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentSkipList<T, Compare, Allocator>::Link
+ConcurrentSkipList<T, Compare, Allocator>::ToLink(Node* node) {
+  return reinterpret_cast<Link>(node);
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentSkipList<T, Compare, Allocator>::Node*
+ConcurrentSkipList<T, Compare, Allocator>::ToNode(Link link) {
+  return reinterpret_cast<Node*>(link & ~Link(1));
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentSkipList<T, Compare, Allocator>::IsMarked(Link link) {
+  return (link & 1) != 0;
+}
+
+template<class T, class Compare, class Allocator>
+int ConcurrentSkipList<T, Compare, Allocator>::RandomHeight() {
+  // every level holds half of the nodes of the level below
+  static thread_local std::minstd_rand gen(std::random_device{}());
+  std::uint32_t bits = static_cast<std::uint32_t>(gen());
+  return 1 + std::countr_zero(bits | (std::uint32_t(1) << (kMaxHeight - 1)));
+}
+
+template<class T, class Compare, class Allocator>
+std::size_t ConcurrentSkipList<T, Compare, Allocator>::UnitCount(int height) {
+  return (kLinksOffset + height * sizeof(AtomicLink) + sizeof(Unit) - 1)
+      / sizeof(Unit);
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+bool ConcurrentSkipList<T, Compare, Allocator>::Find
+    (const K& key, AtomicLink** preds, Node** succs) {
+  while (true) {
+    AtomicLink* pred = head_;
+    bool is_consistent = true;
+    for (int level = kMaxHeight - 1; level >= 0 && is_consistent; --level) {
+      Node* current = ToNode(pred[level].load());
+      while (current != nullptr) {
+        Link next = current->Links()[level].load();
+        if (IsMarked(next)) {
+          Link expected = ToLink(current);
+          if (!pred[level].compare_exchange_strong(expected,
+                                                   ToLink(ToNode(next)))) {
+            // pred changed or got erased itself, start over
+            is_consistent = false;
+            break;
+          }
+          Release(current);
+          current = ToNode(next);
+        } else if (comp_(current->value, key)) {
+          pred = current->Links();
+          current = ToNode(next);
+        } else {
+          break;
+        }
+      }
+      preds[level] = pred;
+      succs[level] = current;
+    }
+    if (is_consistent) {
+      return succs[0] != nullptr && !comp_(key, succs[0]->value);
+    }
+  }
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+typename ConcurrentSkipList<T, Compare, Allocator>::Node*
+ConcurrentSkipList<T, Compare, Allocator>::LowerBound(const K& key) const {
+  const AtomicLink* pred = head_;
+  Node* current = nullptr;
+  for (int level = kMaxHeight - 1; level >= 0; --level) {
+    current = ToNode(pred[level].load());
+    while (current != nullptr) {
+      Link next = current->Links()[level].load();
+      if (!IsMarked(next) && !comp_(current->value, key)) {
+        break;
+      }
+      // an erased node is stepped over but never becomes pred
+      if (!IsMarked(next)) {
+        pred = current->Links();
+      }
+      current = ToNode(next);
+    }
+  }
+  return current;
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+bool ConcurrentSkipList<T, Compare, Allocator>::Contains(const K& key) const {
+  EpochReclamation::Guard guard = reclamation_.Pin();
+  Node* node = LowerBound(key);
+  return node != nullptr && !comp_(key, node->value);
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+bool ConcurrentSkipList<T, Compare, Allocator>::EraseKey(const K& key) {
+  AtomicLink* preds[kMaxHeight];
+  Node* succs[kMaxHeight];
+  bool is_erased = false;
+  {
+    EpochReclamation::Guard guard = reclamation_.Pin();
+    if (!Find(key, preds, succs)) {
+      return false;
+    }
+    Node* node = succs[0];
+    AtomicLink* links = node->Links();
+    for (int level = node->height - 1; level > 0; --level) {
+      Link next = links[level].load();
+      while (!IsMarked(next)
+          && !links[level].compare_exchange_weak(next, next | 1)) {}
+    }
+    // of concurrent erases the one that marks the bottom link wins
+    Link next = links[0].load();
+    while (!IsMarked(next)) {
+      if (links[0].compare_exchange_weak(next, next | 1)) {
+        is_erased = true;
+        size_.fetch_sub(1, std::memory_order_relaxed);
+        Find(key, preds, succs);
+        break;
+      }
+    }
+  }
+  if (is_erased) {
+    reclamation_.Collect();
+  }
+  return is_erased;
+}
+
+template<class T, class Compare, class Allocator>
+void ConcurrentSkipList<T, Compare, Allocator>::Release(Node* node) {
+  if (node->references.fetch_sub(1) == 1) {
+    reclamation_.Retire(node, &DestroyRetired, this);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+template<class... Args>
+typename ConcurrentSkipList<T, Compare, Allocator>::Node*
+ConcurrentSkipList<T, Compare, Allocator>::CreateNode
+    (int height, Args&& ... args) {
+  Unit* units = UnitAllocatorTraits::allocate(allocator_, UnitCount(height));
+  Node* node;
+  try {
+    node = ::new(static_cast<void*>(units))
+        Node(height, std::forward<Args>(args)...);
+  } catch (...) {
+    UnitAllocatorTraits::deallocate(allocator_, units, UnitCount(height));
+    throw;
+  }
+  AtomicLink* links = node->Links();
+  for (int level = 0; level < height; ++level) {
+    ::new(static_cast<void*>(links + level)) AtomicLink(0);
+  }
+  return node;
+}
+
+template<class T, class Compare, class Allocator>
+void ConcurrentSkipList<T, Compare, Allocator>::DestroyNode(Node* node) {
+  int height = node->height;
+  std::destroy_n(node->Links(), height);
+  std::destroy_at(node);
+  UnitAllocatorTraits::deallocate(allocator_, reinterpret_cast<Unit*>(node),
+                                  UnitCount(height));
+}
+
+template<class T, class Compare, class Allocator>
+void ConcurrentSkipList<T, Compare, Allocator>::DestroyRetired
+    (void* list, void* node) {
+  static_cast<ConcurrentSkipList*>(list)->DestroyNode(
+      static_cast<Node*>(node));
+}
+
+#endif  // CONCURRENT_SKIP_LIST_H_
@@ -0,0 +1,1175 @@
+#ifndef DISK_BINARY_SEARCH_TREE_H_
+#define DISK_BINARY_SEARCH_TREE_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "binary_search_tree.h"
+
+// Page traffic of a DiskBufferPool. A fault is a fetch of a page that was
+// not in memory and had to be read from the file.
+struct DiskIoStats {
+  std::uint64_t fetches = 0;
+  std::uint64_t faults = 0;
+  std::uint64_t writes = 0;
+  std::uint64_t evictions = 0;
+};
+
+// Fixed-size pages of a file, cached in memory. A page stays pinned while a
+// PageRef to it lives. When the pool is full, the least recently used
+// unpinned page makes room and is written back first if it is dirty.
+class DiskBufferPool {
+ private:
+  struct Frame;
+
+ public:
+  using PageId = std::uint64_t;
+
+  static constexpr std::size_t kPageSize = 4096;
+  // enough for a root to leaf path and the pages a split or a removal
+  // touches next to it
+  static constexpr std::size_t kMinCapacity = 8;
+
+  class PageRef {
+    friend class DiskBufferPool;
+   public:
+    PageRef(const PageRef&) = delete;
+    PageRef& operator=(const PageRef&) = delete;
+
+    PageRef(PageRef&& rhs) noexcept;
+
+    ~PageRef();
+
+    PageId id() const;
+    std::byte* data() const;
+
+    // the page is written back before it leaves the pool
+    void mark_dirty() const;
+
+   private:
+    explicit PageRef(Frame* frame);
+
+    Frame* frame_;
+  };
+
+  // fd stays owned by the caller, capacity is at least kMinCapacity
+  DiskBufferPool(int fd, std::size_t capacity);
+
+  DiskBufferPool(const DiskBufferPool&) = delete;
+  DiskBufferPool& operator=(const DiskBufferPool&) = delete;
+
+  // writes back dirty pages, errors are lost here, call flush() to see them
+  ~DiskBufferPool();
+
+  PageRef fetch(PageId id);
+  // a zeroed page that is not read from the file
+  PageRef create(PageId id);
+
+  // write back every dirty page
+  void flush();
+
+  const DiskIoStats& stats() const;
+  void reset_stats();
+
+ private:
+  struct Frame {
+    PageId id = 0;
+    int pins = 0;
+    bool is_used = false;
+    bool is_dirty = false;
+    std::list<Frame*>::iterator lru_position;
+    std::unique_ptr<std::byte[]> data;
+  };
+
+  // the frame of id, moved to the front of the LRU list, nullptr if the
+  // page is not in memory
+  Frame* FindFrame(PageId id);
+
+  // an unused frame, or the least recently used unpinned one emptied
+  Frame* TakeFrame(PageId id);
+
+  void WriteBack(Frame* frame);
+
+  int fd_;
+  std::vector<Frame> frames_;
+  // most recently used first
+  std::list<Frame*> lru_;
+  std::unordered_map<PageId, Frame*> page_table_;
+  DiskIoStats stats_;
+};
+
+// Out-of-core multiset with the interface of BinarySearchTree. It is a B+
+// tree of kPageSize pages in a file, so a lookup reads O(log_B n) pages,
+// where B is the number of values in a page. A range scan reads the leaves
+// one after the other. Only a few pages at a time are kept in memory, in
+// an LRU DiskBufferPool. The size is 64-bit. Opening an existing file
+// picks up the tree in it.
+//
+// Leaves are linked both ways for iteration. Inner nodes hold keys k[i]
+// such that all values below child i are in [k[i - 1], k[i]], and
+// equivalent values may span several leaves. An insert into a full page
+// splits it in half, or leaves the old page full when the value goes to
+// the end of the last leaf, so appends fill pages completely. An erase
+// frees a page only once it is empty (free-at-empty). Underfull pages are
+// not merged, which keeps erase cheap and costs space only after mass
+// deletions.
+//
+// T must be trivially copyable, values are stored byte for byte.
+// Iterators hold a copy of their value and are invalidated by insert and
+// erase. Not thread-safe.
+template<class T, class Compare = std::less<T>>
+class DiskBinarySearchTree {
+ private:
+  using PageId = DiskBufferPool::PageId;
+  using PageRef = DiskBufferPool::PageRef;
+
+  // page 0 holds the file header, so it is never a node
+  static constexpr PageId kNoPage = 0;
+
+ public:
+  using value_compare = Compare;
+  using size_type = std::uint64_t;
+
+  // open the tree in path or create it, keep up to cache_pages pages in
+  // memory. Throws std::system_error if the file cannot be opened and
+  // std::runtime_error if it holds something else.
+  explicit DiskBinarySearchTree(const std::string& path,
+                                std::size_t cache_pages = 1024,
+                                const Compare& comp = Compare());
+
+  DiskBinarySearchTree(const DiskBinarySearchTree&) = delete;
+  DiskBinarySearchTree& operator=(const DiskBinarySearchTree&) = delete;
+
+  // flushes, errors are lost here, call flush() to see them
+  ~DiskBinarySearchTree();
+
+  value_compare value_comp() const;
+
+  size_type size() const;
+  bool empty() const;
+
+  // levels of pages, 1 for a tree of one leaf
+  int height() const;
+
+  bool contains(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  bool contains(const K& key) const;
+
+  size_type count(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  size_type count(const K& key) const;
+
+  void insert(const T& value);
+
+  template<class... Args>
+  void emplace(Args&& ... args);
+
+  // erase one value equivalent to value, if there is one
+  void erase(const T& value);
+  template<class K> requires TransparentCompare<Compare>
+  void erase(const K& key);
+
+  // write the dirty pages and the file header
+  void flush();
+
+  const DiskIoStats& io_stats() const;
+  void reset_io_stats();
+
+  class ConstIterator {
+    friend class DiskBinarySearchTree;
+   public:
+    using difference_type = std::ptrdiff_t;
+    using value_type = T;
+    using pointer = const T*;
+    using reference = const T&;
+    using iterator_category = std::bidirectional_iterator_tag;
+
+    ConstIterator() = default;
+
+    const T& operator*() const;
+
+    const T* operator->() const;
+
+    ConstIterator& operator++();
+    ConstIterator operator++(int);
+
+    ConstIterator& operator--();
+    ConstIterator operator--(int);
+
+    bool operator==(const ConstIterator& rhs) const;
+    bool operator!=(const ConstIterator& rhs) const;
+
+   private:
+    ConstIterator(const DiskBinarySearchTree* owner, PageId leaf,
+                  std::uint32_t index);
+
+    // move on to the next leaf while index_ is past the end of the current
+    // one, then copy the value
+    void Settle();
+
+    const DiskBinarySearchTree* owner_ = nullptr;
+    // end() is kNoPage
+    PageId leaf_ = kNoPage;
+    std::uint32_t index_ = 0;
+    std::optional<T> value_;
+  };
+  ConstIterator begin() const;
+
+  ConstIterator end() const;
+
+  ConstIterator find(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator find(const K& key) const;
+
+  // first value that is not less than value
+  ConstIterator lower_bound(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator lower_bound(const K& key) const;
+
+  // first value that is greater than value
+  ConstIterator upper_bound(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator upper_bound(const K& key) const;
+
+  std::pair<ConstIterator, ConstIterator> equal_range(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  std::pair<ConstIterator, ConstIterator> equal_range(const K& key) const;
+
+ private:
+  static_assert(std::is_trivially_copyable_v<T>,
+                "DiskBinarySearchTree needs a trivially copyable T");
+  static_assert(alignof(T) <= alignof(PageId),
+                "values would not be aligned in a page");
+
+  static constexpr std::size_t kPageSize = DiskBufferPool::kPageSize;
+  static constexpr std::uint64_t kMagic = 0x3145455254534244;  // "DBSTREE1"
+
+  struct FileHeader {
+    std::uint64_t magic;
+    std::uint64_t page_size;
+    std::uint64_t value_size;
+    std::uint64_t value_alignment;
+    PageId root;
+    PageId first_leaf;
+    PageId last_leaf;
+    std::uint64_t height;
+    std::uint64_t size;
+    std::uint64_t page_count;
+    // freed pages, each holds the id of the next one
+    PageId free_list;
+  };
+
+  struct NodeHeader {
+    std::uint32_t is_leaf;
+    // values in a leaf, children in an inner node
+    std::uint32_t count;
+    // neighbouring leaves
+    PageId prev;
+    PageId next;
+  };
+
+  static constexpr std::size_t kLeafCapacity =
+      (kPageSize - sizeof(NodeHeader)) / sizeof(T);
+  // an inner node of n children has n - 1 keys, the children follow the
+  // keys at a multiple of 8
+  static constexpr std::size_t kInnerCapacity =
+      (kPageSize - sizeof(NodeHeader) - sizeof(PageId))
+          / (sizeof(T) + sizeof(PageId));
+  static constexpr std::size_t kChildrenOffset =
+      (sizeof(NodeHeader) + (kInnerCapacity - 1) * sizeof(T)
+          + sizeof(PageId) - 1) / sizeof(PageId) * sizeof(PageId);
+  static_assert(kChildrenOffset + kInnerCapacity * sizeof(PageId)
+                    <= kPageSize);
+  static_assert(kLeafCapacity >= 4 && kInnerCapacity >= 4,
+                "values are too large for a page");
+
+  static NodeHeader& Header(const PageRef& page);
+  // values of a leaf, keys of an inner node
+  static T* Values(const PageRef& page);
+  static PageId* Children(const PageRef& page);
+
+  PageRef AllocatePage(bool is_leaf);
+  void FreePage(PageId id);
+
+  void WriteFileHeader();
+
+  template<class K>
+  ConstIterator LowerBound(const K& key) const;
+  template<class K>
+  ConstIterator UpperBound(const K& key) const;
+
+  template<class K>
+  ConstIterator FindValue(const K& key) const;
+
+  template<class K>
+  size_type CalcCount(const K& key) const;
+
+  template<class K>
+  void EraseValue(const K& key);
+
+  // the separator and the new right sibling if the page split
+  using SplitResult = std::optional<std::pair<T, PageId>>;
+
+  SplitResult InsertInto(PageId page_id, const T& value);
+  SplitResult InsertIntoLeaf(PageRef& page, const T& value);
+  SplitResult InsertIntoInner(PageRef& page, std::size_t child,
+                              const T& separator, PageId right);
+
+  // erase one value equivalent to key from the subtree at page_id, return
+  // whether there was one, *is_empty tells if the page is empty now
+  template<class K>
+  bool EraseFrom(PageId page_id, const K& key, bool* is_empty);
+
+  // take the empty child out of an inner node and free it
+  void RemoveChild(const PageRef& page, std::size_t child);
+
+  void UnlinkLeaf(const PageRef& leaf);
+
+  [[no_unique_address]] Compare comp_;
+  int fd_ = -1;
+  std::unique_ptr<DiskBufferPool> pool_;
+  FileHeader header_;
+};
+
+// definitions
+
+// DiskBufferPool
+
+inline DiskBufferPool::PageRef::PageRef(Frame* frame) : frame_(frame) {
+  ++frame_->pins;
+}
+
+inline DiskBufferPool::PageRef::PageRef(PageRef&& rhs) noexcept :
+    frame_(std::exchange(rhs.frame_, nullptr)) {}
+
+inline DiskBufferPool::PageRef::~PageRef() {
+  if (frame_ != nullptr) {
+    --frame_->pins;
+  }
+}
+
+inline DiskBufferPool::PageId DiskBufferPool::PageRef::id() const {
+  return frame_->id;
+}
+
+inline std::byte* DiskBufferPool::PageRef::data() const {
+  return frame_->data.get();
+}
+
+inline void DiskBufferPool::PageRef::mark_dirty() const {
+  frame_->is_dirty = true;
+}
+
+inline DiskBufferPool::DiskBufferPool(int fd, std::size_t capacity) :
+    fd_(fd), frames_(std::max(capacity, kMinCapacity)) {
+  for (Frame& frame : frames_) {
+    frame.data = std::make_unique<std::byte[]>(kPageSize);
+  }
+}
+
+inline DiskBufferPool::~DiskBufferPool() {
+  try {
+    flush();
+  } catch (const std::system_error&) {
+  }
+}
+
+inline DiskBufferPool::PageRef DiskBufferPool::fetch(PageId id) {
+  ++stats_.fetches;
+  Frame* frame = FindFrame(id);
+  if (frame != nullptr) {
+    return PageRef(frame);
+  }
+
+  ++stats_.faults;
+  frame = TakeFrame(id);
+  std::size_t done = 0;
+  while (done < kPageSize) {
+    ssize_t result = ::pread(fd_, frame->data.get() + done, kPageSize - done,
+                             static_cast<off_t>(id * kPageSize + done));
+    if (result <= 0) {
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      int error = result < 0 ? errno : EIO;
+      page_table_.erase(id);
+      frame->is_used = false;
+      throw std::system_error(error, std::generic_category(),
+                              "DiskBufferPool: read");
+    }
+    done += static_cast<std::size_t>(result);
+  }
+  return PageRef(frame);
+}
+
+inline DiskBufferPool::PageRef DiskBufferPool::create(PageId id) {
+  Frame* frame = FindFrame(id);
+  if (frame == nullptr) {
+    frame = TakeFrame(id);
+  }
+  std::memset(frame->data.get(), 0, kPageSize);
+  frame->is_dirty = true;
+  return PageRef(frame);
+}
+
+inline void DiskBufferPool::flush() {
+  for (Frame& frame : frames_) {
+    if (frame.is_used && frame.is_dirty) {
+      WriteBack(&frame);
+    }
+  }
+}
+
+inline const DiskIoStats& DiskBufferPool::stats() const {
+  return stats_;
+}
+
+inline void DiskBufferPool::reset_stats() {
+  stats_ = DiskIoStats();
+}
+
+inline DiskBufferPool::Frame* DiskBufferPool::FindFrame(PageId id) {
+  auto it = page_table_.find(id);
+  if (it == page_table_.end()) {
+    return nullptr;
+  }
+  Frame* frame = it->second;
+  lru_.splice(lru_.begin(), lru_, frame->lru_position);
+  return frame;
+}
+
+inline DiskBufferPool::Frame* DiskBufferPool::TakeFrame(PageId id) {
+  Frame* frame = nullptr;
+  if (lru_.size() < frames_.size()) {
+    frame = &frames_[lru_.size()];
+    lru_.push_front(frame);
+  } else {
+    for (auto it = lru_.rbegin(); it != lru_.rend(); ++it) {
+      if ((*it)->pins == 0) {
+        frame = *it;
+        break;
+      }
+    }
+    if (frame == nullptr) {
+      throw std::length_error("DiskBufferPool: every page is pinned");
+    }
+    if (frame->is_used) {
+      if (frame->is_dirty) {
+        WriteBack(frame);
+      }
+      page_table_.erase(frame->id);
+      ++stats_.evictions;
+    }
+    lru_.splice(lru_.begin(), lru_, frame->lru_position);
+  }
+  frame->lru_position = lru_.begin();
+  frame->id = id;
+  frame->is_used = true;
+  frame->is_dirty = false;
+  page_table_[id] = frame;
+  return frame;
+}
+
+inline void DiskBufferPool::WriteBack(Frame* frame) {
+  std::size_t done = 0;
+  while (done < kPageSize) {
+    ssize_t result = ::pwrite(fd_, frame->data.get() + done,
+                              kPageSize - done,
+                              static_cast<off_t>(frame->id * kPageSize + done));
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(),
+                              "DiskBufferPool: write");
+    }
+    done += static_cast<std::size_t>(result);
+  }
+  frame->is_dirty = false;
+  ++stats_.writes;
+}
+
+// DiskBinarySearchTree
+
+template<class T, class Compare>
+DiskBinarySearchTree<T, Compare>::DiskBinarySearchTree
+    (const std::string& path, std::size_t cache_pages, const Compare& comp) :
+    comp_(comp) {
+  fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd_ < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "DiskBinarySearchTree: open " + path);
+  }
+  try {
+    pool_ = std::make_unique<DiskBufferPool>(fd_, cache_pages);
+    struct stat file_stat;
+    if (::fstat(fd_, &file_stat) != 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "DiskBinarySearchTree: stat " + path);
+    }
+    if (file_stat.st_size == 0) {
+      header_ = FileHeader{kMagic, kPageSize, sizeof(T), alignof(T),
+                           1, 1, 1, 1, 0, 2, kNoPage};
+      PageRef root = pool_->create(1);
+      Header(root).is_leaf = 1;
+      WriteFileHeader();
+    } else {
+      if (static_cast<std::size_t>(file_stat.st_size) < 2 * kPageSize) {
+        throw std::runtime_error("DiskBinarySearchTree: bad header");
+      }
+      PageRef page = pool_->fetch(0);
+      std::memcpy(&header_, page.data(), sizeof(header_));
+      if (header_.magic != kMagic || header_.page_size != kPageSize
+          || header_.value_size != sizeof(T)
+          || header_.value_alignment != alignof(T)) {
+        throw std::runtime_error("DiskBinarySearchTree: bad header");
+      }
+    }
+  } catch (...) {
+    pool_.reset();
+    ::close(fd_);
+    throw;
+  }
+}
+
+template<class T, class Compare>
+DiskBinarySearchTree<T, Compare>::~DiskBinarySearchTree() {
+  try {
+    flush();
+  } catch (const std::system_error&) {
+  }
+  pool_.reset();
+  ::close(fd_);
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::value_compare
+DiskBinarySearchTree<T, Compare>::value_comp() const {
+  return comp_;
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::size_type
+DiskBinarySearchTree<T, Compare>::size() const {
+  return header_.size;
+}
+
+template<class T, class Compare>
+bool DiskBinarySearchTree<T, Compare>::empty() const {
+  return header_.size == 0;
+}
+
+template<class T, class Compare>
+int DiskBinarySearchTree<T, Compare>::height() const {
+  return static_cast<int>(header_.height);
+}
+
+template<class T, class Compare>
+bool DiskBinarySearchTree<T, Compare>::contains(const T& value) const {
+  return FindValue(value) != end();
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+bool DiskBinarySearchTree<T, Compare>::contains(const K& key) const {
+  return FindValue(key) != end();
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::size_type
+DiskBinarySearchTree<T, Compare>::count(const T& value) const {
+  return CalcCount(value);
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+typename DiskBinarySearchTree<T, Compare>::size_type
+DiskBinarySearchTree<T, Compare>::count(const K& key) const {
+  return CalcCount(key);
+}
+
+template<class T, class Compare>
+void DiskBinarySearchTree<T, Compare>::insert(const T& value) {
+  SplitResult split = InsertInto(header_.root, value);
+  if (split) {
+    // the root split, the tree grows a level
+    PageRef root = AllocatePage(false);
+    Header(root).count = 2;
+    Values(root)[0] = split->first;
+    Children(root)[0] = header_.root;
+    Children(root)[1] = split->second;
+    header_.root = root.id();
+    ++header_.height;
+  }
+  ++header_.size;
+}
+
+template<class T, class Compare>
+template<class... Args>
+void DiskBinarySearchTree<T, Compare>::emplace(Args&& ... args) {
+  insert(T(std::forward<Args>(args)...));
+}
+
+template<class T, class Compare>
+void DiskBinarySearchTree<T, Compare>::erase(const T& value) {
+  EraseValue(value);
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+void DiskBinarySearchTree<T, Compare>::erase(const K& key) {
+  EraseValue(key);
+}
+
+template<class T, class Compare>
+void DiskBinarySearchTree<T, Compare>::flush() {
+  WriteFileHeader();
+  pool_->flush();
+}
+
+template<class T, class Compare>
+const DiskIoStats& DiskBinarySearchTree<T, Compare>::io_stats() const {
+  return pool_->stats();
+}
+
+template<class T, class Compare>
+void DiskBinarySearchTree<T, Compare>::reset_io_stats() {
+  pool_->reset_stats();
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::ConstIterator
+DiskBinarySearchTree<T, Compare>::begin() const {
+  return ConstIterator(this, header_.first_leaf, 0);
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::ConstIterator
+DiskBinarySearchTree<T, Compare>::end() const {
+  return ConstIterator(this, kNoPage, 0);
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::ConstIterator
+DiskBinarySearchTree<T, Compare>::find(const T& value) const {
+  return FindValue(value);
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+typename DiskBinarySearchTree<T, Compare>::ConstIterator
+DiskBinarySearchTree<T, Compare>::find(const K& key) const {
+  return FindValue(key);
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::ConstIterator
+DiskBinarySearchTree<T, Compare>::lower_bound(const T& value) const {
+  return LowerBound(value);
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+typename DiskBinarySearchTree<T, Compare>::ConstIterator
+DiskBinarySearchTree<T, Compare>::lower_bound(const K& key) const {
+  return LowerBound(key);
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::ConstIterator
+DiskBinarySearchTree<T, Compare>::upper_bound(const T& value) const {
+  return UpperBound(value);
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+typename DiskBinarySearchTree<T, Compare>::ConstIterator
+DiskBinarySearchTree<T, Compare>::upper_bound(const K& key) const {
+  return UpperBound(key);
+}
+
+template<class T, class Compare>
+auto DiskBinarySearchTree<T, Compare>::equal_range(const T& value) const
+    -> std::pair<ConstIterator, ConstIterator> {
+  return {LowerBound(value), UpperBound(value)};
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+auto DiskBinarySearchTree<T, Compare>::equal_range(const K& key) const
+    -> std::pair<ConstIterator, ConstIterator> {
+  return {LowerBound(key), UpperBound(key)};
+}
+
+// ConstIterator
+
+template<class T, class Compare>
+DiskBinarySearchTree<T, Compare>::ConstIterator::ConstIterator
+    (const DiskBinarySearchTree* owner, PageId leaf, std::uint32_t index) :
+    owner_(owner), leaf_(leaf), index_(index) {
+  Settle();
+}
+
+template<class T, class Compare>
+const T& DiskBinarySearchTree<T, Compare>::ConstIterator::operator*() const {
+  return *value_;
+}
+
+template<class T, class Compare>
+const T* DiskBinarySearchTree<T, Compare>::ConstIterator::operator->() const {
+  return &*value_;
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::ConstIterator&
+DiskBinarySearchTree<T, Compare>::ConstIterator::operator++() {
+  ++index_;
+  Settle();
+  return *this;
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::ConstIterator
+DiskBinarySearchTree<T, Compare>::ConstIterator::operator++(int) {
+  auto copy = *this;
+  ++(*this);
+  return copy;
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::ConstIterator&
+DiskBinarySearchTree<T, Compare>::ConstIterator::operator--() {
+  if (leaf_ == kNoPage) {
+    leaf_ = owner_->header_.last_leaf;
+    index_ = Header(owner_->pool_->fetch(leaf_)).count;
+  }
+  // empty leaves only exist as the single leaf of an empty tree
+  while (index_ == 0) {
+    leaf_ = Header(owner_->pool_->fetch(leaf_)).prev;
+    index_ = Header(owner_->pool_->fetch(leaf_)).count;
+  }
+  --index_;
+  Settle();
+  return *this;
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::ConstIterator
+DiskBinarySearchTree<T, Compare>::ConstIterator::operator--(int) {
+  auto copy = *this;
+  --(*this);
+  return copy;
+}
+
+template<class T, class Compare>
+bool DiskBinarySearchTree<T, Compare>::ConstIterator::operator==
+    (const ConstIterator& rhs) const {
+  return leaf_ == rhs.leaf_ && index_ == rhs.index_;
+}
+
+template<class T, class Compare>
+bool DiskBinarySearchTree<T, Compare>::ConstIterator::operator!=
+    (const ConstIterator& rhs) const {
+  return !(*this == rhs);
+}
+
+template<class T, class Compare>
+void DiskBinarySearchTree<T, Compare>::ConstIterator::Settle() {
+  while (leaf_ != kNoPage) {
+    PageRef page = owner_->pool_->fetch(leaf_);
+    if (index_ < Header(page).count) {
+      value_ = Values(page)[index_];
+      return;
+    }
+    leaf_ = Header(page).next;
+    index_ = 0;
+  }
+  value_.reset();
+}
+
+// private
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::NodeHeader&
+DiskBinarySearchTree<T, Compare>::Header(const PageRef& page) {
+  return *reinterpret_cast<NodeHeader*>(page.data());
+}
+
+template<class T, class Compare>
+T* DiskBinarySearchTree<T, Compare>::Values(const PageRef& page) {
+  return reinterpret_cast<T*>(page.data() + sizeof(NodeHeader));
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::PageId*
+DiskBinarySearchTree<T, Compare>::Children(const PageRef& page) {
+  return reinterpret_cast<PageId*>(page.data() + kChildrenOffset);
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::PageRef
+DiskBinarySearchTree<T, Compare>::AllocatePage(bool is_leaf) {
+  PageId id;
+  if (header_.free_list != kNoPage) {
+    id = header_.free_list;
+    PageRef page = pool_->fetch(id);
+    std::memcpy(&header_.free_list, page.data(), sizeof(PageId));
+  } else {
+    id = header_.page_count++;
+  }
+  PageRef page = pool_->create(id);
+  Header(page).is_leaf = is_leaf;
+  return page;
+}
+
+template<class T, class Compare>
+void DiskBinarySearchTree<T, Compare>::FreePage(PageId id) {
+  PageRef page = pool_->fetch(id);
+  std::memcpy(page.data(), &header_.free_list, sizeof(PageId));
+  page.mark_dirty();
+  header_.free_list = id;
+}
+
+template<class T, class Compare>
+void DiskBinarySearchTree<T, Compare>::WriteFileHeader() {
+  PageRef page = pool_->create(0);
+  std::memcpy(page.data(), &header_, sizeof(header_));
+}
+
+template<class T, class Compare>
+template<class K>
+typename DiskBinarySearchTree<T, Compare>::ConstIterator
+DiskBinarySearchTree<T, Compare>::LowerBound(const K& key) const {
+  // the first value not less than key is below the first key that is not
+  // less than key, or in a leaf after it
+  PageId page_id = header_.root;
+  while (true) {
+    PageRef page = pool_->fetch(page_id);
+    const NodeHeader& header = Header(page);
+    const T* values = Values(page);
+    if (header.is_leaf) {
+      auto position = std::lower_bound(values, values + header.count, key,
+                                       comp_) - values;
+      return ConstIterator(this, page_id,
+                           static_cast<std::uint32_t>(position));
+    }
+    auto child = std::lower_bound(values, values + header.count - 1, key,
+                                  comp_) - values;
+    page_id = Children(page)[child];
+  }
+}
+
+template<class T, class Compare>
+template<class K>
+typename DiskBinarySearchTree<T, Compare>::ConstIterator
+DiskBinarySearchTree<T, Compare>::UpperBound(const K& key) const {
+  PageId page_id = header_.root;
+  while (true) {
+    PageRef page = pool_->fetch(page_id);
+    const NodeHeader& header = Header(page);
+    const T* values = Values(page);
+    if (header.is_leaf) {
+      auto position = std::upper_bound(values, values + header.count, key,
+                                       comp_) - values;
+      return ConstIterator(this, page_id,
+                           static_cast<std::uint32_t>(position));
+    }
+    auto child = std::upper_bound(values, values + header.count - 1, key,
+                                  comp_) - values;
+    page_id = Children(page)[child];
+  }
+}
+
+template<class T, class Compare>
+template<class K>
+typename DiskBinarySearchTree<T, Compare>::ConstIterator
+DiskBinarySearchTree<T, Compare>::FindValue(const K& key) const {
+  ConstIterator it = LowerBound(key);
+  if (it == end() || comp_(key, *it)) {
+    return end();
+  }
+  return it;
+}
+
+template<class T, class Compare>
+template<class K>
+typename DiskBinarySearchTree<T, Compare>::size_type
+DiskBinarySearchTree<T, Compare>::CalcCount(const K& key) const {
+  size_type count = 0;
+  for (ConstIterator it = LowerBound(key); it != end() && !comp_(key, *it);
+       ++it) {
+    ++count;
+  }
+  return count;
+}
+
+template<class T, class Compare>
+template<class K>
+void DiskBinarySearchTree<T, Compare>::EraseValue(const K& key) {
+  bool is_empty;
+  if (!EraseFrom(header_.root, key, &is_empty)) {
+    return;
+  }
+  --header_.size;
+  // an inner root left with one child gives way to it
+  while (header_.height > 1) {
+    PageId child;
+    {
+      PageRef root = pool_->fetch(header_.root);
+      if (Header(root).count != 1) {
+        break;
+      }
+      child = Children(root)[0];
+    }
+    FreePage(header_.root);
+    header_.root = child;
+    --header_.height;
+  }
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::SplitResult
+DiskBinarySearchTree<T, Compare>::InsertInto
+    (PageId page_id, const T& value) {
+  std::size_t child;
+  PageId child_id;
+  {
+    PageRef page = pool_->fetch(page_id);
+    if (Header(page).is_leaf) {
+      return InsertIntoLeaf(page, value);
+    }
+    // equivalent values go after each other like in BinarySearchTree
+    const T* keys = Values(page);
+    child = std::upper_bound(keys, keys + Header(page).count - 1, value,
+                             comp_) - keys;
+    child_id = Children(page)[child];
+  }
+  // the page is not pinned on the way down, so a deep tree fits any pool
+  SplitResult split = InsertInto(child_id, value);
+  if (!split) {
+    return split;
+  }
+  PageRef page = pool_->fetch(page_id);
+  return InsertIntoInner(page, child, split->first, split->second);
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::SplitResult
+DiskBinarySearchTree<T, Compare>::InsertIntoLeaf
+    (PageRef& page, const T& value) {
+  NodeHeader& header = Header(page);
+  T* values = Values(page);
+  std::size_t count = header.count;
+  std::size_t position = std::upper_bound(values, values + count, value,
+                                          comp_) - values;
+  page.mark_dirty();
+  if (count < kLeafCapacity) {
+    std::memmove(values + position + 1, values + position,
+                 (count - position) * sizeof(T));
+    values[position] = value;
+    ++header.count;
+    return std::nullopt;
+  }
+
+  // an append to the last leaf keeps the old leaf full
+  bool is_append = position == count && header.next == kNoPage;
+  std::size_t middle = is_append ? count : count / 2;
+  PageRef right = AllocatePage(true);
+  NodeHeader& right_header = Header(right);
+  T* right_values = Values(right);
+  std::memcpy(right_values, values + middle, (count - middle) * sizeof(T));
+  header.count = static_cast<std::uint32_t>(middle);
+  right_header.count = static_cast<std::uint32_t>(count - middle);
+  if (position < middle) {
+    std::memmove(values + position + 1, values + position,
+                 (middle - position) * sizeof(T));
+    values[position] = value;
+    ++header.count;
+  } else {
+    std::size_t right_position = position - middle;
+    std::memmove(right_values + right_position + 1,
+                 right_values + right_position,
+                 (right_header.count - right_position) * sizeof(T));
+    right_values[right_position] = value;
+    ++right_header.count;
+  }
+
+  right_header.prev = page.id();
+  right_header.next = header.next;
+  if (header.next != kNoPage) {
+    PageRef next = pool_->fetch(header.next);
+    Header(next).prev = right.id();
+    next.mark_dirty();
+  } else {
+    header_.last_leaf = right.id();
+  }
+  header.next = right.id();
+  return std::pair<T, PageId>(right_values[0], right.id());
+}
+
+template<class T, class Compare>
+typename DiskBinarySearchTree<T, Compare>::SplitResult
+DiskBinarySearchTree<T, Compare>::InsertIntoInner
+    (PageRef& page, std::size_t child, const T& separator, PageId right) {
+  NodeHeader& header = Header(page);
+  T* keys = Values(page);
+  PageId* children = Children(page);
+  std::size_t count = header.count;
+  page.mark_dirty();
+  if (count < kInnerCapacity) {
+    std::memmove(keys + child + 1, keys + child,
+                 (count - 1 - child) * sizeof(T));
+    keys[child] = separator;
+    std::memmove(children + child + 2, children + child + 1,
+                 (count - 1 - child) * sizeof(PageId));
+    children[child + 1] = right;
+    ++header.count;
+    return std::nullopt;
+  }
+
+  // lay out the keys and children with the new ones, then give the upper
+  // half to a new page and the middle key to the parent
+  std::vector<T> all_keys(keys, keys + count - 1);
+  all_keys.insert(all_keys.begin() + child, separator);
+  std::vector<PageId> all_children(children, children + count);
+  all_children.insert(all_children.begin() + child + 1, right);
+
+  std::size_t left_count = all_children.size() / 2;
+  std::size_t right_count = all_children.size() - left_count;
+  PageRef sibling = AllocatePage(false);
+  std::memcpy(keys, all_keys.data(), (left_count - 1) * sizeof(T));
+  std::memcpy(children, all_children.data(), left_count * sizeof(PageId));
+  header.count = static_cast<std::uint32_t>(left_count);
+  std::memcpy(Values(sibling), all_keys.data() + left_count,
+              (right_count - 1) * sizeof(T));
+  std::memcpy(Children(sibling), all_children.data() + left_count,
+              right_count * sizeof(PageId));
+  Header(sibling).count = static_cast<std::uint32_t>(right_count);
+  return std::pair<T, PageId>(all_keys[left_count - 1], sibling.id());
+}
+
+template<class T, class Compare>
+template<class K>
+bool DiskBinarySearchTree<T, Compare>::EraseFrom
+    (PageId page_id, const K& key, bool* is_empty) {
+  {
+    PageRef page = pool_->fetch(page_id);
+    NodeHeader& header = Header(page);
+    T* values = Values(page);
+    if (header.is_leaf) {
+      std::size_t position = std::lower_bound(values, values + header.count,
+                                              key, comp_) - values;
+      if (position == header.count || comp_(key, values[position])) {
+        return false;
+      }
+      std::memmove(values + position, values + position + 1,
+                   (header.count - position - 1) * sizeof(T));
+      --header.count;
+      page.mark_dirty();
+      // the last leaf of the tree stays, even if empty
+      *is_empty = header.count == 0
+          && header_.first_leaf != header_.last_leaf;
+      return true;
+    }
+  }
+
+  // equivalent values may be below every child whose range touches key
+  std::size_t child;
+  {
+    PageRef page = pool_->fetch(page_id);
+    const T* keys = Values(page);
+    child = std::lower_bound(keys, keys + Header(page).count - 1, key,
+                             comp_) - keys;
+  }
+  while (true) {
+    PageId child_id;
+    {
+      PageRef page = pool_->fetch(page_id);
+      if (child == Header(page).count) {
+        return false;
+      }
+      if (child > 0 && comp_(key, Values(page)[child - 1])) {
+        return false;
+      }
+      child_id = Children(page)[child];
+    }
+    bool is_child_empty;
+    if (EraseFrom(child_id, key, &is_child_empty)) {
+      PageRef page = pool_->fetch(page_id);
+      if (is_child_empty) {
+        RemoveChild(page, child);
+      }
+      *is_empty = Header(page).count == 0;
+      return true;
+    }
+    ++child;
+  }
+}
+
+template<class T, class Compare>
+void DiskBinarySearchTree<T, Compare>::RemoveChild
+    (const PageRef& page, std::size_t child) {
+  NodeHeader& header = Header(page);
+  T* keys = Values(page);
+  PageId* children = Children(page);
+  PageId child_id = children[child];
+  {
+    PageRef child_page = pool_->fetch(child_id);
+    if (Header(child_page).is_leaf) {
+      UnlinkLeaf(child_page);
+    }
+  }
+  FreePage(child_id);
+
+  // the key on the left of the child goes with it, the first child takes
+  // the key on its right along
+  std::size_t key = child > 0 ? child - 1 : 0;
+  if (header.count > 1) {
+    std::memmove(keys + key, keys + key + 1,
+                 (header.count - 2 - key) * sizeof(T));
+  }
+  std::memmove(children + child, children + child + 1,
+               (header.count - 1 - child) * sizeof(PageId));
+  --header.count;
+  page.mark_dirty();
+}
+
+template<class T, class Compare>
+void DiskBinarySearchTree<T, Compare>::UnlinkLeaf(const PageRef& leaf) {
+  const NodeHeader& header = Header(leaf);
+  if (header.prev != kNoPage) {
+    PageRef prev = pool_->fetch(header.prev);
+    Header(prev).next = header.next;
+    prev.mark_dirty();
+  } else {
+    header_.first_leaf = header.next;
+  }
+  if (header.next != kNoPage) {
+    PageRef next = pool_->fetch(header.next);
+    Header(next).prev = header.prev;
+    next.mark_dirty();
+  } else {
+    header_.last_leaf = header.prev;
+  }
+}
+
+#endif  // DISK_BINARY_SEARCH_TREE_H_
@@ -0,0 +1,150 @@
+#ifndef EPOCH_RECLAMATION_H_
+#define EPOCH_RECLAMATION_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+// Epoch-based reclamation. Readers pin the current epoch for the time they
+// hold pointers into a shared structure. Memory retired in epoch e is freed
+// once the epoch has moved to e + 2, because no reader that could still
+// see it is left by then. The epoch moves on only when nobody is pinned in
+// the epoch before the current one.
+//
+// Readers count themselves in one of a few padded slots, chosen by thread,
+// so Pin() and unpinning are one atomic add each and never block. Retire()
+// and Collect() are lock-free too and may be called from any thread.
+class EpochReclamation {
+ public:
+  // readers are pinned for the lifetime of a guard
+  class Guard {
+    friend class EpochReclamation;
+   public:
+    Guard(const Guard&) = delete;
+    Guard& operator=(const Guard&) = delete;
+
+    ~Guard();
+
+   private:
+    explicit Guard(std::atomic<std::int64_t>* counter);
+
+    std::atomic<std::int64_t>* counter_;
+  };
+
+  using Deleter = void (*)(void* context, void* pointer);
+
+  EpochReclamation() = default;
+
+  EpochReclamation(const EpochReclamation&) = delete;
+  EpochReclamation& operator=(const EpochReclamation&) = delete;
+
+  // frees everything retired, no reader may be pinned anymore
+  ~EpochReclamation();
+
+  Guard Pin();
+
+  // deleter(context, pointer) runs once no reader can reach pointer
+  void Retire(void* pointer, Deleter deleter, void* context);
+
+  // advance the epoch if possible and free what became unreachable, the
+  // caller must not be pinned
+  void Collect();
+
+ private:
+  static constexpr int kSlotCount = 32;
+
+  struct alignas(64) Slot {
+    // readers pinned in epoch e are counted in counters[e % 3]
+    std::atomic<std::int64_t> counters[3] = {};
+  };
+
+  struct Retired {
+    void* pointer;
+    Deleter deleter;
+    void* context;
+    Retired* next;
+  };
+
+  static std::size_t SlotIndex();
+
+  static void FreeAll(Retired* retired);
+
+  Slot slots_[kSlotCount];
+  std::atomic<std::uint64_t> epoch_ = 0;
+  // stacks of what was retired in epoch e are kept in limbo_[e % 3]
+  std::atomic<Retired*> limbo_[3] = {};
+};
+
+// definitions
+
+inline EpochReclamation::Guard::Guard(std::atomic<std::int64_t>* counter) :
+    counter_(counter) {}
+
+inline EpochReclamation::Guard::~Guard() {
+  counter_->fetch_sub(1, std::memory_order_release);
+}
+
+inline EpochReclamation::~EpochReclamation() {
+  for (std::atomic<Retired*>& retired : limbo_) {
+    FreeAll(retired.load());
+  }
+}
+
+inline EpochReclamation::Guard EpochReclamation::Pin() {
+  Slot& slot = slots_[SlotIndex()];
+  while (true) {
+    std::uint64_t epoch = epoch_.load();
+    std::atomic<std::int64_t>& counter = slot.counters[epoch % 3];
+    counter.fetch_add(1);
+    // if the epoch moved on before we were counted, a Collect() may have
+    // missed us, so count ourselves in the new epoch instead
+    if (epoch_.load() == epoch) {
+      return Guard(&counter);
+    }
+    counter.fetch_sub(1);
+  }
+}
+
+inline void EpochReclamation::Retire(void* pointer, Deleter deleter,
+                                     void* context) {
+  // a retire that races with Collect() may land in the list of a later
+  // epoch, which only frees the pointer later
+  std::atomic<Retired*>& limbo = limbo_[epoch_.load() % 3];
+  Retired* retired = new Retired{pointer, deleter, context, limbo.load()};
+  while (!limbo.compare_exchange_weak(retired->next, retired)) {}
+}
+
+inline void EpochReclamation::Collect() {
+  std::uint64_t epoch = epoch_.load();
+  std::uint64_t previous = (epoch + 2) % 3;
+  for (const Slot& slot : slots_) {
+    if (slot.counters[previous].load() != 0) {
+      return;
+    }
+  }
+  // nobody is pinned in epoch - 1, what was retired there is unreachable
+  // for everyone pinned in epoch or epoch + 1, of concurrent collectors
+  // only the one that moves the epoch frees
+  if (epoch_.compare_exchange_strong(epoch, epoch + 1)) {
+    FreeAll(limbo_[previous].exchange(nullptr));
+  }
+}
+
+inline std::size_t EpochReclamation::SlotIndex() {
+  static thread_local std::size_t index =
+      std::hash<std::thread::id>()(std::this_thread::get_id()) % kSlotCount;
+  return index;
+}
+
+inline void EpochReclamation::FreeAll(Retired* retired) {
+  while (retired != nullptr) {
+    Retired* next = retired->next;
+    retired->deleter(retired->context, retired->pointer);
+    delete retired;
+    retired = next;
+  }
+}
+
+#endif  // EPOCH_RECLAMATION_H_
@@ -0,0 +1,765 @@
+#ifndef FROZEN_BINARY_SEARCH_TREE_H_
+#define FROZEN_BINARY_SEARCH_TREE_H_
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "binary_search_tree.h"
+
+// Immutable snapshot of a BinarySearchTree for lookup-heavy use. The values
+// are stored in one array in Eytzinger (breadth-first) order: the children
+// of slot k are 2k and 2k + 1. The first levels are shared by every search
+// and stay in cache, and the 16 descendants four levels down lie next to
+// each other, so they are prefetched while the search is still above them.
+//
+// Arithmetic values in the default order use a static B+ tree instead:
+// nodes of one cache line of keys, searched with AVX2 or SSE2 compares
+// where the target has them and with a branch-free loop otherwise.
+template<class T, class Compare = std::less<T>>
+class FrozenBinarySearchTree {
+ public:
+  using value_compare = Compare;
+
+  FrozenBinarySearchTree() = default;
+
+  // [first, last) must be sorted by comp
+  template<std::input_iterator InputIt>
+  FrozenBinarySearchTree(InputIt first, InputIt last,
+                         const Compare& comp = Compare());
+
+  template<class Allocator, class Policy>
+  explicit FrozenBinarySearchTree
+      (const BinarySearchTree<T, Compare, Allocator, Policy>& tree);
+
+  value_compare value_comp() const;
+
+  int size() const;
+  bool empty() const;
+
+  bool contains(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  bool contains(const K& key) const;
+
+  int count(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  int count(const K& key) const;
+
+  // results[i] = contains(values[i]), several searches run interleaved so
+  // that their cache misses overlap
+  void contains_many(std::span<const T> values,
+                     std::span<bool> results) const;
+
+  std::vector<T> to_vector() const;
+
+  bool operator==(const FrozenBinarySearchTree& rhs) const;
+  bool operator!=(const FrozenBinarySearchTree& rhs) const;
+
+  class ConstIterator {
+    friend class FrozenBinarySearchTree;
+   public:
+    using difference_type = std::ptrdiff_t;
+    using value_type = T;
+    using pointer = const T*;
+    using reference = const T&;
+    using iterator_category = std::bidirectional_iterator_tag;
+
+    ConstIterator() = default;
+
+    const T& operator*() const;
+
+    const T* operator->() const;
+
+    ConstIterator& operator++();
+    ConstIterator operator++(int);
+
+    ConstIterator& operator--();
+    ConstIterator operator--(int);
+
+    bool operator==(ConstIterator rhs) const;
+    bool operator!=(ConstIterator rhs) const;
+
+   private:
+    ConstIterator(std::size_t index, const FrozenBinarySearchTree* owner);
+
+    // slot in values_
+    std::size_t index_ = 0;
+    const FrozenBinarySearchTree* owner_ = nullptr;
+  };
+  ConstIterator begin() const;
+
+  ConstIterator end() const;
+
+  ConstIterator find(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator find(const K& key) const;
+
+  // first value that is not less than value
+  ConstIterator lower_bound(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator lower_bound(const K& key) const;
+
+  // first value that is greater than value
+  ConstIterator upper_bound(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator upper_bound(const K& key) const;
+
+  std::pair<ConstIterator, ConstIterator> equal_range(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  std::pair<ConstIterator, ConstIterator> equal_range(const K& key) const;
+
+ private:
+  static constexpr bool kBlockLayout =
+      std::is_arithmetic_v<T> && std::is_same_v<Compare, std::less<T>>;
+  static constexpr std::size_t kBlockSize = 64 / sizeof(T);
+  static constexpr std::size_t kBatchSize = 16;
+
+  // level of the B+ tree above the leaves, a node has kBlockSize keys and
+  // kBlockSize + 1 children; key i is the smallest value under child i + 1
+  struct Level {
+    // first node of the level in index_, in nodes
+    std::size_t offset;
+    // nodes on the level below
+    std::size_t child_count;
+  };
+
+  void Build(std::vector<T>&& sorted);
+  void BuildEytzinger(std::vector<T>&& sorted);
+  void BuildBlocks(std::vector<T>&& sorted);
+
+  template<bool kUpperBound>
+  std::size_t BlockSearch(T key) const;
+
+  // keys of node on the given level, levels_.size() means the leaves
+  const T* Block(std::size_t level, std::size_t node) const;
+
+  // number of keys in the block before the lower or upper bound of key
+  template<bool kUpperBound>
+  static std::size_t CountBefore(const T* block, T key);
+
+  // the descent goes right when the value in the slot is less than key
+  // (lower bound) or not greater than key (upper bound)
+  template<class K>
+  std::size_t LowerBoundIndex(const K& key) const;
+  template<class K>
+  std::size_t UpperBoundIndex(const K& key) const;
+
+  template<class K>
+  std::size_t FindIndex(const K& key) const;
+
+  template<class K>
+  int CalcCount(const K& key) const;
+
+  std::size_t FirstIndex() const;
+  std::size_t LastIndex() const;
+  std::size_t EndIndex() const;
+  std::size_t NextIndex(std::size_t index) const;
+  std::size_t PrevIndex(std::size_t index) const;
+
+  void Prefetch(std::size_t index) const;
+
+  [[no_unique_address]] Compare comp_;
+  // Eytzinger: slot 0 is padding so that the children of k are 2k and
+  // 2k + 1, end() is 0. Blocks: sorted values padded to whole leaves with
+  // the largest value, end() is size_.
+  std::vector<T> values_;
+  std::size_t size_ = 0;
+  // upper levels of the B+ tree, the root first
+  std::vector<T> index_;
+  std::vector<Level> levels_;
+};
+
+// definitions
+
+template<class T, class Compare>
+template<std::input_iterator InputIt>
+FrozenBinarySearchTree<T, Compare>::FrozenBinarySearchTree
+    (InputIt first, InputIt last, const Compare& comp) : comp_(comp) {
+  Build(std::vector<T>(first, last));
+}
+
+template<class T, class Compare>
+template<class Allocator, class Policy>
+FrozenBinarySearchTree<T, Compare>::FrozenBinarySearchTree
+    (const BinarySearchTree<T, Compare, Allocator, Policy>& tree) :
+    comp_(tree.value_comp()) {
+  Build(std::vector<T>(tree.begin(), tree.end()));
+}
+
+template<class T, class Compare>
+typename FrozenBinarySearchTree<T, Compare>::value_compare
+FrozenBinarySearchTree<T, Compare>::value_comp() const {
+  return comp_;
+}
+
+template<class T, class Compare>
+int FrozenBinarySearchTree<T, Compare>::size() const {
+  return static_cast<int>(size_);
+}
+
+template<class T, class Compare>
+bool FrozenBinarySearchTree<T, Compare>::empty() const {
+  return size_ == 0;
+}
+
+template<class T, class Compare>
+bool FrozenBinarySearchTree<T, Compare>::contains(const T& value) const {
+  return FindIndex(value) != EndIndex();
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+bool FrozenBinarySearchTree<T, Compare>::contains(const K& key) const {
+  return FindIndex(key) != EndIndex();
+}
+
+template<class T, class Compare>
+int FrozenBinarySearchTree<T, Compare>::count(const T& value) const {
+  return CalcCount(value);
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+int FrozenBinarySearchTree<T, Compare>::count(const K& key) const {
+  return CalcCount(key);
+}
+
+template<class T, class Compare>
+void FrozenBinarySearchTree<T, Compare>::contains_many
+    (std::span<const T> values, std::span<bool> results) const {
+  if (size_ == 0) {
+    std::fill(results.begin(), results.begin() + values.size(), false);
+    return;
+  }
+  for (std::size_t first = 0; first < values.size(); first += kBatchSize) {
+    std::size_t batch = std::min(kBatchSize, values.size() - first);
+    const T* keys = values.data() + first;
+    std::size_t indices[kBatchSize];
+
+    if constexpr (kBlockLayout) {
+      // every search has the same depth, so they go down level by level
+      std::fill(indices, indices + batch, 0);
+      for (std::size_t level = 0; level < levels_.size(); ++level) {
+        for (std::size_t i = 0; i < batch; ++i) {
+          std::size_t rank = CountBefore<false>(Block(level, indices[i]),
+                                                keys[i]);
+          indices[i] = std::min(indices[i] * (kBlockSize + 1) + rank,
+                                levels_[level].child_count - 1);
+          __builtin_prefetch(Block(level + 1, indices[i]));
+        }
+      }
+      for (std::size_t i = 0; i < batch; ++i) {
+        std::size_t index = indices[i] * kBlockSize
+            + CountBefore<false>(Block(levels_.size(), indices[i]), keys[i]);
+        results[first + i] =
+            index < size_ && !comp_(keys[i], values_[index]);
+      }
+    } else {
+      // the descents differ in length by at most one step
+      std::fill(indices, indices + batch, 1);
+      for (bool active = true; active;) {
+        active = false;
+        for (std::size_t i = 0; i < batch; ++i) {
+          if (indices[i] <= size_) {
+            indices[i] = 2 * indices[i]
+                + (comp_(values_[indices[i]], keys[i]) ? 1 : 0);
+            Prefetch(16 * indices[i]);
+            active = true;
+          }
+        }
+      }
+      for (std::size_t i = 0; i < batch; ++i) {
+        std::size_t index = indices[i]
+            >> __builtin_ffsll(static_cast<long long>(~indices[i]));
+        results[first + i] =
+            index != 0 && !comp_(keys[i], values_[index]);
+      }
+    }
+  }
+}
+
+template<class T, class Compare>
+std::vector<T> FrozenBinarySearchTree<T, Compare>::to_vector() const {
+  return std::vector<T>(begin(), end());
+}
+
+template<class T, class Compare>
+bool FrozenBinarySearchTree<T, Compare>::operator==
+    (const FrozenBinarySearchTree& rhs) const {
+  return size_ == rhs.size_ && std::equal(begin(), end(), rhs.begin());
+}
+
+template<class T, class Compare>
+bool FrozenBinarySearchTree<T, Compare>::operator!=
+    (const FrozenBinarySearchTree& rhs) const {
+  return !(*this == rhs);
+}
+
+// ConstIterator
+
+template<class T, class Compare>
+FrozenBinarySearchTree<T, Compare>::ConstIterator::ConstIterator
+    (std::size_t index, const FrozenBinarySearchTree* owner) :
+    index_(index), owner_(owner) {}
+
+template<class T, class Compare>
+const T& FrozenBinarySearchTree<T, Compare>::ConstIterator::operator*()
+    const {
+  return owner_->values_[index_];
+}
+
+template<class T, class Compare>
+const T* FrozenBinarySearchTree<T, Compare>::ConstIterator::operator->()
+    const {
+  return &owner_->values_[index_];
+}
+
+template<class T, class Compare>
+typename FrozenBinarySearchTree<T, Compare>::ConstIterator&
+FrozenBinarySearchTree<T, Compare>::ConstIterator::operator++() {
+  index_ = owner_->NextIndex(index_);
+  return *this;
+}
+
+template<class T, class Compare>
+typename FrozenBinarySearchTree<T, Compare>::ConstIterator
+FrozenBinarySearchTree<T, Compare>::ConstIterator::operator++(int) {
+  ConstIterator old = *this;
+  ++*this;
+  return old;
+}
+
+template<class T, class Compare>
+typename FrozenBinarySearchTree<T, Compare>::ConstIterator&
+FrozenBinarySearchTree<T, Compare>::ConstIterator::operator--() {
+  index_ = owner_->PrevIndex(index_);
+  return *this;
+}
+
+template<class T, class Compare>
+typename FrozenBinarySearchTree<T, Compare>::ConstIterator
+FrozenBinarySearchTree<T, Compare>::ConstIterator::operator--(int) {
+  ConstIterator old = *this;
+  --*this;
+  return old;
+}
+
+template<class T, class Compare>
+bool FrozenBinarySearchTree<T, Compare>::ConstIterator::operator==
+    (ConstIterator rhs) const {
+  return index_ == rhs.index_ && owner_ == rhs.owner_;
+}
+
+template<class T, class Compare>
+bool FrozenBinarySearchTree<T, Compare>::ConstIterator::operator!=
+    (ConstIterator rhs) const {
+  return !(*this == rhs);
+}
+
+// -ConstIterator
+
+template<class T, class Compare>
+typename FrozenBinarySearchTree<T, Compare>::ConstIterator
+FrozenBinarySearchTree<T, Compare>::begin() const {
+  return {FirstIndex(), this};
+}
+
+template<class T, class Compare>
+typename FrozenBinarySearchTree<T, Compare>::ConstIterator
+FrozenBinarySearchTree<T, Compare>::end() const {
+  return {EndIndex(), this};
+}
+
+template<class T, class Compare>
+typename FrozenBinarySearchTree<T, Compare>::ConstIterator
+FrozenBinarySearchTree<T, Compare>::find(const T& value) const {
+  return {FindIndex(value), this};
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+typename FrozenBinarySearchTree<T, Compare>::ConstIterator
+FrozenBinarySearchTree<T, Compare>::find(const K& key) const {
+  return {FindIndex(key), this};
+}
+
+template<class T, class Compare>
+typename FrozenBinarySearchTree<T, Compare>::ConstIterator
+FrozenBinarySearchTree<T, Compare>::lower_bound(const T& value) const {
+  return {LowerBoundIndex(value), this};
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+typename FrozenBinarySearchTree<T, Compare>::ConstIterator
+FrozenBinarySearchTree<T, Compare>::lower_bound(const K& key) const {
+  return {LowerBoundIndex(key), this};
+}
+
+template<class T, class Compare>
+typename FrozenBinarySearchTree<T, Compare>::ConstIterator
+FrozenBinarySearchTree<T, Compare>::upper_bound(const T& value) const {
+  return {UpperBoundIndex(value), this};
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+typename FrozenBinarySearchTree<T, Compare>::ConstIterator
+FrozenBinarySearchTree<T, Compare>::upper_bound(const K& key) const {
+  return {UpperBoundIndex(key), this};
+}
+
+template<class T, class Compare>
+auto FrozenBinarySearchTree<T, Compare>::equal_range(const T& value) const
+    -> std::pair<ConstIterator, ConstIterator> {
+  return {lower_bound(value), upper_bound(value)};
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+auto FrozenBinarySearchTree<T, Compare>::equal_range(const K& key) const
+    -> std::pair<ConstIterator, ConstIterator> {
+  return {lower_bound(key), upper_bound(key)};
+}
+
+template<class T, class Compare>
+void FrozenBinarySearchTree<T, Compare>::Build(std::vector<T>&& sorted) {
+  size_ = sorted.size();
+  if (size_ == 0) {
+    return;
+  }
+  if constexpr (kBlockLayout) {
+    BuildBlocks(std::move(sorted));
+  } else {
+    BuildEytzinger(std::move(sorted));
+  }
+}
+
+template<class T, class Compare>
+void FrozenBinarySearchTree<T, Compare>::BuildEytzinger
+    (std::vector<T>&& sorted) {
+  // an in-order walk over the implicit tree gives the slot of every
+  // sorted value
+  std::vector<std::size_t> slots;
+  slots.reserve(size_);
+  std::vector<std::size_t> stack;
+  for (std::size_t index = 1; index <= size_ || !stack.empty();) {
+    if (index <= size_) {
+      stack.push_back(index);
+      index = 2 * index;
+    } else {
+      index = stack.back();
+      stack.pop_back();
+      slots.push_back(index);
+      index = 2 * index + 1;
+    }
+  }
+
+  std::vector<std::size_t> order(size_ + 1);
+  for (std::size_t i = 0; i < size_; ++i) {
+    order[slots[i]] = i;
+  }
+  values_.reserve(size_ + 1);
+  values_.push_back(sorted.front());
+  for (std::size_t index = 1; index <= size_; ++index) {
+    values_.push_back(std::move(sorted[order[index]]));
+  }
+}
+
+template<class T, class Compare>
+void FrozenBinarySearchTree<T, Compare>::BuildBlocks
+    (std::vector<T>&& sorted) {
+  values_ = std::move(sorted);
+  // pad with the largest value stored, numeric_limits<T>::max() is less
+  // than a stored infinity
+  T padding = values_.back();
+  std::size_t count = (size_ + kBlockSize - 1) / kBlockSize;
+  values_.resize(count * kBlockSize, padding);
+
+  // build the levels bottom-up from the smallest value under every node
+  std::vector<T> mins(count);
+  for (std::size_t node = 0; node < count; ++node) {
+    mins[node] = values_[node * kBlockSize];
+  }
+  std::vector<std::pair<std::vector<T>, std::size_t>> levels;
+  while (count > 1) {
+    std::size_t parent_count = (count + kBlockSize) / (kBlockSize + 1);
+    std::vector<T> keys(parent_count * kBlockSize, padding);
+    std::vector<T> parent_mins(parent_count);
+    for (std::size_t parent = 0; parent < parent_count; ++parent) {
+      std::size_t first_child = parent * (kBlockSize + 1);
+      parent_mins[parent] = mins[first_child];
+      for (std::size_t i = 0; i < kBlockSize; ++i) {
+        if (first_child + i + 1 < count) {
+          keys[parent * kBlockSize + i] = mins[first_child + i + 1];
+        }
+      }
+    }
+    levels.emplace_back(std::move(keys), count);
+    mins = std::move(parent_mins);
+    count = parent_count;
+  }
+
+  for (auto it = levels.rbegin(); it != levels.rend(); ++it) {
+    levels_.push_back({index_.size() / kBlockSize, it->second});
+    index_.insert(index_.end(), it->first.begin(), it->first.end());
+  }
+}
+
+template<class T, class Compare>
+template<bool kUpperBound>
+std::size_t FrozenBinarySearchTree<T, Compare>::BlockSearch(T key) const {
+  if (size_ == 0) {
+    return 0;
+  }
+  std::size_t node = 0;
+  for (std::size_t level = 0; level < levels_.size(); ++level) {
+    // separators of missing children are the largest value, an upper bound
+    // of it may count them, so stay within the real children
+    node = std::min(node * (kBlockSize + 1)
+                        + CountBefore<kUpperBound>(Block(level, node), key),
+                    levels_[level].child_count - 1);
+  }
+  std::size_t index = node * kBlockSize
+      + CountBefore<kUpperBound>(Block(levels_.size(), node), key);
+  return std::min(index, size_);
+}
+
+template<class T, class Compare>
+const T* FrozenBinarySearchTree<T, Compare>::Block
+    (std::size_t level, std::size_t node) const {
+  if (level == levels_.size()) {
+    return values_.data() + node * kBlockSize;
+  }
+  return index_.data() + (levels_[level].offset + node) * kBlockSize;
+}
+
+template<class T, class Compare>
+template<bool kUpperBound>
+std::size_t FrozenBinarySearchTree<T, Compare>::CountBefore
+    (const T* block, T key) {
+  // a lower bound counts the keys less than key, an upper bound the keys
+  // not greater than key
+#if defined(__AVX2__)
+  if constexpr (std::is_same_v<T, std::int32_t> && kBlockSize % 8 == 0) {
+    __m256i keys = _mm256_set1_epi32(key);
+    unsigned greater = 0;
+    unsigned less = 0;
+    for (std::size_t i = 0; i < kBlockSize; i += 8) {
+      __m256i values = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(block + i));
+      if constexpr (kUpperBound) {
+        greater |= static_cast<unsigned>(_mm256_movemask_ps(
+            _mm256_castsi256_ps(_mm256_cmpgt_epi32(values, keys)))) << i;
+      } else {
+        less |= static_cast<unsigned>(_mm256_movemask_ps(
+            _mm256_castsi256_ps(_mm256_cmpgt_epi32(keys, values)))) << i;
+      }
+    }
+    return kUpperBound ? kBlockSize - std::popcount(greater)
+                       : std::popcount(less);
+  }
+  if constexpr (std::is_same_v<T, float> && kBlockSize % 8 == 0) {
+    __m256 keys = _mm256_set1_ps(key);
+    unsigned before = 0;
+    for (std::size_t i = 0; i < kBlockSize; i += 8) {
+      __m256 values = _mm256_loadu_ps(block + i);
+      before |= static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(
+          values, keys, kUpperBound ? _CMP_LE_OQ : _CMP_LT_OQ))) << i;
+    }
+    return std::popcount(before);
+  }
+#elif defined(__SSE2__)
+  if constexpr (std::is_same_v<T, std::int32_t> && kBlockSize % 4 == 0) {
+    __m128i keys = _mm_set1_epi32(key);
+    unsigned greater = 0;
+    unsigned less = 0;
+    for (std::size_t i = 0; i < kBlockSize; i += 4) {
+      __m128i values = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(block + i));
+      if constexpr (kUpperBound) {
+        greater |= static_cast<unsigned>(_mm_movemask_ps(
+            _mm_castsi128_ps(_mm_cmpgt_epi32(values, keys)))) << i;
+      } else {
+        less |= static_cast<unsigned>(_mm_movemask_ps(
+            _mm_castsi128_ps(_mm_cmpgt_epi32(keys, values)))) << i;
+      }
+    }
+    return kUpperBound ? kBlockSize - std::popcount(greater)
+                       : std::popcount(less);
+  }
+  if constexpr (std::is_same_v<T, float> && kBlockSize % 4 == 0) {
+    __m128 keys = _mm_set1_ps(key);
+    unsigned before = 0;
+    for (std::size_t i = 0; i < kBlockSize; i += 4) {
+      __m128 values = _mm_loadu_ps(block + i);
+      __m128 mask = kUpperBound ? _mm_cmple_ps(values, keys)
+                                : _mm_cmplt_ps(values, keys);
+      before |= static_cast<unsigned>(_mm_movemask_ps(mask)) << i;
+    }
+    return std::popcount(before);
+  }
+#endif
+  std::size_t count = 0;
+  for (std::size_t i = 0; i < kBlockSize; ++i) {
+    count += kUpperBound ? !(key < block[i]) : block[i] < key;
+  }
+  return count;
+}
+
+template<class T, class Compare>
+template<class K>
+std::size_t FrozenBinarySearchTree<T, Compare>::LowerBoundIndex
+    (const K& key) const {
+  if constexpr (kBlockLayout) {
+    return BlockSearch<false>(key);
+  } else {
+    std::size_t index = 1;
+    while (index <= size_) {
+      Prefetch(16 * index);
+      index = 2 * index + (comp_(values_[index], key) ? 1 : 0);
+    }
+    // the answer is the last slot where the descent went left: drop the
+    // trailing right turns and that left turn
+    return index >> __builtin_ffsll(static_cast<long long>(~index));
+  }
+}
+
+template<class T, class Compare>
+template<class K>
+std::size_t FrozenBinarySearchTree<T, Compare>::UpperBoundIndex
+    (const K& key) const {
+  if constexpr (kBlockLayout) {
+    return BlockSearch<true>(key);
+  } else {
+    std::size_t index = 1;
+    while (index <= size_) {
+      Prefetch(16 * index);
+      index = 2 * index + (comp_(key, values_[index]) ? 0 : 1);
+    }
+    return index >> __builtin_ffsll(static_cast<long long>(~index));
+  }
+}
+
+template<class T, class Compare>
+template<class K>
+std::size_t FrozenBinarySearchTree<T, Compare>::FindIndex
+    (const K& key) const {
+  std::size_t index = LowerBoundIndex(key);
+  if (index == EndIndex() || comp_(key, values_[index])) {
+    return EndIndex();
+  }
+  return index;
+}
+
+template<class T, class Compare>
+template<class K>
+int FrozenBinarySearchTree<T, Compare>::CalcCount(const K& key) const {
+  std::size_t last = UpperBoundIndex(key);
+  if constexpr (kBlockLayout) {
+    return static_cast<int>(last - LowerBoundIndex(key));
+  }
+  int count = 0;
+  for (std::size_t index = LowerBoundIndex(key); index != last;
+       index = NextIndex(index)) {
+    ++count;
+  }
+  return count;
+}
+
+template<class T, class Compare>
+std::size_t FrozenBinarySearchTree<T, Compare>::FirstIndex() const {
+  if (kBlockLayout || size_ == 0) {
+    return 0;
+  }
+  std::size_t index = 1;
+  while (2 * index <= size_) {
+    index = 2 * index;
+  }
+  return index;
+}
+
+template<class T, class Compare>
+std::size_t FrozenBinarySearchTree<T, Compare>::EndIndex() const {
+  return kBlockLayout ? size_ : 0;
+}
+
+template<class T, class Compare>
+std::size_t FrozenBinarySearchTree<T, Compare>::LastIndex() const {
+  if constexpr (kBlockLayout) {
+    return size_ - 1;
+  }
+  if (size_ == 0) {
+    return 0;
+  }
+  std::size_t index = 1;
+  while (2 * index + 1 <= size_) {
+    index = 2 * index + 1;
+  }
+  return index;
+}
+
+template<class T, class Compare>
+std::size_t FrozenBinarySearchTree<T, Compare>::NextIndex
+    (std::size_t index) const {
+  if constexpr (kBlockLayout) {
+    return index + 1;
+  }
+  if (2 * index + 1 <= size_) {
+    index = 2 * index + 1;
+    while (2 * index <= size_) {
+      index = 2 * index;
+    }
+    return index;
+  }
+  // climb while coming from a right child, then once more
+  return index >> __builtin_ffsll(static_cast<long long>(~index));
+}
+
+template<class T, class Compare>
+std::size_t FrozenBinarySearchTree<T, Compare>::PrevIndex
+    (std::size_t index) const {
+  if constexpr (kBlockLayout) {
+    return index - 1;
+  }
+  if (index == 0) {
+    return LastIndex();
+  }
+  if (2 * index <= size_) {
+    index = 2 * index;
+    while (2 * index + 1 <= size_) {
+      index = 2 * index + 1;
+    }
+    return index;
+  }
+  // climb while coming from a left child, then once more
+  return index >> __builtin_ffsll(static_cast<long long>(index));
+}
+
+template<class T, class Compare>
+void FrozenBinarySearchTree<T, Compare>::Prefetch(std::size_t index) const {
+  // a hint only, an index past the end is harmless
+  __builtin_prefetch(reinterpret_cast<const char*>(values_.data())
+                         + index * sizeof(T));
+}
+
+// BinarySearchTree::freeze
+
+template<class T, class Compare, class Allocator, class Policy>
+FrozenBinarySearchTree<T, Compare>
+BinarySearchTree<T, Compare, Allocator, Policy>::freeze() const {
+  return FrozenBinarySearchTree<T, Compare>(*this);
+}
+
+#endif  // FROZEN_BINARY_SEARCH_TREE_H_
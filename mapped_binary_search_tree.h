@@ -0,0 +1,315 @@
+#ifndef MAPPED_BINARY_SEARCH_TREE_H_
+#define MAPPED_BINARY_SEARCH_TREE_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "binary_search_tree.h"
+
+// Read-only view of a file written by BinarySearchTree::serialize(). The
+// file is mapped and searched in place: opening it reads only the header,
+// lookups are binary searches over the sorted values and pages come in as
+// they are touched. Nothing is parsed or allocated per value, so opening
+// is O(1) whatever the size.
+//
+// The values are trusted to be sorted by comp, deserialize() is the
+// checked way to load a file of unknown origin. POSIX only.
+template<class T, class Compare = std::less<T>>
+class MappedBinarySearchTree {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "MappedBinarySearchTree needs a trivially copyable T");
+  static_assert(alignof(T) <= sizeof(SerializedTreeHeader),
+                "values would not be aligned in the mapping");
+
+ public:
+  using value_compare = Compare;
+  // values lie in one sorted array
+  using ConstIterator = const T*;
+
+  MappedBinarySearchTree() = default;
+  // throws std::system_error if the file cannot be mapped and
+  // std::runtime_error if it holds something else
+  explicit MappedBinarySearchTree(const std::string& path,
+                                  const Compare& comp = Compare());
+
+  MappedBinarySearchTree(const MappedBinarySearchTree&) = delete;
+  MappedBinarySearchTree& operator=(const MappedBinarySearchTree&) = delete;
+
+  MappedBinarySearchTree(MappedBinarySearchTree&& rhs) noexcept;
+  MappedBinarySearchTree& operator=(MappedBinarySearchTree&& rhs) noexcept;
+
+  ~MappedBinarySearchTree();
+
+  value_compare value_comp() const;
+
+  int size() const;
+  bool empty() const;
+
+  bool contains(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  bool contains(const K& key) const;
+
+  int count(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  int count(const K& key) const;
+
+  std::vector<T> to_vector() const;
+
+  ConstIterator begin() const;
+
+  ConstIterator end() const;
+
+  ConstIterator find(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator find(const K& key) const;
+
+  // first value that is not less than value
+  ConstIterator lower_bound(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator lower_bound(const K& key) const;
+
+  // first value that is greater than value
+  ConstIterator upper_bound(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator upper_bound(const K& key) const;
+
+  std::pair<ConstIterator, ConstIterator> equal_range(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  std::pair<ConstIterator, ConstIterator> equal_range(const K& key) const;
+
+ private:
+  template<class K>
+  ConstIterator FindValue(const K& key) const;
+
+  void Unmap();
+
+  [[no_unique_address]] Compare comp_;
+  void* mapping_ = nullptr;
+  std::size_t mapping_size_ = 0;
+  const T* values_ = nullptr;
+  int size_ = 0;
+};
+
+// definitions
+
+template<class T, class Compare>
+MappedBinarySearchTree<T, Compare>::MappedBinarySearchTree
+    (const std::string& path, const Compare& comp) : comp_(comp) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "MappedBinarySearchTree: open " + path);
+  }
+  struct stat file_stat;
+  if (::fstat(fd, &file_stat) != 0) {
+    int error = errno;
+    ::close(fd);
+    throw std::system_error(error, std::generic_category(),
+                            "MappedBinarySearchTree: stat " + path);
+  }
+  std::size_t file_size = static_cast<std::size_t>(file_stat.st_size);
+  if (file_size < sizeof(SerializedTreeHeader)) {
+    ::close(fd);
+    throw std::runtime_error("MappedBinarySearchTree: bad header");
+  }
+  void* mapping = ::mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  // the mapping stays valid without the descriptor
+  int error = errno;
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    throw std::system_error(error, std::generic_category(),
+                            "MappedBinarySearchTree: mmap " + path);
+  }
+  mapping_ = mapping;
+  mapping_size_ = file_size;
+
+  const auto* header = static_cast<const SerializedTreeHeader*>(mapping);
+  if (header->magic != SerializedTreeHeader::kMagic
+      || header->value_size != sizeof(T)
+      || header->value_alignment != alignof(T)
+      || header->count > INT_MAX
+      || header->count
+          > (file_size - sizeof(SerializedTreeHeader)) / sizeof(T)) {
+    Unmap();
+    throw std::runtime_error("MappedBinarySearchTree: bad header");
+  }
+  values_ = reinterpret_cast<const T*>(header + 1);
+  size_ = static_cast<int>(header->count);
+}
+
+template<class T, class Compare>
+MappedBinarySearchTree<T, Compare>::MappedBinarySearchTree
+    (MappedBinarySearchTree&& rhs) noexcept :
+    comp_(std::move(rhs.comp_)),
+    mapping_(std::exchange(rhs.mapping_, nullptr)),
+    mapping_size_(std::exchange(rhs.mapping_size_, 0)),
+    values_(std::exchange(rhs.values_, nullptr)),
+    size_(std::exchange(rhs.size_, 0)) {}
+
+template<class T, class Compare>
+MappedBinarySearchTree<T, Compare>&
+MappedBinarySearchTree<T, Compare>::operator=
+    (MappedBinarySearchTree&& rhs) noexcept {
+  if (this != &rhs) {
+    Unmap();
+    comp_ = std::move(rhs.comp_);
+    mapping_ = std::exchange(rhs.mapping_, nullptr);
+    mapping_size_ = std::exchange(rhs.mapping_size_, 0);
+    values_ = std::exchange(rhs.values_, nullptr);
+    size_ = std::exchange(rhs.size_, 0);
+  }
+  return *this;
+}
+
+template<class T, class Compare>
+MappedBinarySearchTree<T, Compare>::~MappedBinarySearchTree() {
+  Unmap();
+}
+
+template<class T, class Compare>
+typename MappedBinarySearchTree<T, Compare>::value_compare
+MappedBinarySearchTree<T, Compare>::value_comp() const {
+  return comp_;
+}
+
+template<class T, class Compare>
+int MappedBinarySearchTree<T, Compare>::size() const {
+  return size_;
+}
+
+template<class T, class Compare>
+bool MappedBinarySearchTree<T, Compare>::empty() const {
+  return size_ == 0;
+}
+
+template<class T, class Compare>
+bool MappedBinarySearchTree<T, Compare>::contains(const T& value) const {
+  return FindValue(value) != end();
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+bool MappedBinarySearchTree<T, Compare>::contains(const K& key) const {
+  return FindValue(key) != end();
+}
+
+template<class T, class Compare>
+int MappedBinarySearchTree<T, Compare>::count(const T& value) const {
+  auto [first, last] = equal_range(value);
+  return static_cast<int>(last - first);
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+int MappedBinarySearchTree<T, Compare>::count(const K& key) const {
+  auto [first, last] = equal_range(key);
+  return static_cast<int>(last - first);
+}
+
+template<class T, class Compare>
+std::vector<T> MappedBinarySearchTree<T, Compare>::to_vector() const {
+  return std::vector<T>(begin(), end());
+}
+
+template<class T, class Compare>
+typename MappedBinarySearchTree<T, Compare>::ConstIterator
+MappedBinarySearchTree<T, Compare>::begin() const {
+  return values_;
+}
+
+template<class T, class Compare>
+typename MappedBinarySearchTree<T, Compare>::ConstIterator
+MappedBinarySearchTree<T, Compare>::end() const {
+  return values_ + size_;
+}
+
+template<class T, class Compare>
+typename MappedBinarySearchTree<T, Compare>::ConstIterator
+MappedBinarySearchTree<T, Compare>::find(const T& value) const {
+  return FindValue(value);
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+typename MappedBinarySearchTree<T, Compare>::ConstIterator
+MappedBinarySearchTree<T, Compare>::find(const K& key) const {
+  return FindValue(key);
+}
+
+template<class T, class Compare>
+typename MappedBinarySearchTree<T, Compare>::ConstIterator
+MappedBinarySearchTree<T, Compare>::lower_bound(const T& value) const {
+  return std::lower_bound(begin(), end(), value, comp_);
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+typename MappedBinarySearchTree<T, Compare>::ConstIterator
+MappedBinarySearchTree<T, Compare>::lower_bound(const K& key) const {
+  return std::lower_bound(begin(), end(), key, comp_);
+}
+
+template<class T, class Compare>
+typename MappedBinarySearchTree<T, Compare>::ConstIterator
+MappedBinarySearchTree<T, Compare>::upper_bound(const T& value) const {
+  return std::upper_bound(begin(), end(), value, comp_);
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+typename MappedBinarySearchTree<T, Compare>::ConstIterator
+MappedBinarySearchTree<T, Compare>::upper_bound(const K& key) const {
+  return std::upper_bound(begin(), end(), key, comp_);
+}
+
+template<class T, class Compare>
+auto MappedBinarySearchTree<T, Compare>::equal_range(const T& value) const
+    -> std::pair<ConstIterator, ConstIterator> {
+  return std::equal_range(begin(), end(), value, comp_);
+}
+
+template<class T, class Compare>
+template<class K> requires TransparentCompare<Compare>
+auto MappedBinarySearchTree<T, Compare>::equal_range(const K& key) const
+    -> std::pair<ConstIterator, ConstIterator> {
+  return std::equal_range(begin(), end(), key, comp_);
+}
+
+template<class T, class Compare>
+template<class K>
+typename MappedBinarySearchTree<T, Compare>::ConstIterator
+MappedBinarySearchTree<T, Compare>::FindValue(const K& key) const {
+  ConstIterator it = std::lower_bound(begin(), end(), key, comp_);
+  if (it == end() || comp_(key, *it)) {
+    return end();
+  }
+  return it;
+}
+
+template<class T, class Compare>
+void MappedBinarySearchTree<T, Compare>::Unmap() {
+  if (mapping_ != nullptr) {
+    ::munmap(mapping_, mapping_size_);
+  }
+  mapping_ = nullptr;
+  mapping_size_ = 0;
+  values_ = nullptr;
+  size_ = 0;
+}
+
+#endif  // MAPPED_BINARY_SEARCH_TREE_H_
@@ -0,0 +1,272 @@
+#ifndef NODE_POOL_H_
+#define NODE_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+// Slab allocator for fixed-size blocks. Freed blocks go to a free list of
+// their size and alignment and are handed out again before the slab grows.
+// Over-aligned blocks are cut from the slabs too. Not thread-safe.
+class NodePool {
+ public:
+  static constexpr std::size_t kDefaultSlabSize = 64 * 1024;
+
+  explicit NodePool(std::size_t slab_size = kDefaultSlabSize);
+
+  NodePool(const NodePool&) = delete;
+  NodePool& operator=(const NodePool&) = delete;
+
+  ~NodePool();
+
+  void* Allocate(std::size_t size, std::size_t alignment);
+  void Deallocate(void* block, std::size_t size, std::size_t alignment);
+
+  // returns every slab to the global heap, blocks must not be used afterwards
+  void Release();
+
+  std::size_t SlabSize() const;
+  std::size_t SlabCount() const;
+  // total size of the slabs, a slab can be larger than SlabSize() to fit a
+  // large block
+  std::size_t SlabBytes() const;
+
+ private:
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  struct FreeList {
+    std::size_t block_size;
+    std::size_t alignment;
+    FreeBlock* head;
+  };
+
+  static std::size_t BlockAlignment(std::size_t alignment);
+  static std::size_t BlockSize(std::size_t size, std::size_t alignment);
+
+  FreeList& FindFreeList(std::size_t block_size, std::size_t alignment);
+
+  // bytes to skip at slab_cur_ to reach alignment
+  std::size_t Padding(std::size_t alignment) const;
+
+  void AddSlab(std::size_t min_size);
+
+  std::size_t slab_size_;
+  std::vector<void*> slabs_;
+  std::size_t slab_bytes_ = 0;
+  std::vector<FreeList> free_lists_;
+  char* slab_cur_ = nullptr;
+  char* slab_end_ = nullptr;
+};
+
+// std::allocator_traits compatible allocator on top of a shared NodePool.
+// Copies and rebound copies share the pool, so a tree and the nodes it
+// rebinds to allocate from the same slabs.
+template<class T>
+class PoolAllocator {
+  template<class U>
+  friend class PoolAllocator;
+
+ public:
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::false_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+  using is_always_equal = std::false_type;
+
+  PoolAllocator();
+  explicit PoolAllocator(std::size_t slab_size);
+
+  // a moved-from allocator must stay equal to its copy, so moves copy
+  PoolAllocator(const PoolAllocator& rhs) = default;
+  PoolAllocator& operator=(const PoolAllocator& rhs) = default;
+
+  template<class U>
+  PoolAllocator(const PoolAllocator<U>& rhs) noexcept;
+
+  T* allocate(std::size_t n);
+  void deallocate(T* pointer, std::size_t n);
+
+  // a copied container gets a pool of its own
+  PoolAllocator select_on_container_copy_construction() const;
+
+  // frees the whole pool in O(number of slabs) if no one else shares it
+  bool release();
+
+  // bytes held by the pool, free blocks and the unused end of the last
+  // slab included
+  std::size_t slab_bytes() const;
+
+  template<class U>
+  bool operator==(const PoolAllocator<U>& rhs) const;
+  template<class U>
+  bool operator!=(const PoolAllocator<U>& rhs) const;
+
+ private:
+  std::shared_ptr<NodePool> pool_;
+};
+
+// definitions
+
+inline NodePool::NodePool(std::size_t slab_size) : slab_size_(slab_size) {}
+
+inline NodePool::~NodePool() {
+  Release();
+}
+
+inline void* NodePool::Allocate(std::size_t size, std::size_t alignment) {
+  alignment = BlockAlignment(alignment);
+  std::size_t block_size = BlockSize(size, alignment);
+
+  FreeList& free_list = FindFreeList(block_size, alignment);
+  if (free_list.head != nullptr) {
+    FreeBlock* block = free_list.head;
+    free_list.head = block->next;
+    return block;
+  }
+
+  if (static_cast<std::size_t>(slab_end_ - slab_cur_) <
+      Padding(alignment) + block_size) {
+    // slabs are only max_align_t aligned, leave room to align the block
+    AddSlab(block_size + alignment - alignof(std::max_align_t));
+  }
+  char* block = slab_cur_ + Padding(alignment);
+  slab_cur_ = block + block_size;
+  return block;
+}
+
+inline void NodePool::Deallocate(void* block, std::size_t size,
+                                 std::size_t alignment) {
+  alignment = BlockAlignment(alignment);
+  FreeList& free_list =
+      FindFreeList(BlockSize(size, alignment), alignment);
+  free_list.head = new(block) FreeBlock{free_list.head};
+}
+
+inline void NodePool::Release() {
+  for (void* slab : slabs_) {
+    ::operator delete(slab, std::align_val_t(alignof(std::max_align_t)));
+  }
+  slabs_.clear();
+  slab_bytes_ = 0;
+  free_lists_.clear();
+  slab_cur_ = nullptr;
+  slab_end_ = nullptr;
+}
+
+inline std::size_t NodePool::SlabSize() const {
+  return slab_size_;
+}
+
+inline std::size_t NodePool::SlabCount() const {
+  return slabs_.size();
+}
+
+inline std::size_t NodePool::SlabBytes() const {
+  return slab_bytes_;
+}
+
+inline std::size_t NodePool::BlockAlignment(std::size_t alignment) {
+  // every block is at least max_align_t aligned, so it can be reused for
+  // any type that is not over-aligned
+  return alignment < alignof(std::max_align_t) ? alignof(std::max_align_t)
+                                               : alignment;
+}
+
+inline std::size_t NodePool::BlockSize(std::size_t size,
+                                       std::size_t alignment) {
+  std::size_t block_size =
+      size < sizeof(FreeBlock) ? sizeof(FreeBlock) : size;
+  return (block_size + alignment - 1) / alignment * alignment;
+}
+
+inline NodePool::FreeList& NodePool::FindFreeList(std::size_t block_size,
+                                                  std::size_t alignment) {
+  // a tree allocates one or two block sizes, a linear scan is enough
+  for (FreeList& free_list : free_lists_) {
+    if (free_list.block_size == block_size &&
+        free_list.alignment == alignment) {
+      return free_list;
+    }
+  }
+  free_lists_.push_back({block_size, alignment, nullptr});
+  return free_lists_.back();
+}
+
+inline std::size_t NodePool::Padding(std::size_t alignment) const {
+  auto address = reinterpret_cast<std::uintptr_t>(slab_cur_);
+  return (alignment - address % alignment) % alignment;
+}
+
+inline void NodePool::AddSlab(std::size_t min_size) {
+  std::size_t size = slab_size_ < min_size ? min_size : slab_size_;
+  slabs_.reserve(slabs_.size() + 1);
+  slab_cur_ = static_cast<char*>(
+      ::operator new(size, std::align_val_t(alignof(std::max_align_t))));
+  slab_end_ = slab_cur_ + size;
+  slabs_.push_back(slab_cur_);
+  slab_bytes_ += size;
+}
+
+// PoolAllocator
+
+template<class T>
+PoolAllocator<T>::PoolAllocator() : pool_(std::make_shared<NodePool>()) {}
+
+template<class T>
+PoolAllocator<T>::PoolAllocator(std::size_t slab_size) :
+    pool_(std::make_shared<NodePool>(slab_size)) {}
+
+template<class T>
+template<class U>
+PoolAllocator<T>::PoolAllocator(const PoolAllocator<U>& rhs) noexcept :
+    pool_(rhs.pool_) {}
+
+template<class T>
+T* PoolAllocator<T>::allocate(std::size_t n) {
+  return static_cast<T*>(pool_->Allocate(n * sizeof(T), alignof(T)));
+}
+
+template<class T>
+void PoolAllocator<T>::deallocate(T* pointer, std::size_t n) {
+  pool_->Deallocate(pointer, n * sizeof(T), alignof(T));
+}
+
+template<class T>
+PoolAllocator<T> PoolAllocator<T>::select_on_container_copy_construction()
+    const {
+  return PoolAllocator(pool_->SlabSize());
+}
+
+template<class T>
+bool PoolAllocator<T>::release() {
+  if (pool_.use_count() != 1) {
+    return false;
+  }
+  pool_->Release();
+  return true;
+}
+
+template<class T>
+std::size_t PoolAllocator<T>::slab_bytes() const {
+  return pool_->SlabBytes();
+}
+
+template<class T>
+template<class U>
+bool PoolAllocator<T>::operator==(const PoolAllocator<U>& rhs) const {
+  return pool_ == rhs.pool_;
+}
+
+template<class T>
+template<class U>
+bool PoolAllocator<T>::operator!=(const PoolAllocator<U>& rhs) const {
+  return !(*this == rhs);
+}
+
+// -PoolAllocator
+
+#endif  // NODE_POOL_H_
@@ -0,0 +1,882 @@
+#ifndef PERSISTENT_BINARY_SEARCH_TREE_H_
+#define PERSISTENT_BINARY_SEARCH_TREE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "binary_search_tree.h"
+
+// AVL multiset whose copies share nodes. A copy or snapshot() takes O(1):
+// it only counts one more reference to the root. Nodes are reference
+// counted and a node with more than one reference is never changed. Before
+// an insert or erase changes a shared node, it copies the node, so a
+// mutation copies at most the O(log n) nodes on its path and the few it
+// rotates. Nodes owned by one tree alone are changed in place.
+//
+// Iterators carry the path from the root, as there are no parent links in
+// shared nodes. Any insert or erase invalidates the iterators of the tree
+// it is applied to, but not those of its snapshots. Reference counts are
+// atomic, so trees that share nodes may be used from different threads,
+// but one tree is not safe to use from several threads. A copy keeps the
+// allocator of the tree it shares nodes with.
+template<class T, class Compare = std::less<T>,
+    class Allocator = std::allocator<T>>
+class PersistentBinarySearchTree {
+ public:
+  using value_compare = Compare;
+  using allocator_type = Allocator;
+
+  PersistentBinarySearchTree() = default;
+  explicit PersistentBinarySearchTree(const Compare& comp,
+                                      const Allocator& allocator = Allocator());
+
+  PersistentBinarySearchTree(const std::initializer_list<T>& list,
+                             const Compare& comp = Compare(),
+                             const Allocator& allocator = Allocator());
+
+  // O(1), shares all nodes with rhs
+  PersistentBinarySearchTree(const PersistentBinarySearchTree& rhs);
+  PersistentBinarySearchTree(PersistentBinarySearchTree&& rhs) noexcept;
+
+  PersistentBinarySearchTree& operator=(
+      const PersistentBinarySearchTree& rhs);
+  PersistentBinarySearchTree& operator=(
+      PersistentBinarySearchTree&& rhs) noexcept;
+
+  ~PersistentBinarySearchTree();
+
+  // a tree that keeps the current values however this tree changes
+  PersistentBinarySearchTree snapshot() const;
+
+  value_compare value_comp() const;
+  allocator_type get_allocator() const;
+
+  int size() const;
+  bool empty() const;
+
+  // height of the empty tree is 0
+  int height() const;
+
+  bool contains(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  bool contains(const K& key) const;
+
+  int count(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  int count(const K& key) const;
+
+  template<class... Args>
+  void emplace(Args&& ... args);
+
+  template<class U>
+  void insert(U&& value);
+
+  void erase(const T& value);
+  template<class K> requires TransparentCompare<Compare>
+  void erase(const K& key);
+
+  void clear();
+
+  std::vector<T> to_vector() const;
+
+  bool operator==(const PersistentBinarySearchTree& rhs) const;
+  bool operator!=(const PersistentBinarySearchTree& rhs) const;
+
+ private:
+  static constexpr int kMaxHeight = 64;
+
+  struct Node {
+    template<class... Args>
+    explicit Node(Args&& ... args);
+
+    T value;
+    Node* left = nullptr;
+    Node* right = nullptr;
+    int height = 1;
+    // trees and parent nodes pointing here
+    std::atomic<int> references = 1;
+  };
+
+  using NodeAllocator =
+      typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+  using NodeAllocatorTraits = std::allocator_traits<NodeAllocator>;
+
+  // nodes from the root down to the current node, empty for end()
+  struct Path {
+    void Push(const Node* node);
+    const Node* Pop();
+    const Node* Top() const;
+
+    const Node* nodes[kMaxHeight];
+    int depth = 0;
+  };
+
+ public:
+  class ConstIterator {
+    friend class PersistentBinarySearchTree;
+   public:
+    using difference_type = std::ptrdiff_t;
+    using value_type = T;
+    using pointer = const T*;
+    using reference = const T&;
+    using iterator_category = std::bidirectional_iterator_tag;
+
+    ConstIterator() = default;
+
+    const T& operator*() const;
+
+    const T* operator->() const;
+
+    ConstIterator& operator++();
+    ConstIterator operator++(int);
+
+    ConstIterator& operator--();
+    ConstIterator operator--(int);
+
+    bool operator==(const ConstIterator& rhs) const;
+    bool operator!=(const ConstIterator& rhs) const;
+
+   private:
+    ConstIterator(const Path& path, const Node* root);
+
+    Path path_;
+    const Node* root_ = nullptr;
+  };
+  ConstIterator begin() const;
+
+  ConstIterator end() const;
+
+  ConstIterator find(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator find(const K& key) const;
+
+  // first value that is not less than value
+  ConstIterator lower_bound(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator lower_bound(const K& key) const;
+
+  // first value that is greater than value
+  ConstIterator upper_bound(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  ConstIterator upper_bound(const K& key) const;
+
+  std::pair<ConstIterator, ConstIterator> equal_range(const T& value) const;
+  template<class K> requires TransparentCompare<Compare>
+  std::pair<ConstIterator, ConstIterator> equal_range(const K& key) const;
+
+ private:
+  static int Height(const Node* node);
+  static void UpdateHeight(Node* node);
+
+  static void DescendLeftmost(Path* path, const Node* node);
+  static void DescendRightmost(Path* path, const Node* node);
+
+  template<class K>
+  Path FindPath(const K& key) const;
+
+  // path to the first node that goes after key, for the lower bound the
+  // nodes not less than key, for the upper bound the nodes greater than key
+  template<class K>
+  Path BoundPath(const K& key, bool is_upper) const;
+
+  template<class K>
+  int CalcCount(const K& key) const;
+
+  static void Acquire(Node* node);
+  void Release(Node* node);
+
+  // make the node at link owned by this tree alone, copying it if it is
+  // shared, the link is updated before the shared node is let go
+  Node* Unshare(Node*& link);
+
+  // Copies happen on the way down, so the tree is unchanged if one throws.
+  // Rotations on the way up touch only nodes unshared before.
+  void InsertNode(Node*& link, Node* added);
+
+  template<class K>
+  void EraseNode(Node*& link, const K& key);
+
+  // detach the leftmost node below link into *min
+  void EraseMin(Node*& link, Node** min);
+
+  // an erase below node on the given side may rotate the other child and
+  // its inner child, unshare them ahead if it can happen
+  void PrepareErase(Node* node, bool erases_left);
+
+  // return the new root of the subtree, all nodes it moves are unshared
+  Node* Balance(Node* node);
+  Node* RotateLeft(Node* node);
+  Node* RotateRight(Node* node);
+
+  template<class... Args>
+  Node* CreateNode(Args&& ... args);
+  void DestroyNode(Node* node);
+
+  [[no_unique_address]] Compare comp_;
+  [[no_unique_address]] NodeAllocator allocator_;
+  Node* root_ = nullptr;
+  int size_ = 0;
+};
+
+// definitions
+
+template<class T, class Compare, class Allocator>
+template<class... Args>
+PersistentBinarySearchTree<T, Compare, Allocator>::Node::Node
+    (Args&& ... args) : value(std::forward<Args>(args)...) {}
+
+template<class T, class Compare, class Allocator>
+PersistentBinarySearchTree<T, Compare, Allocator>::PersistentBinarySearchTree
+    (const Compare& comp, const Allocator& allocator) :
+    comp_(comp), allocator_(allocator) {}
+
+template<class T, class Compare, class Allocator>
+PersistentBinarySearchTree<T, Compare, Allocator>::PersistentBinarySearchTree
+    (const std::initializer_list<T>& list, const Compare& comp,
+     const Allocator& allocator) :
+    comp_(comp), allocator_(allocator) {
+  for (const T& value : list) {
+    insert(value);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+PersistentBinarySearchTree<T, Compare, Allocator>::PersistentBinarySearchTree
+    (const PersistentBinarySearchTree& rhs) :
+    comp_(rhs.comp_), allocator_(rhs.allocator_), root_(rhs.root_),
+    size_(rhs.size_) {
+  Acquire(root_);
+}
+
+template<class T, class Compare, class Allocator>
+PersistentBinarySearchTree<T, Compare, Allocator>::PersistentBinarySearchTree
+    (PersistentBinarySearchTree&& rhs) noexcept :
+    comp_(std::move(rhs.comp_)), allocator_(std::move(rhs.allocator_)),
+    root_(std::exchange(rhs.root_, nullptr)),
+    size_(std::exchange(rhs.size_, 0)) {}
+
+template<class T, class Compare, class Allocator>
+PersistentBinarySearchTree<T, Compare, Allocator>&
+PersistentBinarySearchTree<T, Compare, Allocator>::operator=
+    (const PersistentBinarySearchTree& rhs) {
+  if (this != &rhs) {
+    PersistentBinarySearchTree copy(rhs);
+    *this = std::move(copy);
+  }
+  return *this;
+}
+
+template<class T, class Compare, class Allocator>
+PersistentBinarySearchTree<T, Compare, Allocator>&
+PersistentBinarySearchTree<T, Compare, Allocator>::operator=
+    (PersistentBinarySearchTree&& rhs) noexcept {
+  if (this != &rhs) {
+    Release(root_);
+    comp_ = std::move(rhs.comp_);
+    allocator_ = std::move(rhs.allocator_);
+    root_ = std::exchange(rhs.root_, nullptr);
+    size_ = std::exchange(rhs.size_, 0);
+  }
+  return *this;
+}
+
+template<class T, class Compare, class Allocator>
+PersistentBinarySearchTree<T, Compare, Allocator>::
+    ~PersistentBinarySearchTree() {
+  Release(root_);
+}
+
+template<class T, class Compare, class Allocator>
+PersistentBinarySearchTree<T, Compare, Allocator>
+PersistentBinarySearchTree<T, Compare, Allocator>::snapshot() const {
+  return *this;
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::value_compare
+PersistentBinarySearchTree<T, Compare, Allocator>::value_comp() const {
+  return comp_;
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::allocator_type
+PersistentBinarySearchTree<T, Compare, Allocator>::get_allocator() const {
+  return Allocator(allocator_);
+}
+
+template<class T, class Compare, class Allocator>
+int PersistentBinarySearchTree<T, Compare, Allocator>::size() const {
+  return size_;
+}
+
+template<class T, class Compare, class Allocator>
+bool PersistentBinarySearchTree<T, Compare, Allocator>::empty() const {
+  return size_ == 0;
+}
+
+template<class T, class Compare, class Allocator>
+int PersistentBinarySearchTree<T, Compare, Allocator>::height() const {
+  return Height(root_);
+}
+
+template<class T, class Compare, class Allocator>
+bool PersistentBinarySearchTree<T, Compare, Allocator>::contains
+    (const T& value) const {
+  return FindPath(value).depth != 0;
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+bool PersistentBinarySearchTree<T, Compare, Allocator>::contains
+    (const K& key) const {
+  return FindPath(key).depth != 0;
+}
+
+template<class T, class Compare, class Allocator>
+int PersistentBinarySearchTree<T, Compare, Allocator>::count
+    (const T& value) const {
+  return CalcCount(value);
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+int PersistentBinarySearchTree<T, Compare, Allocator>::count
+    (const K& key) const {
+  return CalcCount(key);
+}
+
+template<class T, class Compare, class Allocator>
+template<class... Args>
+void PersistentBinarySearchTree<T, Compare, Allocator>::emplace
+    (Args&& ... args) {
+  Node* added = CreateNode(std::forward<Args>(args)...);
+  try {
+    InsertNode(root_, added);
+  } catch (...) {
+    DestroyNode(added);
+    throw;
+  }
+  ++size_;
+}
+
+template<class T, class Compare, class Allocator>
+template<class U>
+void PersistentBinarySearchTree<T, Compare, Allocator>::insert(U&& value) {
+  emplace(std::forward<U>(value));
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentBinarySearchTree<T, Compare, Allocator>::erase
+    (const T& value) {
+  if (contains(value)) {
+    EraseNode(root_, value);
+    --size_;
+  }
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+void PersistentBinarySearchTree<T, Compare, Allocator>::erase(const K& key) {
+  if (contains(key)) {
+    EraseNode(root_, key);
+    --size_;
+  }
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentBinarySearchTree<T, Compare, Allocator>::clear() {
+  Release(std::exchange(root_, nullptr));
+  size_ = 0;
+}
+
+template<class T, class Compare, class Allocator>
+std::vector<T> PersistentBinarySearchTree<T, Compare, Allocator>::to_vector()
+    const {
+  std::vector<T> result;
+  result.reserve(size_);
+  for (const T& value : *this) {
+    result.push_back(value);
+  }
+  return result;
+}
+
+template<class T, class Compare, class Allocator>
+bool PersistentBinarySearchTree<T, Compare, Allocator>::operator==
+    (const PersistentBinarySearchTree& rhs) const {
+  // snapshots that were not changed since share their root
+  return root_ == rhs.root_
+      || (size_ == rhs.size_ && std::equal(begin(), end(), rhs.begin()));
+}
+
+template<class T, class Compare, class Allocator>
+bool PersistentBinarySearchTree<T, Compare, Allocator>::operator!=
+    (const PersistentBinarySearchTree& rhs) const {
+  return !(*this == rhs);
+}
+
+// Path
+
+template<class T, class Compare, class Allocator>
+void PersistentBinarySearchTree<T, Compare, Allocator>::Path::Push
+    (const Node* node) {
+  nodes[depth++] = node;
+}
+
+template<class T, class Compare, class Allocator>
+const typename PersistentBinarySearchTree<T, Compare, Allocator>::Node*
+PersistentBinarySearchTree<T, Compare, Allocator>::Path::Pop() {
+  return nodes[--depth];
+}
+
+template<class T, class Compare, class Allocator>
+const typename PersistentBinarySearchTree<T, Compare, Allocator>::Node*
+PersistentBinarySearchTree<T, Compare, Allocator>::Path::Top() const {
+  return depth == 0 ? nullptr : nodes[depth - 1];
+}
+
+// -Path
+
+// ConstIterator
+
+template<class T, class Compare, class Allocator>
+PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator::
+    ConstIterator(const Path& path, const Node* root) :
+    path_(path), root_(root) {}
+
+template<class T, class Compare, class Allocator>
+const T& PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator::
+    operator*() const {
+  return path_.Top()->value;
+}
+
+template<class T, class Compare, class Allocator>
+const T* PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator::
+    operator->() const {
+  return &path_.Top()->value;
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator&
+PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator::
+    operator++() {
+  const Node* node = path_.Top();
+  if (node->right != nullptr) {
+    DescendLeftmost(&path_, node->right);
+    return *this;
+  }
+  // go up until we come from a left child
+  const Node* child;
+  do {
+    child = path_.Pop();
+  } while (path_.depth != 0 && path_.Top()->right == child);
+  return *this;
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator
+PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator::operator++
+    (int) {
+  ConstIterator old = *this;
+  ++*this;
+  return old;
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator&
+PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator::
+    operator--() {
+  if (path_.depth == 0) {
+    DescendRightmost(&path_, root_);
+    return *this;
+  }
+  const Node* node = path_.Top();
+  if (node->left != nullptr) {
+    DescendRightmost(&path_, node->left);
+    return *this;
+  }
+  // go up until we come from a right child
+  const Node* child;
+  do {
+    child = path_.Pop();
+  } while (path_.depth != 0 && path_.Top()->left == child);
+  return *this;
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator
+PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator::operator--
+    (int) {
+  ConstIterator old = *this;
+  --*this;
+  return old;
+}
+
+template<class T, class Compare, class Allocator>
+bool PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator::
+    operator==(const ConstIterator& rhs) const {
+  return path_.Top() == rhs.path_.Top() && root_ == rhs.root_;
+}
+
+template<class T, class Compare, class Allocator>
+bool PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator::
+    operator!=(const ConstIterator& rhs) const {
+  return !(*this == rhs);
+}
+
+// -ConstIterator
+
+template<class T, class Compare, class Allocator>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator
+PersistentBinarySearchTree<T, Compare, Allocator>::begin() const {
+  Path path;
+  DescendLeftmost(&path, root_);
+  return {path, root_};
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator
+PersistentBinarySearchTree<T, Compare, Allocator>::end() const {
+  return {Path(), root_};
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator
+PersistentBinarySearchTree<T, Compare, Allocator>::find
+    (const T& value) const {
+  return {FindPath(value), root_};
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator
+PersistentBinarySearchTree<T, Compare, Allocator>::find(const K& key) const {
+  return {FindPath(key), root_};
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator
+PersistentBinarySearchTree<T, Compare, Allocator>::lower_bound
+    (const T& value) const {
+  return {BoundPath(value, false), root_};
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator
+PersistentBinarySearchTree<T, Compare, Allocator>::lower_bound
+    (const K& key) const {
+  return {BoundPath(key, false), root_};
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator
+PersistentBinarySearchTree<T, Compare, Allocator>::upper_bound
+    (const T& value) const {
+  return {BoundPath(value, true), root_};
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::ConstIterator
+PersistentBinarySearchTree<T, Compare, Allocator>::upper_bound
+    (const K& key) const {
+  return {BoundPath(key, true), root_};
+}
+
+template<class T, class Compare, class Allocator>
+auto PersistentBinarySearchTree<T, Compare, Allocator>::equal_range
+    (const T& value) const -> std::pair<ConstIterator, ConstIterator> {
+  return {lower_bound(value), upper_bound(value)};
+}
+
+template<class T, class Compare, class Allocator>
+template<class K> requires TransparentCompare<Compare>
+auto PersistentBinarySearchTree<T, Compare, Allocator>::equal_range
+    (const K& key) const -> std::pair<ConstIterator, ConstIterator> {
+  return {lower_bound(key), upper_bound(key)};
+}
+
+template<class T, class Compare, class Allocator>
+int PersistentBinarySearchTree<T, Compare, Allocator>::Height
+    (const Node* node) {
+  return node == nullptr ? 0 : node->height;
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentBinarySearchTree<T, Compare, Allocator>::UpdateHeight
+    (Node* node) {
+  node->height = std::max(Height(node->left), Height(node->right)) + 1;
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentBinarySearchTree<T, Compare, Allocator>::DescendLeftmost
+    (Path* path, const Node* node) {
+  for (; node != nullptr; node = node->left) {
+    path->Push(node);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentBinarySearchTree<T, Compare, Allocator>::DescendRightmost
+    (Path* path, const Node* node) {
+  for (; node != nullptr; node = node->right) {
+    path->Push(node);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::Path
+PersistentBinarySearchTree<T, Compare, Allocator>::FindPath
+    (const K& key) const {
+  Path path;
+  const Node* node = root_;
+  while (node != nullptr) {
+    path.Push(node);
+    if (comp_(key, node->value)) {
+      node = node->left;
+    } else if (comp_(node->value, key)) {
+      node = node->right;
+    } else {
+      return path;
+    }
+  }
+  return Path();
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::Path
+PersistentBinarySearchTree<T, Compare, Allocator>::BoundPath
+    (const K& key, bool is_upper) const {
+  // the bound is the last node where the descent went left, the path to it
+  // is a prefix of the descent
+  Path path;
+  int bound_depth = 0;
+  const Node* node = root_;
+  while (node != nullptr) {
+    path.Push(node);
+    bool goes_left =
+        is_upper ? comp_(key, node->value) : !comp_(node->value, key);
+    if (goes_left) {
+      bound_depth = path.depth;
+      node = node->left;
+    } else {
+      node = node->right;
+    }
+  }
+  path.depth = bound_depth;
+  return path;
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+int PersistentBinarySearchTree<T, Compare, Allocator>::CalcCount
+    (const K& key) const {
+  ConstIterator last(BoundPath(key, true), root_);
+  int count = 0;
+  for (ConstIterator it(BoundPath(key, false), root_); it != last; ++it) {
+    ++count;
+  }
+  return count;
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentBinarySearchTree<T, Compare, Allocator>::Acquire(Node* node) {
+  if (node != nullptr) {
+    node->references.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentBinarySearchTree<T, Compare, Allocator>::Release(Node* node) {
+  // a freed node lets go of its children, the right ones wait on a stack
+  // that never gets deeper than the tree
+  Node* released[kMaxHeight];
+  int released_count = 0;
+  while (node != nullptr) {
+    if (node->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      if (node->right != nullptr) {
+        released[released_count++] = node->right;
+      }
+      Node* left = node->left;
+      DestroyNode(node);
+      node = left;
+    } else {
+      node = nullptr;
+    }
+    if (node == nullptr && released_count != 0) {
+      node = released[--released_count];
+    }
+  }
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::Node*
+PersistentBinarySearchTree<T, Compare, Allocator>::Unshare(Node*& link) {
+  Node* node = link;
+  if (node->references.load(std::memory_order_acquire) == 1) {
+    return node;
+  }
+  Node* copy = CreateNode(node->value);
+  copy->left = node->left;
+  copy->right = node->right;
+  copy->height = node->height;
+  Acquire(copy->left);
+  Acquire(copy->right);
+  link = copy;
+  Release(node);
+  return copy;
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentBinarySearchTree<T, Compare, Allocator>::InsertNode
+    (Node*& link, Node* added) {
+  if (link == nullptr) {
+    link = added;
+    return;
+  }
+  Node* node = Unshare(link);
+  if (comp_(added->value, node->value)) {
+    InsertNode(node->left, added);
+  } else {
+    InsertNode(node->right, added);
+  }
+  link = Balance(node);
+}
+
+template<class T, class Compare, class Allocator>
+template<class K>
+void PersistentBinarySearchTree<T, Compare, Allocator>::EraseNode
+    (Node*& link, const K& key) {
+  Node* node = link;
+  bool goes_left = comp_(key, node->value);
+  if (goes_left || comp_(node->value, key)) {
+    node = Unshare(link);
+    PrepareErase(node, goes_left);
+    EraseNode(goes_left ? node->left : node->right, key);
+    link = Balance(node);
+    return;
+  }
+  if (node->left == nullptr || node->right == nullptr) {
+    Node* child = node->left != nullptr ? node->left : node->right;
+    Acquire(child);
+    link = child;
+    Release(node);
+    return;
+  }
+  node = Unshare(link);
+  PrepareErase(node, false);
+  Node* successor;
+  EraseMin(node->right, &successor);
+  successor->left = std::exchange(node->left, nullptr);
+  successor->right = std::exchange(node->right, nullptr);
+  DestroyNode(node);
+  link = Balance(successor);
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentBinarySearchTree<T, Compare, Allocator>::EraseMin
+    (Node*& link, Node** min) {
+  Node* node = Unshare(link);
+  if (node->left == nullptr) {
+    *min = node;
+    link = std::exchange(node->right, nullptr);
+    return;
+  }
+  PrepareErase(node, true);
+  EraseMin(node->left, min);
+  link = Balance(node);
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentBinarySearchTree<T, Compare, Allocator>::PrepareErase
+    (Node* node, bool erases_left) {
+  Node*& sibling_link = erases_left ? node->right : node->left;
+  const Node* erased_side = erases_left ? node->left : node->right;
+  if (Height(sibling_link) <= Height(erased_side)) {
+    return;
+  }
+  // the sibling is the pivot of a rotation, its inner child too if the
+  // rotation is double
+  Node* sibling = Unshare(sibling_link);
+  Node*& inner = erases_left ? sibling->left : sibling->right;
+  const Node* outer = erases_left ? sibling->right : sibling->left;
+  if (Height(inner) > Height(outer)) {
+    Unshare(inner);
+  }
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::Node*
+PersistentBinarySearchTree<T, Compare, Allocator>::Balance(Node* node) {
+  UpdateHeight(node);
+  int balance = Height(node->left) - Height(node->right);
+  if (balance > 1) {
+    if (Height(node->left->left) < Height(node->left->right)) {
+      node->left = RotateLeft(node->left);
+    }
+    return RotateRight(node);
+  }
+  if (balance < -1) {
+    if (Height(node->right->right) < Height(node->right->left)) {
+      node->right = RotateRight(node->right);
+    }
+    return RotateLeft(node);
+  }
+  return node;
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::Node*
+PersistentBinarySearchTree<T, Compare, Allocator>::RotateLeft(Node* node) {
+  Node* pivot = node->right;
+  node->right = pivot->left;
+  pivot->left = node;
+  UpdateHeight(node);
+  UpdateHeight(pivot);
+  return pivot;
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::Node*
+PersistentBinarySearchTree<T, Compare, Allocator>::RotateRight(Node* node) {
+  Node* pivot = node->left;
+  node->left = pivot->right;
+  pivot->right = node;
+  UpdateHeight(node);
+  UpdateHeight(pivot);
+  return pivot;
+}
+
+template<class T, class Compare, class Allocator>
+template<class... Args>
+typename PersistentBinarySearchTree<T, Compare, Allocator>::Node*
+PersistentBinarySearchTree<T, Compare, Allocator>::CreateNode
+    (Args&& ... args) {
+  Node* node = NodeAllocatorTraits::allocate(allocator_, 1);
+  try {
+    NodeAllocatorTraits::construct(allocator_, node,
+                                   std::forward<Args>(args)...);
+  } catch (...) {
+    NodeAllocatorTraits::deallocate(allocator_, node, 1);
+    throw;
+  }
+  return node;
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentBinarySearchTree<T, Compare, Allocator>::DestroyNode
+    (Node* node) {
+  NodeAllocatorTraits::destroy(allocator_, node);
+  NodeAllocatorTraits::deallocate(allocator_, node, 1);
+}
+
+#endif  // PERSISTENT_BINARY_SEARCH_TREE_H_